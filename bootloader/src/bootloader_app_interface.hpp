@@ -31,7 +31,7 @@ namespace bootloader_app_interface
  */
 struct AppShared
 {
-    std::uint32_t reserved_a = 0;                               ///< Reserved for future use
+    std::uint32_t reserved_a = 0;                               ///< Flags below; other bits reserved for future use
     std::uint32_t reserved_b = 0;                               ///< Reserved for future use
 
     /*
@@ -48,10 +48,20 @@ struct AppShared
      * General part
      */
     bool stay_in_bootloader = false;
+
+    /*
+     * Flags in reserved_a; the older bootloaders ignore them, so the layout stays compatible
+     */
+    /// Warm boot hint: the application is restarted on command, so the boot delay is not needed
+    static constexpr std::uint32_t FlagSkipBootDelay = 1U << 0;
+
+    bool getFlag(std::uint32_t flag) const { return (reserved_a & flag) != 0; }
+    void setFlag(std::uint32_t flag)       { reserved_a |= flag; }
 };
 
 
 static_assert(sizeof(AppShared) <= 240, "AppShared may be larger than the amount of allocated memory");
+static_assert(sizeof(AppShared) == 216, "The layout of AppShared must match the deployed bootloaders and applications");
 
 
 static inline auto makeMarshaller()
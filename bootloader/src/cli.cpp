@@ -19,6 +19,7 @@
 
 #include "usb_cdc.hpp"
 #include "cli.hpp"
+#include "windowed_upload.hpp"
 #include <board/board.hpp>
 #include <unistd.h>
 #include <cstdio>
@@ -137,6 +138,41 @@ class DownloadCommand : public os::shell::ICommandHandler
 } static cmd_download;
 
 
+/**
+ * Faster alternative to the command download, see windowed_upload.hpp.
+ * The image CRC is verified by the bootloader against the application descriptor; it is printed so that the host
+ * could compare it with the CRC of the image it has sent.
+ */
+class UploadCommand : public os::shell::ICommandHandler
+{
+    const char* getName() const override { return "upload"; }
+
+    void execute(os::shell::BaseChannelWrapper& ios, int, char**) override
+    {
+        assert(g_bootloader_ != nullptr);
+
+        windowed_upload::Receiver loader(ios.getChannel());
+
+        int res = g_bootloader_->upgradeApp(loader);
+        if (res < 0)
+        {
+            ios.print("ERROR %d\n", res);
+            return;
+        }
+
+        const auto appinfo = g_bootloader_->getAppInfo();
+        if (!appinfo.second)
+        {
+            ios.print("ERROR image is not valid\n");
+            return;
+        }
+
+        ios.print("image_crc: 0x%08x%08x\n",
+                  unsigned(appinfo.first.image_crc >> 32), unsigned(appinfo.first.image_crc & 0xFFFFFFFFU));
+    }
+} static cmd_upload;
+
+
 class CLIThread : public chibios_rt::BaseStaticThread<2048>
 {
     os::shell::Shell<> shell_;
@@ -178,6 +214,7 @@ public:
         shell_.addCommandHandler(&cmd_state);
         shell_.addCommandHandler(&cmd_wait);
         shell_.addCommandHandler(&cmd_download);
+        shell_.addCommandHandler(&cmd_upload);
     }
 } cli_thread;
 
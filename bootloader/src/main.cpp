@@ -23,6 +23,8 @@
 #include <cstring>
 #include <cstdio>
 #include <cstdlib>
+#include <algorithm>
+#include <iterator>
 #include <zubax_chibios/os.hpp>
 #include <zubax_chibios/platform/stm32/flash_writer.hpp>
 #include <zubax_chibios/bootloader/bootloader.hpp>
@@ -30,6 +32,7 @@
 #include "board/board.hpp"
 #include "usb_cdc.hpp"
 #include "cli.hpp"
+#include "windowed_upload.hpp"
 #include "bootloader_app_interface.hpp"
 
 
@@ -43,6 +46,91 @@ namespace
  */
 constexpr unsigned WatchdogTimeoutMSec = 5000;
 
+/**
+ * Programs the flash in the background, so that the next block can be received while the previous one is being
+ * written. There is only one job buffer; together with the buffer of the downloader, this makes a double buffer.
+ * Only the programming is done in the background; erasing stalls the CPU completely, it is done synchronously in order
+ * to not lose incoming data.
+ */
+class FlashWriteBehindThread : public chibios_rt::BaseStaticThread<512>
+{
+    /*
+     * The job is programmed one half-word per call, because the flash writer may lock the system for the duration
+     * of the call; one programming operation takes less time than the reception of one byte via UART at 115200 baud.
+     */
+    static constexpr unsigned ChunkSize = 2;
+
+    std::size_t address_ = 0;
+    std::size_t size_ = 0;
+    alignas(4) std::uint8_t buffer_[windowed_upload::MaxChunkSize];     ///< Largest block of all downloaders
+
+    bool failed_ = false;
+
+    chibios_rt::BinarySemaphore job_ready_{true};
+    chibios_rt::BinarySemaphore idle_{false};
+
+    void main() override
+    {
+        while (true)
+        {
+            (void)job_ready_.wait(TIME_INFINITE);
+
+            os::stm32::FlashWriter writer;
+            for (std::size_t pos = 0; pos < size_; pos += ChunkSize)
+            {
+                const std::size_t chunk = std::min<std::size_t>(ChunkSize, size_ - pos);
+                if (!writer.write(reinterpret_cast<const void*>(address_ + pos), &buffer_[pos], chunk))
+                {
+                    failed_ = true;
+                    break;
+                }
+            }
+
+            idle_.signal();
+        }
+    }
+
+public:
+    static constexpr unsigned MaxJobSize = sizeof(buffer_);
+
+    /**
+     * Waits until the previous job is finished, then starts the new one.
+     * @return False if any of the previous jobs has failed; the new job is not started in this case.
+     */
+    bool submit(const std::size_t address, const void* const data, const std::size_t size)
+    {
+        assert(size <= MaxJobSize);
+        (void)idle_.wait(TIME_INFINITE);
+        if (failed_)
+        {
+            idle_.signal();
+            return false;
+        }
+        address_ = address;
+        size_ = size;
+        std::memcpy(&buffer_[0], data, size);
+        job_ready_.signal();
+        return true;
+    }
+
+    /**
+     * Waits until there are no pending jobs.
+     * @return False if any of the jobs has failed since the last reset.
+     */
+    bool waitIdle()
+    {
+        (void)idle_.wait(TIME_INFINITE);
+        idle_.signal();
+        return !failed_;
+    }
+
+    void resetError()
+    {
+        (void)waitIdle();
+        failed_ = false;
+    }
+} flash_write_behind_thread;
+
 /**
  * This class contains logic and hardcoded values that are SPECIFIC FOR THIS PARTICULAR MCU AND APPLICATION.
  */
@@ -50,6 +138,14 @@ class AppStorageBackend : public bootloader::IAppStorageBackend
 {
     static constexpr unsigned FlashPageSize = 2048;
     static constexpr unsigned ApplicationAddress = FLASH_BASE + APPLICATION_OFFSET;
+    static constexpr unsigned MaxFlashSize = 256 * 1024;
+
+    /*
+     * The pages that have been erased or found blank since the beginning of the upgrade, so that each page is
+     * checked and erased at most once. The image size is not known in advance, hence the pages are erased on the
+     * first write rather than all at once.
+     */
+    std::uint8_t erased_pages_[MaxFlashSize / FlashPageSize / 8] = {};
 
     static unsigned getFlashSize()
     {
@@ -71,37 +167,102 @@ class AppStorageBackend : public bootloader::IAppStorageBackend
         return true;
     }
 
+    static bool isPageBlank(const std::size_t page_address)
+    {
+        const auto* const words = reinterpret_cast<const std::uint32_t*>(page_address);
+        for (unsigned i = 0; i < (FlashPageSize / 4); i++)
+        {
+            if (words[i] != 0xFFFFFFFFU)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Makes sure that all pages covered by the specified range are erased; the range must be within the flash.
+     */
+    bool erasePagesOnce(const std::size_t address, const std::size_t size)
+    {
+        os::stm32::FlashWriter writer;
+
+        for (std::size_t page = (address - FLASH_BASE) / FlashPageSize;
+             page <= ((address + size - 1) - FLASH_BASE) / FlashPageSize;
+             page++)
+        {
+            assert(page < (MaxFlashSize / FlashPageSize));
+            auto& byte = erased_pages_[page / 8];
+            const std::uint8_t bit = std::uint8_t(1U << (page % 8));
+            if ((byte & bit) != 0)
+            {
+                continue;
+            }
+
+            const std::size_t page_address = FLASH_BASE + page * FlashPageSize;
+            if (!isPageBlank(page_address))
+            {
+                DEBUG_LOG("Erasing page at %x\n", page_address);
+                if (!writer.erasePageAt(page_address))
+                {
+                    return false;
+                }
+            }
+            byte |= bit;
+        }
+
+        return true;
+    }
+
 public:
     static constexpr std::int16_t ErrEraseFailed = 9001;
     static constexpr std::int16_t ErrWriteFailed = 9002;
 
-    int beginUpgrade()   override { return 0; }
-    int endUpgrade(bool) override { return 0; }
+    int beginUpgrade() override
+    {
+        flash_write_behind_thread.resetError();
+        std::fill(std::begin(erased_pages_), std::end(erased_pages_), 0);
+        return 0;
+    }
+
+    int endUpgrade(bool) override
+    {
+        return flash_write_behind_thread.waitIdle() ? 0 : -ErrWriteFailed;
+    }
 
     int write(std::size_t offset, const void* data, std::size_t size) override
     {
-        if (!correctOffsetAndSize(offset, size))
+        if (!correctOffsetAndSize(offset, size) || (size == 0))
         {
             return 0;
         }
-        os::stm32::FlashWriter writer;
 
-        // Blank check byte-by-byte, erase page only if needed
-        for (std::size_t blank_check_pos = offset; blank_check_pos < (offset + size); blank_check_pos++)
+        // The previous block must be written before the pages are erased, in case it shares the page
+        if (!flash_write_behind_thread.waitIdle())
         {
-            if (UNLIKELY(*reinterpret_cast<const std::uint8_t*>(blank_check_pos) != 0xFF))
+            return -ErrWriteFailed;
+        }
+
+        if (!erasePagesOnce(offset, size))
+        {
+            return -ErrEraseFailed;
+        }
+
+        /*
+         * Write; the result of the background write is reported with the next call.
+         * Blocks larger than the job buffer are split into several jobs, so that every write is chunked, see
+         * FlashWriteBehindThread.
+         */
+        const auto bytes = static_cast<const std::uint8_t*>(data);
+        for (std::size_t pos = 0; pos < size; pos += FlashWriteBehindThread::MaxJobSize)
+        {
+            const std::size_t job_size = std::min<std::size_t>(FlashWriteBehindThread::MaxJobSize, size - pos);
+            if (!flash_write_behind_thread.submit(offset + pos, bytes + pos, job_size))
             {
-                DEBUG_LOG("Erasing page at %x\n", blank_check_pos);
-                const bool ok = writer.erasePageAt(blank_check_pos);
-                if (!ok)
-                {
-                    return -ErrEraseFailed;
-                }
+                return -ErrWriteFailed;
             }
         }
-
-        // Write
-        return writer.write(reinterpret_cast<const void*>(offset), data, size) ? size : -ErrWriteFailed;
+        return int(size);
     }
 
     int read(std::size_t offset, void* data, std::size_t size) override
@@ -110,6 +271,7 @@ public:
         {
             return 0;
         }
+        (void)flash_write_behind_thread.waitIdle();     // The data being read may not be written yet
         std::memmove(data, reinterpret_cast<const void*>(offset), size);
         return size;
     }
@@ -169,27 +331,35 @@ int main()
     /*
      * Bootloader logic initialization
      */
-    app::AppStorageBackend backend;
-
-    bootloader::Bootloader bl(backend);
+    app::flash_write_behind_thread.start(LOWPRIO);
 
-    cli::init(bl);
+    app::AppStorageBackend backend;
 
     /*
-     * Parsing the app shared struct
+     * Parsing the app shared struct; it is done before the bootloader is constructed because of the warm boot hint
      */
     const auto app_shared = bootloader_app_interface::readAndErase();
-    if (app_shared.second)
+    if (!app_shared.second)
     {
-        if (app_shared.first.stay_in_bootloader)
-        {
-            DEBUG_LOG("Boot cancelled by apps request\n");
-            bl.cancelBoot();
-        }
+        DEBUG_LOG("App shared struct not found\n");
     }
-    else
+
+    const bool warm_boot = app_shared.second &&
+                           app_shared.first.getFlag(bootloader_app_interface::AppShared::FlagSkipBootDelay);
+    if (warm_boot)
     {
-        DEBUG_LOG("App shared struct not found\n");
+        DEBUG_LOG("Warm boot, no boot delay\n");
+    }
+
+    bootloader::Bootloader bl(backend, 0xFFFFFFFFU,
+                              warm_boot ? 0U : bootloader::Bootloader::DefaultBootDelayMSec);
+
+    cli::init(bl);
+
+    if (app_shared.second && app_shared.first.stay_in_bootloader)
+    {
+        DEBUG_LOG("Boot cancelled by apps request\n");
+        bl.cancelBoot();
     }
 
     /*
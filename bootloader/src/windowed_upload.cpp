@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2016  Zubax Robotics  <info@zubax.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+#include "windowed_upload.hpp"
+#include <ch.hpp>
+
+namespace windowed_upload
+{
+namespace
+{
+/// Kept out of the stack, which is tight in the CLI thread
+std::uint8_t chunk_buffer_[BufferSize];
+
+/**
+ * See the template parameter Port of receive().
+ */
+class ChannelPort
+{
+    ::BaseChannel* const channel_;
+    ::systime_t timer_started_at_ = 0;
+
+public:
+    explicit ChannelPort(::BaseChannel* channel) :
+        channel_(channel)
+    { }
+
+    unsigned read(std::uint8_t* const data, const unsigned size, const unsigned timeout_msec)
+    {
+        return unsigned(chnReadTimeout(channel_, data, size, MS2ST(timeout_msec)));
+    }
+
+    void write(const std::uint8_t* const data, const unsigned size)
+    {
+        (void)chnWriteTimeout(channel_, data, size, MS2ST(ByteTimeoutMSec));
+    }
+
+    void restartTimer() { timer_started_at_ = chVTGetSystemTime(); }
+
+    bool isTimerExpired(const unsigned timeout_msec) const
+    {
+        return chVTTimeElapsedSinceX(timer_started_at_) > MS2ST(timeout_msec);
+    }
+};
+
+}
+
+int Receiver::download(bootloader::IDownloadStreamSink& sink)
+{
+    ChannelPort port(channel_);
+    return receive(port, sink, &chunk_buffer_[0]);
+}
+
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2016  Zubax Robotics  <info@zubax.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+#pragma once
+
+#include "windowed_upload_protocol.hpp"
+#include <zubax_chibios/bootloader/bootloader.hpp>
+#include <hal.h>
+
+namespace windowed_upload
+{
+/**
+ * Receiver of the windowed upload protocol over a ChibiOS channel, see windowed_upload_protocol.hpp.
+ */
+class Receiver : public bootloader::IDownloader
+{
+    ::BaseChannel* const channel_;
+
+public:
+    explicit Receiver(::BaseChannel* channel) :
+        channel_(channel)
+    { }
+
+    int download(bootloader::IDownloadStreamSink& sink) override;
+};
+
+}
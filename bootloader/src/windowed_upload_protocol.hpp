@@ -0,0 +1,189 @@
+/*
+ * Copyright (C) 2016  Zubax Robotics  <info@zubax.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+#pragma once
+
+#include <cstdint>
+
+/**
+ * Windowed binary upload protocol, a faster alternative to YMODEM intended for USB CDC, where the stop-and-wait
+ * acknowledgement per block makes the transfer latency bound. The host may send multiple chunks without waiting
+ * for the acknowledgements; lost or damaged chunks are retransmitted using the go-back-N scheme.
+ * A chunk is acknowledged after it has been written, and erasing flash stalls the CPU. USB flow control holds the
+ * following chunks meanwhile, but UART input is lost, so over UART the host must wait for every acknowledgement.
+ * The sender is tools/upload/babel_upload.py.
+ *
+ * Host to device, a chunk (all values are little endian):
+ *  <sync:u8 = 0x5A> <seq:u16> <len:u16> <data:u8[len]> <crc:u32>
+ * The sequence number starts from zero and wraps around. The chunks are written in the order of sequence numbers,
+ * each right after the previous one; the recommended length is MaxChunkSize (two flash pages), the bigger lengths
+ * are not allowed. A chunk of zero length marks the end of the image.
+ * The CRC is CRC-32 (IEEE 802.3) of the sequence number, the length, and the data.
+ *
+ * Device to host, a response:
+ *  <code:u8> <seq:u16>
+ * Codes:
+ *  'R' - ready to receive the chunk seq (that is zero); sent once at the beginning
+ *  'A' - the chunk seq has been written; duplicates of the already written chunks are acknowledged again
+ *  'N' - a damaged or out of order chunk was received; the host must resend starting from the chunk seq.
+ *        It is sent only once until the transfer makes progress, so the host must also resend the unacknowledged
+ *        chunks if there was no response for a while.
+ *  'F' - the end of the image has been received; the bootloader verifies the image CRC afterwards
+ *  'E' - the transfer is aborted because of a storage error or timeout
+ *
+ * This header does not depend on the OS, so that it can be used on the host as well.
+ */
+namespace windowed_upload
+{
+
+static constexpr unsigned MaxChunkSize = 4096;
+
+static constexpr std::uint8_t SyncByte = 0x5A;
+static constexpr unsigned HeaderSize = 4;                   ///< Sequence number and length
+static constexpr unsigned CRCSize = 4;
+static constexpr unsigned BufferSize = HeaderSize + MaxChunkSize + CRCSize;
+
+static constexpr unsigned ByteTimeoutMSec = 100;            ///< Maximum pause inside a chunk
+static constexpr unsigned IdleTimeoutMSec = 5000;           ///< Maximum time without progress
+
+static constexpr std::int16_t ErrTimeout = 9101;
+
+/**
+ * CRC-32 (IEEE 802.3), reflected, nibble-wise table to keep the memory footprint low.
+ */
+class CRC32
+{
+    std::uint32_t value_ = 0xFFFFFFFFU;
+
+public:
+    void add(const std::uint8_t* data, unsigned len)
+    {
+        static const std::uint32_t Table[] =
+        {
+            0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+            0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+        };
+        while (len --> 0)
+        {
+            value_ ^= *data++;
+            value_ = (value_ >> 4) ^ Table[value_ & 0x0FU];
+            value_ = (value_ >> 4) ^ Table[value_ & 0x0FU];
+        }
+    }
+
+    std::uint32_t get() const { return value_ ^ 0xFFFFFFFFU; }
+};
+
+/**
+ * Receives the image and passes the chunks to the sink in order.
+ * @tparam Port     Provides the following methods:
+ *                      unsigned read(std::uint8_t* data, unsigned size, unsigned timeout_msec);   // Bytes read
+ *                      void write(const std::uint8_t* data, unsigned size);
+ *                      void restartTimer();
+ *                      bool isTimerExpired(unsigned timeout_msec);     // Since the last restartTimer()
+ * @tparam Sink     Provides int handleNextDataChunk(const void* data, std::size_t size), which returns a negative
+ *                  error code on failure, like bootloader::IDownloadStreamSink.
+ * @param buffer    At least BufferSize bytes.
+ * @return Zero on success, negative error code otherwise.
+ */
+template <typename Port, typename Sink>
+int receive(Port& port, Sink& sink, std::uint8_t* const buffer)
+{
+    auto respond = [&port](const char code, const std::uint16_t seq)
+    {
+        const std::uint8_t buf[3] = { std::uint8_t(code), std::uint8_t(seq & 0xFFU), std::uint8_t(seq >> 8) };
+        port.write(&buf[0], sizeof(buf));
+    };
+
+    std::uint16_t expected_seq = 0;
+    bool nak_sent = false;
+    port.restartTimer();
+
+    respond('R', expected_seq);
+
+    while (true)
+    {
+        if (port.isTimerExpired(IdleTimeoutMSec))
+        {
+            respond('E', expected_seq);
+            return -ErrTimeout;
+        }
+
+        // Looking for the beginning of the next chunk; anything else is skipped
+        std::uint8_t sync = 0;
+        if ((port.read(&sync, 1, ByteTimeoutMSec) != 1) || (sync != SyncByte))
+        {
+            continue;
+        }
+
+        bool valid = port.read(buffer, HeaderSize, ByteTimeoutMSec) == HeaderSize;
+
+        const auto seq = std::uint16_t(buffer[0] | (buffer[1] << 8));
+        const unsigned len = unsigned(buffer[2] | (buffer[3] << 8));
+
+        valid = valid && (len <= MaxChunkSize) &&
+                (port.read(buffer + HeaderSize, len + CRCSize, ByteTimeoutMSec) == (len + CRCSize));
+        if (valid)
+        {
+            const std::uint8_t* const p = buffer + HeaderSize + len;
+            const std::uint32_t received_crc = std::uint32_t(p[0]) | (std::uint32_t(p[1]) << 8) |
+                                               (std::uint32_t(p[2]) << 16) | (std::uint32_t(p[3]) << 24);
+            CRC32 crc;
+            crc.add(buffer, HeaderSize + len);
+            valid = crc.get() == received_crc;
+        }
+
+        if (valid && (seq != expected_seq) && (std::uint16_t(expected_seq - seq) < 0x8000U))
+        {
+            respond('A', seq);              // Retransmitted chunk that has already been written
+            continue;
+        }
+
+        if (!valid || (seq != expected_seq))
+        {
+            if (!nak_sent)
+            {
+                respond('N', expected_seq);
+                nak_sent = true;
+            }
+            continue;
+        }
+
+        nak_sent = false;
+        port.restartTimer();
+
+        if (len == 0)
+        {
+            respond('F', seq);
+            return 0;
+        }
+
+        const int res = sink.handleNextDataChunk(buffer + HeaderSize, len);
+        if (res < 0)
+        {
+            respond('E', seq);
+            return res;
+        }
+
+        respond('A', seq);
+        expected_seq++;
+    }
+}
+
+}
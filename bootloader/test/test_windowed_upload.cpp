@@ -0,0 +1,295 @@
+/*
+ * Copyright (C) 2016  Zubax Robotics  <info@zubax.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+#include "test.hpp"
+#include <windowed_upload_protocol.hpp>
+#include <cstring>
+#include <deque>
+#include <random>
+#include <utility>
+#include <vector>
+
+namespace
+{
+
+using windowed_upload::BufferSize;
+using windowed_upload::MaxChunkSize;
+
+/**
+ * Feeds the scripted input to the receiver and records its responses; the clock advances only when a read times out.
+ */
+class FakePort
+{
+    enum { Pause = -1 };
+
+    std::deque<int> input_;
+    std::uint64_t now_msec_ = 0;
+    std::uint64_t timer_started_at_msec_ = 0;
+
+public:
+    std::vector<std::pair<char, std::uint16_t>> responses;
+
+    void feed(const std::vector<std::uint8_t>& data)
+    {
+        input_.insert(input_.end(), data.begin(), data.end());
+    }
+
+    /// The sender stops for a while, so that the current read times out
+    void pause()
+    {
+        input_.push_back(Pause);
+    }
+
+    unsigned read(std::uint8_t* data, const unsigned size, const unsigned timeout_msec)
+    {
+        unsigned n = 0;
+        while ((n < size) && !input_.empty() && (input_.front() != Pause))
+        {
+            data[n++] = std::uint8_t(input_.front());
+            input_.pop_front();
+        }
+        if (n < size)
+        {
+            if (!input_.empty())
+            {
+                input_.pop_front();
+            }
+            now_msec_ += timeout_msec;
+        }
+        return n;
+    }
+
+    void write(const std::uint8_t* data, const unsigned size)
+    {
+        ENFORCE(size == 3);
+        responses.emplace_back(char(data[0]), std::uint16_t(data[1] | (data[2] << 8)));
+    }
+
+    void restartTimer() { timer_started_at_msec_ = now_msec_; }
+
+    bool isTimerExpired(const unsigned timeout_msec) const
+    {
+        return (now_msec_ - timer_started_at_msec_) > timeout_msec;
+    }
+};
+
+struct FakeSink
+{
+    std::vector<std::uint8_t> image;
+    int error = 0;                          ///< Returned instead of accepting the data if negative
+
+    int handleNextDataChunk(const void* data, std::size_t size)
+    {
+        if (error < 0)
+        {
+            return error;
+        }
+        const auto bytes = static_cast<const std::uint8_t*>(data);
+        image.insert(image.end(), bytes, bytes + size);
+        return 0;
+    }
+};
+
+std::vector<std::uint8_t> makeChunk(const std::uint16_t seq, const std::vector<std::uint8_t>& data)
+{
+    std::vector<std::uint8_t> chunk;
+    chunk.push_back(windowed_upload::SyncByte);
+    chunk.push_back(std::uint8_t(seq));
+    chunk.push_back(std::uint8_t(seq >> 8));
+    chunk.push_back(std::uint8_t(data.size()));
+    chunk.push_back(std::uint8_t(data.size() >> 8));
+    chunk.insert(chunk.end(), data.begin(), data.end());
+
+    windowed_upload::CRC32 crc;
+    crc.add(&chunk[1], unsigned(chunk.size() - 1));
+    for (unsigned i = 0; i < 4; i++)
+    {
+        chunk.push_back(std::uint8_t(crc.get() >> (i * 8)));
+    }
+    return chunk;
+}
+
+std::vector<std::uint8_t> makeImage(const unsigned size)
+{
+    std::mt19937 rng(size);
+    std::vector<std::uint8_t> image(size);
+    for (auto& x : image)
+    {
+        x = std::uint8_t(rng());
+    }
+    return image;
+}
+
+std::vector<std::uint8_t> getChunkData(const std::vector<std::uint8_t>& image, const unsigned index,
+                                       const unsigned chunk_size = MaxChunkSize)
+{
+    const unsigned begin = index * chunk_size;
+    const unsigned end = std::min<unsigned>(begin + chunk_size, unsigned(image.size()));
+    return std::vector<std::uint8_t>(image.begin() + begin, image.begin() + end);
+}
+
+int run(FakePort& port, FakeSink& sink)
+{
+    static std::uint8_t buffer[BufferSize];
+    return windowed_upload::receive(port, sink, &buffer[0]);
+}
+
+}
+
+TEST_CASE(UploadCRC32)
+{
+    windowed_upload::CRC32 crc;
+    crc.add(reinterpret_cast<const std::uint8_t*>("123456789"), 9);
+    ENFORCE(crc.get() == 0xCBF43926U);                          // CRC-32 check value
+}
+
+TEST_CASE(UploadInOrder)
+{
+    const auto image = makeImage(MaxChunkSize * 2 + 123);
+    FakePort port;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        port.feed(makeChunk(std::uint16_t(i), getChunkData(image, i)));
+    }
+    port.feed(makeChunk(3, {}));
+
+    FakeSink sink;
+    ENFORCE(run(port, sink) == 0);
+    ENFORCE(sink.image == image);
+
+    const std::vector<std::pair<char, std::uint16_t>> expected = { {'R', 0}, {'A', 0}, {'A', 1}, {'A', 2}, {'F', 3} };
+    ENFORCE(port.responses == expected);
+}
+
+TEST_CASE(UploadDuplicateAndOutOfOrder)
+{
+    const auto image = makeImage(MaxChunkSize * 3);
+    FakePort port;
+    port.feed(makeChunk(0, getChunkData(image, 0)));
+    port.feed(makeChunk(2, getChunkData(image, 2)));        // Chunk 1 was lost; NAK
+    port.feed(makeChunk(2, getChunkData(image, 2)));        // Still out of order; the NAK is not repeated
+    port.feed(makeChunk(1, getChunkData(image, 1)));        // Go-back-N retransmission
+    port.feed(makeChunk(0, getChunkData(image, 0)));        // Duplicate; acknowledged again but not written
+    port.feed(makeChunk(2, getChunkData(image, 2)));
+    port.feed(makeChunk(1, getChunkData(image, 1)));        // Duplicate
+    port.feed(makeChunk(3, {}));
+
+    FakeSink sink;
+    ENFORCE(run(port, sink) == 0);
+    ENFORCE(sink.image == image);
+
+    const std::vector<std::pair<char, std::uint16_t>> expected =
+    {
+        {'R', 0}, {'A', 0}, {'N', 1}, {'A', 1}, {'A', 0}, {'A', 2}, {'A', 1}, {'F', 3}
+    };
+    ENFORCE(port.responses == expected);
+}
+
+TEST_CASE(UploadDamagedChunks)
+{
+    const auto image = makeImage(MaxChunkSize + 1);
+    FakePort port;
+
+    port.feed({ 0x00, 0xFF, 0x13 });                       // Noise before the sync byte is skipped
+
+    auto corrupted = makeChunk(0, getChunkData(image, 0));
+    corrupted[100] ^= 0x01;
+    port.feed(corrupted);                                   // CRC mismatch; NAK
+
+    port.feed(makeChunk(0, getChunkData(image, 0)));
+
+    auto oversized = makeChunk(1, std::vector<std::uint8_t>(MaxChunkSize + 1, 0));
+    oversized.resize(5);                                    // Only the header, the length is invalid
+    port.feed(oversized);
+
+    auto truncated = makeChunk(1, getChunkData(image, 1));
+    truncated.pop_back();
+    port.feed(truncated);                                   // The CRC is incomplete; the read times out
+    port.pause();
+
+    port.feed(makeChunk(1, getChunkData(image, 1)));
+    port.feed(makeChunk(2, {}));
+
+    FakeSink sink;
+    ENFORCE(run(port, sink) == 0);
+    ENFORCE(sink.image == image);
+
+    const std::vector<std::pair<char, std::uint16_t>> expected =
+    {
+        {'R', 0}, {'N', 0}, {'A', 0}, {'N', 1}, {'A', 1}, {'F', 2}
+    };
+    ENFORCE(port.responses == expected);
+}
+
+TEST_CASE(UploadSequenceWrap)
+{
+    // One byte per chunk, so that the sequence number wraps around
+    static constexpr unsigned NumChunks = 0x10000 + 10;
+    const auto image = makeImage(NumChunks);
+
+    FakePort port;
+    for (unsigned i = 0; i < NumChunks; i++)
+    {
+        port.feed(makeChunk(std::uint16_t(i), getChunkData(image, i, 1)));
+    }
+    port.feed(makeChunk(0xFFFF, getChunkData(image, 0xFFFF, 1)));   // Duplicate from before the wraparound
+    port.feed(makeChunk(12, { 0x42 }));                             // Ahead of the expected one
+    port.feed(makeChunk(std::uint16_t(NumChunks), {}));
+
+    FakeSink sink;
+    ENFORCE(run(port, sink) == 0);
+    ENFORCE(sink.image == image);
+
+    ENFORCE(port.responses.size() == (NumChunks + 4));
+    for (unsigned i = 0; i < NumChunks; i++)
+    {
+        ENFORCE(port.responses[i + 1] == std::make_pair('A', std::uint16_t(i)));
+    }
+    ENFORCE(port.responses[NumChunks + 1] == std::make_pair('A', std::uint16_t(0xFFFF)));
+    ENFORCE(port.responses[NumChunks + 2] == std::make_pair('N', std::uint16_t(NumChunks)));
+    ENFORCE(port.responses[NumChunks + 3] == std::make_pair('F', std::uint16_t(NumChunks)));
+}
+
+TEST_CASE(UploadErrors)
+{
+    // Storage error
+    {
+        FakePort port;
+        port.feed(makeChunk(0, { 1, 2, 3 }));
+        FakeSink sink;
+        sink.error = -5;
+        ENFORCE(run(port, sink) == -5);
+        const std::vector<std::pair<char, std::uint16_t>> expected = { {'R', 0}, {'E', 0} };
+        ENFORCE(port.responses == expected);
+    }
+
+    // No progress; the duplicates and the damaged chunks do not count as progress
+    {
+        FakePort port;
+        port.feed(makeChunk(0, { 1, 2, 3 }));
+        for (unsigned i = 0; i < 100; i++)
+        {
+            port.feed(makeChunk(0, { 1, 2, 3 }));
+        }
+        FakeSink sink;
+        ENFORCE(run(port, sink) == -windowed_upload::ErrTimeout);
+        ENFORCE(sink.image.size() == 3);
+        ENFORCE(port.responses.back() == std::make_pair('E', std::uint16_t(1)));
+    }
+}
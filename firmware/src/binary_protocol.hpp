@@ -0,0 +1,278 @@
+/*
+ * Copyright (C) 2015  Zubax Robotics  <info@zubax.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cassert>
+#include "can_frame.hpp"
+
+/**
+ * Compact binary protocol, an optional high-throughput alternative to ASCII SLCAN.
+ * It is enabled by the host with the command B1 and disabled with B0; ASCII SLCAN is always the default.
+ *
+ * Every packet is encoded as follows:
+ *  COBS( <type:u8> <payload> <crc:u16> ) 0x00
+ * The CRC is CRC-16-CCITT (poly 0x1021, initial value 0xFFFF, no reflection, no final XOR),
+ * computed over the type and payload, and appended in little endian byte order.
+ * Since COBS does not produce zero bytes, 0x00 is used as a packet delimiter, which allows the receiver to
+ * resynchronize on any packet boundary.
+ *
+ * Packet types (the same in both directions, unless noted otherwise):
+ *  CANFrames  - the payload is a sequence of frame records, one or more, see below.
+ *  Text       - the payload is an ASCII SLCAN command (host to device) or an ASCII response (device to host),
+ *               exactly as it would be transferred in the ASCII mode, except that the commands are not terminated
+ *               with a carriage return.
+ *  TimeBeacon - device to host only, see the SLCAN command Y. The payload is <sequence:u8> <reference_usec:u64>,
+ *               little endian, where the reference time is the extended timestamp of the moment when the previous
+ *               beacon was passed to the host, or all ones if it is not known.
+ *
+ * Frame record, all values little endian:
+ *  <timestamp_usec:u32> <id:u32> <dlc_flags:u8> <data:u8[dlc]>
+ * The ID field is defined exactly as @ref can::Frame::id, including the flags.
+ * The timestamp is defined exactly as @ref can::RxFrame::timestamp_usec; it is ignored in host-to-device frames.
+ * The lower four bits of the dlc_flags field contain the DLC, the highest bit is the loopback flag.
+ */
+namespace binary_protocol
+{
+
+static constexpr std::uint8_t PacketDelimiter = 0x00;
+
+enum class PacketType : std::uint8_t
+{
+    CANFrames  = 0x01,
+    Text       = 0x02,
+    TimeBeacon = 0x03
+};
+
+static constexpr unsigned TimeBeaconPayloadSize = 9;
+
+static constexpr unsigned FrameRecordHeaderSize = 9;
+static constexpr unsigned MaxFrameRecordSize = FrameRecordHeaderSize + can::Frame::MaxDataLen;
+
+static constexpr std::uint8_t FrameRecordMaskDLC      = 0x0F;
+static constexpr std::uint8_t FrameRecordFlagLoopback = 0x80;
+
+/**
+ * Returns the worst case size of an encoded packet, including the type, CRC, COBS overhead, and the delimiter.
+ */
+constexpr unsigned predictMaxEncodedPacketSize(unsigned payload_size)
+{
+    return (payload_size + 3) + ((payload_size + 3) / 254 + 1) + 1;
+}
+
+/**
+ * CRC-16-CCITT, see the protocol description above.
+ */
+class CRC16
+{
+    std::uint16_t value_ = 0xFFFFU;
+
+public:
+    void add(std::uint8_t byte)
+    {
+        // Allocating in RAM because it's faster; nibble-wise table is used to keep the memory footprint low
+        static std::uint16_t Table[] __attribute__((section(".data"))) =
+        {
+            0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+            0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF
+        };
+        value_ = std::uint16_t((value_ << 4) ^ Table[(value_ >> 12) ^ (byte >> 4)]);
+        value_ = std::uint16_t((value_ << 4) ^ Table[(value_ >> 12) ^ (byte & 0x0FU)]);
+    }
+
+    void add(const std::uint8_t* data, unsigned len)
+    {
+        while (len --> 0)
+        {
+            add(*data++);
+        }
+    }
+
+    std::uint16_t get() const { return value_; }
+};
+
+/**
+ * Streaming packet encoder, writes the encoded packet directly into the output buffer.
+ * The output buffer must be large enough, see @ref predictMaxEncodedPacketSize().
+ */
+class PacketEncoder
+{
+    std::uint8_t* const begin_;
+    std::uint8_t* code_ptr_;
+    std::uint8_t* ptr_;
+    std::uint8_t code_ = 1;
+    CRC16 crc_;
+
+    void addEncoded(const std::uint8_t byte)
+    {
+        if (byte == 0)
+        {
+            *code_ptr_ = code_;
+            code_ptr_ = ptr_++;
+            code_ = 1;
+        }
+        else
+        {
+            *ptr_++ = byte;
+            code_++;
+            if (code_ == 0xFF)
+            {
+                *code_ptr_ = code_;
+                code_ptr_ = ptr_++;
+                code_ = 1;
+            }
+        }
+    }
+
+public:
+    PacketEncoder(std::uint8_t* const out, const PacketType type) :
+        begin_(out),
+        code_ptr_(out),
+        ptr_(out + 1)
+    {
+        add(std::uint8_t(type));
+    }
+
+    void add(const std::uint8_t byte)
+    {
+        crc_.add(byte);
+        addEncoded(byte);
+    }
+
+    void add(const std::uint8_t* data, unsigned len)
+    {
+        while (len --> 0)
+        {
+            add(*data++);
+        }
+    }
+
+    void addU32(const std::uint32_t x)
+    {
+        add(std::uint8_t(x));
+        add(std::uint8_t(x >> 8));
+        add(std::uint8_t(x >> 16));
+        add(std::uint8_t(x >> 24));
+    }
+
+    void addFrameRecord(const can::RxFrame& f)
+    {
+        assert(f.dlc <= can::Frame::MaxDataLen);
+        addU32(f.timestamp_usec);
+        addU32(f.id);
+        add(std::uint8_t(f.dlc | (f.loopback ? FrameRecordFlagLoopback : 0)));
+        add(&f.data[0], f.dlc);
+    }
+
+    /**
+     * Appends the CRC and the delimiter. The encoder must not be used afterwards.
+     * @return Total size of the encoded packet, in bytes.
+     */
+    unsigned finalize()
+    {
+        const std::uint16_t crc = crc_.get();
+        addEncoded(std::uint8_t(crc));
+        addEncoded(std::uint8_t(crc >> 8));
+        *code_ptr_ = code_;
+        *ptr_++ = PacketDelimiter;
+        return unsigned(ptr_ - begin_);
+    }
+};
+
+/**
+ * Decodes the packet in place and validates its CRC.
+ * @param buf       Encoded packet, without the delimiter. On success it will start with the type byte followed
+ *                  by the payload.
+ * @param len       Length of the encoded packet.
+ * @param out_type  Packet type, if the packet is valid.
+ * @return Payload length, which is non-negative, or negative if the packet is malformed.
+ */
+inline int decodePacket(std::uint8_t* const buf, const unsigned len, PacketType& out_type)
+{
+    // COBS decoding; the output pointer never goes ahead of the input pointer, so it can be done in place
+    unsigned in = 0;
+    unsigned out = 0;
+    while (in < len)
+    {
+        const std::uint8_t code = buf[in++];
+        if ((code == 0) || ((in + code - 1U) > len))
+        {
+            return -1;
+        }
+        for (unsigned i = 1; i < code; i++)
+        {
+            buf[out++] = buf[in++];
+        }
+        if ((code < 0xFF) && (in < len))
+        {
+            buf[out++] = 0;
+        }
+    }
+
+    // Type and CRC validation
+    if (out < 3)
+    {
+        return -1;
+    }
+    out -= 2;
+
+    CRC16 crc;
+    crc.add(buf, out);
+    if (crc.get() != std::uint16_t(buf[out] | (buf[out + 1] << 8)))
+    {
+        return -1;
+    }
+
+    out_type = PacketType(buf[0]);
+    return int(out - 1);
+}
+
+/**
+ * Parses one frame record from a decoded packet, advancing the pointer.
+ * @return True if the frame record is valid, false if the record is malformed or truncated.
+ */
+inline bool parseFrameRecord(const std::uint8_t*& ptr, const std::uint8_t* const end, can::Frame& out_frame)
+{
+    if ((ptr + FrameRecordHeaderSize) > end)
+    {
+        return false;
+    }
+
+    // Timestamp is ignored
+    out_frame.id = std::uint32_t(ptr[4]) |
+                  (std::uint32_t(ptr[5]) << 8) |
+                  (std::uint32_t(ptr[6]) << 16) |
+                  (std::uint32_t(ptr[7]) << 24);
+    out_frame.dlc = ptr[8] & FrameRecordMaskDLC;
+    ptr += FrameRecordHeaderSize;
+
+    if ((out_frame.dlc > can::Frame::MaxDataLen) || ((ptr + out_frame.dlc) > end))
+    {
+        return false;
+    }
+
+    for (unsigned i = 0; i < out_frame.dlc; i++)
+    {
+        out_frame.data[i] = *ptr++;
+    }
+    return true;
+}
+
+}
@@ -18,6 +18,7 @@
  */
 
 #include "board.hpp"
+#include "../uart_dma.hpp"
 #include <cstring>
 #include <ch.hpp>
 #include <hal.h>
@@ -98,6 +99,12 @@ os::watchdog::Timer init(unsigned watchdog_timeout_msec, os::config::Param<unsig
     halInit();
     chSysInit();
 
+    /*
+     * STDOUT_SD is the default stdio stream of zubax_chibios until the CLI UART is started below. Its USART has
+     * no pins, but it must be running, otherwise the output would block once the queue is full.
+     */
+    sdStart(&STDOUT_SD, nullptr);
+
     /*
      * Watchdog
      */
@@ -114,15 +121,11 @@ os::watchdog::Timer init(unsigned watchdog_timeout_msec, os::config::Param<unsig
         die();
     }
 
-    /*
-     * ADC
-     */
-    initADC();
-
     /*
      * Serial port
      */
     reconfigureUART(cfg_uart_baudrate.get());
+    os::setStdIOStream(uart_dma::getChannel());
 
     /*
      * Prompt
@@ -133,20 +136,19 @@ os::watchdog::Timer init(unsigned watchdog_timeout_msec, os::config::Param<unsig
     return wdt;
 }
 
+void initDeferred()
+{
+    initADC();
+}
+
 void reconfigureUART(const unsigned baudrate)
 {
-    static SerialConfig config =
-    {
-        0,
-        0,
-        USART_CR2_STOP1_BITS,
-        0
-    };
+    static unsigned current_baudrate = 0;
 
-    if (baudrate != config.speed)
+    if (baudrate != current_baudrate)
     {
-        config.speed = baudrate;
-        sdStart(&STDOUT_SD, &config);
+        current_baudrate = baudrate;
+        uart_dma::start(baudrate);
     }
 }
 
@@ -28,6 +28,13 @@ namespace board
 
 os::watchdog::Timer init(unsigned watchdog_timeout_msec, os::config::Param<unsigned>& cfg_uart_baudrate);
 
+/**
+ * Initialization that is not needed to start the CAN and serial interfaces, such as ADC calibration; it is deferred
+ * in order to start up faster. Can be invoked from any thread once after @ref init().
+ * @ref getBusVoltage() does not return meaningful values until then.
+ */
+void initDeferred();
+
 void reconfigureUART(unsigned baudrate);
 
 __attribute__((noreturn))
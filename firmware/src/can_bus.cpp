@@ -8,12 +8,33 @@
 #include <type_traits>
 #include <algorithm>
 #include <new>
+#include <atomic>
 #include "can_bus.hpp"
+#include "can_queues.hpp"
+#include "can_timings.hpp"
 
 
 #ifndef CAN_IRQ_TRACE
 # define CAN_IRQ_TRACE  0
 #endif
+
+/*
+ * Depths of the software queues, can be overridden from the Makefile.
+ * The RX queues are ring buffers, so their depths must be powers of two.
+ */
+#ifndef CAN_RX_QUEUE_CAPACITY
+# define CAN_RX_QUEUE_CAPACITY          256
+#endif
+#ifndef CAN_HP_RX_QUEUE_CAPACITY
+# define CAN_HP_RX_QUEUE_CAPACITY       128
+#endif
+#ifndef CAN_TX_QUEUE_CAPACITY
+# define CAN_TX_QUEUE_CAPACITY          100
+#endif
+
+static_assert((CAN_RX_QUEUE_CAPACITY <= 0xFFFF) && (CAN_HP_RX_QUEUE_CAPACITY <= 0xFFFF) &&
+              (CAN_TX_QUEUE_CAPACITY <= 0xFFFF), "The queue statistics are 16-bit");
+
 #if CAN_IRQ_TRACE
 # define CAN_IRQ_TRACE_BEGIN(pin)       palSetPad(GPIOA, GPIOA_PIN_##pin)
 # define CAN_IRQ_TRACE_END(pin)       palClearPad(GPIOA, GPIOA_PIN_##pin)
@@ -34,453 +55,644 @@ namespace
 constexpr unsigned IRQPriority = CORTEX_MAX_KERNEL_PRIORITY;
 constexpr unsigned NumTxMailboxes = 3;
 
-class RxQueue
+struct TxItem
 {
-    typedef std::uint8_t Size;
-    static constexpr Size Capacity = 255;
+    Frame frame;
+    std::uint32_t submitted_at_usec = 0;
+    bool pending = false;
+};
 
-    RxFrame buf_[Capacity];
-    Size in_ = 0;
-    Size out_ = 0;
-    Size len_ = 0;
-    Size peak_len_ = 0;
+/*
+ * Internal functions
+ */
+constexpr unsigned DefaultINAKTimeoutMSec = 1000;
 
-public:
-    /**
-     * @retval true - OK, false - Overflow
-     */
-    bool push(const RxFrame& frame)
+/// Leaving the init mode takes 11 recessive bits, which is 1.1 ms at 10 kbps, if the bitrate matches the bus
+constexpr unsigned BitRateDetectionINAKTimeoutMSec = 5;
+
+static_assert(2 * (BitRateDetectionINAKTimeoutMSec + 2) <= BitRateDetectionOverheadMSec, "Overhead is too small");
+
+/**
+ * The timeout is measured in system time rather than in iterations, because a sleep can be longer than requested.
+ */
+bool waitMSRINAKBitStateChange(bool target_state, unsigned timeout_ms)
+{
+    const ::systime_t started_at = chVTGetSystemTime();
+    while (true)
     {
-        buf_[in_] = frame;
-        in_++;
-        if UNLIKELY(in_ >= Capacity)
+        const bool state = (CAN->MSR & CAN_MSR_INAK) != 0;
+        if (state == target_state)
         {
-            in_ = 0;
+            return true;
         }
-        if UNLIKELY(len_ >= Capacity)
+        if (chVTTimeElapsedSinceX(started_at) >= MS2ST(timeout_ms))
         {
-            len_ = Capacity;
-            out_++;
-            if UNLIKELY(out_ >= Capacity)
-            {
-                out_ = 0;
-            }
             return false;
         }
-        len_++;
-        if UNLIKELY(peak_len_ < len_)
-        {
-            peak_len_ = len_;
-        }
-        return true;
+        ::usleep(1000);
     }
+}
+
+/*
+ * Acceptance filter management
+ */
+struct FilterBanks
+{
+    static constexpr unsigned NumBanks = 14;
+
+    std::uint32_t fr1[NumBanks] = {};
+    std::uint32_t fr2[NumBanks] = {};
+    std::uint32_t fm1r = 0;             ///< List mode if set, mask mode otherwise
+    std::uint32_t fs1r = 1;             ///< 32-bit scale if set, 16-bit scale otherwise
+    std::uint32_t fa1r = 1;             ///< By default only the bank 0 is active, and it accepts everything
+    std::uint32_t ffa1r = 0;            ///< FIFO1 if set, FIFO0 otherwise
+};
+
+/// Converts an ID or a mask from the 32-bit filter register format into the 16-bit format
+inline std::uint16_t convertFilterRegisterTo16Bit(const std::uint32_t x)
+{
+    return std::uint16_t(((x >> 16) & 0xFFE0U) |                // STID[10:0]
+                         ((x & CAN_RI0R_RTR) << 3) |
+                         ((x & CAN_RI0R_IDE) << 1) |
+                         ((x >> 18) & 7U));                     // EXID[17:15]
+}
 
-    void pop(RxFrame& out_frame)
+int computeFilterBanks(const AcceptanceFilterConfig* const configs, const unsigned num_configs,
+                       FilterBanks& out_banks)
+{
+    out_banks = FilterBanks();
+
+    if (num_configs == 0)
     {
-        if LIKELY(len_ > 0)
-        {
-            out_frame = buf_[out_];
-            out_++;
-            if UNLIKELY(out_ >= Capacity)
-            {
-                out_ = 0;
-            }
-            len_--;
-        }
-        else { assert(0); }
+        return 0;                       // Default configuration accepts everything
     }
 
-    void reset()
+    if (configs == nullptr)
     {
-        in_ = 0;
-        out_ = 0;
-        len_ = 0;
+        assert(false);
+        return -ErrLogic;
     }
 
-    Size getLength() const    { return len_; }
-    Size getPeakUsage() const { return peak_len_; }
-    Size getCapacity() const  { return Capacity; }
-};
-
-/**
- * Frame makeFrame(unsigned id)
- * {
- *     static unsigned count = 0;
- *     const auto s = std::to_string(count++);
- *     return Frame(id, s.c_str(), s.length());
- * }
- * void flush(TxQueue& q)
- * {
- *     std::cout << "Peak usage: " << q.getPeakUsage() << std::endl;
- *     while (q.peek())
- *     {
- *         std::cout << q.peek()->toString() << std::endl;
- *         q.pop();
- *     }
- * }
- * int main()
- * {
- *     TxQueue ptxq;
- *     ENFORCE(ptxq.getPeakUsage() == 0);
- *     ENFORCE(ptxq.getCapacity() == 30);
- *     ENFORCE(ptxq.peek() == nullptr);
- *     ptxq.push(makeFrame(5));
- *     ptxq.push(makeFrame(3));
- *     ptxq.push(makeFrame(4));
- *     ptxq.push(makeFrame(4));
- *     ptxq.push(makeFrame(2));
- *     ptxq.push(makeFrame(4));
- *     flush(ptxq);
- * }
- */
-class TxQueue
-{
-    static constexpr unsigned Capacity = 100;
+    out_banks.fs1r = 0;
+    out_banks.fa1r = 0;
 
-    struct TxFrame
+    unsigned num_banks = 0;
+    auto allocate_bank = [&](bool list_mode, bool scale_32, bool fifo_1) -> int
     {
-        TxFrame* next = nullptr;
-        Frame frame;
-
-        TxFrame(const Frame& f) : frame(f) { }
+        if (num_banks >= FilterBanks::NumBanks)
+        {
+            return -ErrFilterNumConfigs;
+        }
+        const std::uint32_t bit = 1U << num_banks;
+        out_banks.fa1r  |= bit;
+        out_banks.fm1r  |= list_mode ? bit : 0;
+        out_banks.fs1r  |= scale_32 ? bit : 0;
+        out_banks.ffa1r |= fifo_1 ? bit : 0;
+        return int(num_banks++);
     };
 
-    class Allocator
+    /*
+     * Partially occupied banks are filled up before new ones are allocated; since a bank can be assigned to only
+     * one FIFO, each priority class has its own set of partially occupied banks.
+     * Newly allocated banks are filled with copies of the first filter, so that unused slots don't accept anything
+     * extra.
+     */
+    int list16_banks[2] = { -1, -1 };
+    int mask16_banks[2] = { -1, -1 };
+    int list32_banks[2] = { -1, -1 };
+    unsigned list16_used[2] = { 0, 0 };
+    unsigned mask16_used[2] = { 0, 0 };
+    unsigned list32_used[2] = { 0, 0 };
+
+    for (unsigned i = 0; i < num_configs; i++)
     {
-        union Node
-        {
-            alignas(TxFrame) std::uint8_t data[sizeof(TxFrame)];
-            Node* next;
-        };
+        const auto& cfg = configs[i];
+        const unsigned cls = cfg.high_priority ? 1 : 0;     // High priority frames go into FIFO1
 
-        alignas(Node) std::uint8_t pool_[Capacity * sizeof(TxFrame)];
-        Node* free_list_;
-
-        unsigned used_ = 0;
-        unsigned max_used_ = 0;
+        /*
+         * Conversion into the 32-bit register format, like in libuavcan
+         */
+        std::uint32_t id = 0;
+        std::uint32_t mask = 0;
 
-    public:
-        Allocator() :
-            free_list_(reinterpret_cast<Node*>(pool_))
+        if (cfg.id & Frame::FlagEFF)
         {
-            (void)std::fill_n(pool_, sizeof(pool_), 0);
-            for (unsigned i = 0; (i + 1) < (Capacity - 1 + 1); i++) // -Werror=type-limits
-            {
-                // coverity[dead_error_line : FALSE]
-                free_list_[i].next = free_list_ + i + 1;
-            }
-            free_list_[Capacity - 1].next = nullptr;
+            id   = ((cfg.id   & Frame::MaskExtID) << 3) | CAN_RI0R_IDE;
+            mask = ((cfg.mask & Frame::MaskExtID) << 3);
         }
-
-        template <typename... Args>
-        TxFrame* allocate(Args... args)
+        else
         {
-            if UNLIKELY(free_list_ == nullptr)
-            {
-                return nullptr;
-            }
-
-            void* const pmem = free_list_;
-            free_list_ = free_list_->next;
-
-            // Statistics
-            assert(used_ < Capacity);
-            used_++;
-            if UNLIKELY(used_ > max_used_)
-            {
-                max_used_ = used_;
-            }
-
-            return new (pmem) TxFrame(args...);
+            id   = (cfg.id   & Frame::MaskStdID) << 21;
+            mask = (cfg.mask & Frame::MaskStdID) << 21;
         }
 
-        void deallocate(void* ptr)
+        if (cfg.id & Frame::FlagRTR)
         {
-            if UNLIKELY(ptr == nullptr)
-            {
-                assert(false);
-                return;
-            }
-
-            auto p = static_cast<Node*>(ptr);
-            p->next = free_list_;
-            free_list_ = p;
-
-            // Statistics
-            assert(used_ > 0);
-            used_--;
+            id |= CAN_RI0R_RTR;
+        }
+        if (cfg.mask & Frame::FlagEFF)
+        {
+            mask |= CAN_RI0R_IDE;
+        }
+        if (cfg.mask & Frame::FlagRTR)
+        {
+            mask |= CAN_RI0R_RTR;
         }
 
-        unsigned getPeakNumUsedBlocks() const { return max_used_; }
-    };
+        id &= mask;                     // Bits that are not matched must be zero in list mode
 
-    Allocator allocator_;
-    TxFrame* head_ = nullptr;
+        /*
+         * Selecting the most compact representation.
+         * In 16-bit scale, EXID[14:0] can't be matched; EXID[17:15] of standard frames are compared against zero.
+         */
+        const std::uint16_t id16   = convertFilterRegisterTo16Bit(id);
+        const std::uint16_t mask16 = convertFilterRegisterTo16Bit(mask);
 
-public:
-    bool push(const Frame& frame)
-    {
-        auto* const txf = allocator_.allocate(frame);
-        if UNLIKELY(txf == nullptr)
-        {
-            return false;
-        }
+        const bool fits_16 = (mask & 0x0003FFF8U) == 0;
+        const bool exact_16 = fits_16 && ((mask16 | 7U) == 0xFFFFU) && ((id16 & 0x0FU) == 0);
+        const bool exact_32 = (mask | 1U) == 0xFFFFFFFFU;   // Bit 0 is reserved
 
-        if LIKELY(head_ == nullptr || frame.priorityHigherThan(head_->frame))
+        if (exact_16)
         {
-            txf->next = head_;
-            head_ = txf;
+            int& bank = list16_banks[cls];
+            unsigned& used = list16_used[cls];
+            if (bank < 0 || used >= 4)
+            {
+                bank = allocate_bank(true, false, cls != 0);
+                if (bank < 0)
+                {
+                    return bank;
+                }
+                out_banks.fr1[bank] = out_banks.fr2[bank] = id16 | (std::uint32_t(id16) << 16);
+                used = 0;
+            }
+            auto& reg = (used < 2) ? out_banks.fr1[bank] : out_banks.fr2[bank];
+            const unsigned shift = (used % 2) * 16;
+            reg = (reg & ~(0xFFFFU << shift)) | (std::uint32_t(id16) << shift);
+            used++;
         }
-        else
+        else if (fits_16)
         {
-            auto* p = head_;
-            while (p->next != nullptr)
+            int& bank = mask16_banks[cls];
+            unsigned& used = mask16_used[cls];
+            const std::uint32_t value = id16 | (std::uint32_t(mask16) << 16);
+            if (bank < 0 || used >= 2)
             {
-                if UNLIKELY(frame.priorityHigherThan(p->next->frame))
+                bank = allocate_bank(false, false, cls != 0);
+                if (bank < 0)
                 {
-                    break;
+                    return bank;
                 }
-                p = p->next;
+                out_banks.fr1[bank] = out_banks.fr2[bank] = value;
+                used = 0;
             }
-            txf->next = p->next;
-            p->next = txf;
+            ((used == 0) ? out_banks.fr1[bank] : out_banks.fr2[bank]) = value;
+            used++;
         }
-
-        return true;
-    }
-
-    void pop()
-    {
-        if LIKELY(head_ != nullptr)
+        else if (exact_32)
         {
-            auto next = head_->next;
-            head_->~TxFrame();
-            allocator_.deallocate(head_);
-            head_ = next;
+            int& bank = list32_banks[cls];
+            unsigned& used = list32_used[cls];
+            if (bank < 0 || used >= 2)
+            {
+                bank = allocate_bank(true, true, cls != 0);
+                if (bank < 0)
+                {
+                    return bank;
+                }
+                out_banks.fr1[bank] = out_banks.fr2[bank] = id;
+                used = 0;
+            }
+            ((used == 0) ? out_banks.fr1[bank] : out_banks.fr2[bank]) = id;
+            used++;
         }
         else
         {
-            assert(false);
+            const int bank = allocate_bank(false, true, cls != 0);
+            if (bank < 0)
+            {
+                return bank;
+            }
+            out_banks.fr1[bank] = id;
+            out_banks.fr2[bank] = mask;
         }
     }
 
-    const Frame* peek() const
+    return 0;
+}
+
+/// Must be invoked from ISR or Critical Section
+void loadFilterBanksCS(const FilterBanks& banks)
+{
+    CAN->FMR |= CAN_FMR_FINIT;
+
+    CAN->FMR &= 0xFFFFC0F1;
+    CAN->FMR |= static_cast<std::uint32_t>(27) << 8;    // Refer to the bxCAN macrocell documentation for explanation
+
+    CAN->FA1R = 0;                      // Banks can't be modified while active
+    CAN->FFA1R = banks.ffa1r;
+    CAN->FM1R = banks.fm1r;
+    CAN->FS1R = banks.fs1r;
+
+    for (unsigned i = 0; i < FilterBanks::NumBanks; i++)
     {
-        return (head_ == nullptr) ? nullptr : &head_->frame;
+        CAN->sFilterRegister[i].FR1 = banks.fr1[i];
+        CAN->sFilterRegister[i].FR2 = banks.fr2[i];
     }
 
-    unsigned getPeakUsage() const { return allocator_.getPeakNumUsedBlocks(); }
-    unsigned getCapacity() const { return Capacity; }
-};
+    CAN->FA1R = banks.fa1r;
 
+    CAN->FMR &= ~CAN_FMR_FINIT;
+}
 
-struct Timings
+/**
+ * TODO: use a different synchronization primitive, not semaphore
+ */
+class Event
 {
-    std::uint16_t prescaler = 0;
-    std::uint8_t sjw = 0;
-    std::uint8_t bs1 = 0;
-    std::uint8_t bs2 = 0;
-};
+    chibios_rt::CounterSemaphore sem_;
 
+public:
+    Event() : sem_(0) { }
 
-struct TxItem
-{
-    Frame frame;
-    bool pending = false;
+    void waitForSysTicks(unsigned systicks) { (void)sem_.wait(systicks); }
+
+    void signalI() { sem_.signalI(); }
 };
 
-/*
- * Internal functions
+/**
+ * Signaled when new frames are received and when the channel is closed.
+ * It is not a part of the driver state, because the reader waits on it without holding the RX mutex,
+ * see peekReceived(); so the state may be destroyed while the reader is waiting.
  */
-int computeTimings(const std::uint32_t target_bitrate, Timings& out_timings)
-{
-    if (target_bitrate < 1)
-    {
-        return -ErrInvalidBitRate;
-    }
+Event rx_event_;
 
-    /*
-     * Hardware configuration
-     */
-    const std::uint32_t pclk = STM32_PCLK1;
 
-    static const int MaxBS1 = 16;
-    static const int MaxBS2 = 8;
+/**
+ * Counters updated by the CAN interrupt handlers. All of them have the same priority, and the threads update the
+ * counters only from critical sections, so there is never more than one writer at a time.
+ * The counters are read without a critical section, so that monitoring does not add latency to the interrupts:
+ * every counter is a 32-bit word, which is accessed atomically, and the consistency of the whole set is ensured by
+ * the sequence lock: the sequence number is odd while an update is in progress, and the reader retries if it has
+ * changed while reading. A reader can't block the writer, because the interrupts preempt the threads.
+ * The counters are accumulated into the 64-bit totals of @ref Statistics, see @ref foldStatistics().
+ */
+class ISRCounters
+{
+public:
+    struct Values
+    {
+        std::uint32_t generation = 0;           ///< Incremented on reset
+        std::uint32_t errors = 0;
+        std::uint32_t bus_off_events = 0;
+        std::uint32_t bus_off_recoveries = 0;
+        std::uint32_t bus_off_dropped_frames = 0;
+        std::uint32_t sw_rx_queue_overruns = 0;
+        std::uint32_t hw_rx_queue_overruns = 0;
+        std::uint32_t frames_tx = 0;
+        std::uint32_t frames_rx = 0;
+        std::uint32_t tx_mailbox_peak_usage = 0;
+    };
 
-    /*
-     * Ref. "Automatic Baudrate Detection in CANopen Networks", U. Koppe, MicroControl GmbH & Co. KG
-     *      CAN in Automation, 2003
-     *
-     * According to the source, optimal quanta per bit are:
-     *   Bitrate        Optimal Maximum
-     *   1000 kbps      8       10
-     *   500  kbps      16      17
-     *   250  kbps      16      17
-     *   125  kbps      16      17
-     */
-    const int max_quanta_per_bit = (target_bitrate >= 1000000) ? 10 : 17;
+    typedef std::uint32_t Values::* Counter;
 
-    assert(max_quanta_per_bit <= (MaxBS1 + MaxBS2));
+private:
+    Values values_;
+    volatile std::uint32_t sequence_ = 0;
 
-    static const int MaxSamplePointLocation = 900;
+    void beginUpdate()
+    {
+        sequence_ = sequence_ + 1;
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+    }
 
-    /*
-     * Computing (prescaler * BS):
-     *   BITRATE = 1 / (PRESCALER * (1 / PCLK) * (1 + BS1 + BS2))       -- See the Reference Manual
-     *   BITRATE = PCLK / (PRESCALER * (1 + BS1 + BS2))                 -- Simplified
-     * let:
-     *   BS = 1 + BS1 + BS2                                             -- Number of time quanta per bit
-     *   PRESCALER_BS = PRESCALER * BS
-     * ==>
-     *   PRESCALER_BS = PCLK / BITRATE
-     */
-    const std::uint32_t prescaler_bs = pclk / target_bitrate;
+    void endUpdate()
+    {
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        sequence_ = sequence_ + 1;
+    }
 
-    /*
-     * Searching for such prescaler value so that the number of quanta per bit is highest.
-     */
-    std::uint8_t bs1_bs2_sum = max_quanta_per_bit - 1;
+public:
+    /// Must be invoked from ISR or Critical Section
+    void increment(const Counter counter)
+    {
+        beginUpdate();
+        values_.*counter += 1;
+        endUpdate();
+    }
 
-    while ((prescaler_bs % (1 + bs1_bs2_sum)) != 0)
+    /// Must be invoked from ISR or Critical Section
+    void updateTxMailboxPeakUsage(const std::uint32_t mailbox_index)
     {
-        if (bs1_bs2_sum <= 2)
-        {
-            return -ErrInvalidBitRate;          // No solution
-        }
-        bs1_bs2_sum--;
+        beginUpdate();
+        values_.tx_mailbox_peak_usage = std::max(values_.tx_mailbox_peak_usage, mailbox_index);
+        endUpdate();
     }
 
-    const std::uint32_t prescaler = prescaler_bs / (1 + bs1_bs2_sum);
-    if ((prescaler < 1U) || (prescaler > 1024U))
+    /// Must be invoked from ISR or Critical Section
+    void reset()
     {
-        return -ErrInvalidBitRate;              // No solution
+        beginUpdate();
+        const std::uint32_t generation = values_.generation;
+        values_ = Values();
+        values_.generation = generation + 1;
+        endUpdate();
     }
 
-    /*
-     * Now we have a constraint: (BS1 + BS2) == bs1_bs2_sum.
-     * We need to find the values so that the sample point is as close as possible to the optimal value.
-     *
-     *   Solve[(1 + bs1)/(1 + bs1 + bs2) == 7/8, bs2]  (* Where 7/8 is 0.875, the recommended sample point location *)
-     *   {{bs2 -> (1 + bs1)/7}}
-     *
-     * Hence:
-     *   bs2 = (1 + bs1) / 7
-     *   bs1 = (7 * bs1_bs2_sum - 1) / 8
-     *
-     * Sample point location can be computed as follows:
-     *   Sample point location = (1 + bs1) / (1 + bs1 + bs2)
-     *
-     * Since the optimal solution is so close to the maximum, we prepare two solutions, and then pick the best one:
-     *   - With rounding to nearest
-     *   - With rounding to zero
-     */
-    struct BsPair
-    {
-        std::uint8_t bs1;
-        std::uint8_t bs2;
-        std::uint16_t sample_point_permill;
-
-        BsPair() :
-            bs1(0),
-            bs2(0),
-            sample_point_permill(0)
-        { }
-
-        BsPair(std::uint8_t bs1_bs2_sum, std::uint8_t arg_bs1) :
-            bs1(arg_bs1),
-            bs2(bs1_bs2_sum - bs1),
-            sample_point_permill(1000 * (1 + bs1) / (1 + bs1 + bs2))
+    /// Can be invoked from any context except ISR
+    Values read() const
+    {
+        while (true)
         {
-            assert(bs1_bs2_sum > arg_bs1);
+            const std::uint32_t sequence = sequence_;
+            std::atomic_signal_fence(std::memory_order_seq_cst);
+            const Values out = values_;
+            std::atomic_signal_fence(std::memory_order_seq_cst);
+            if LIKELY(((sequence & 1U) == 0) && (sequence == sequence_))
+            {
+                return out;
+            }
         }
+    }
+} isr_counters_;
 
-        bool isValid() const { return (bs1 >= 1) && (bs1 <= MaxBS1) && (bs2 >= 1) && (bs2 <= MaxBS2); }
-    };
+/**
+ * Queue capacity and peak usage, the latest known values; kept after the interface is closed.
+ * Protected by the critical section, it is only a few words.
+ */
+struct QueueStatistics
+{
+    std::uint16_t tx_queue_capacity       = 0;
+    std::uint16_t tx_queue_peak_usage     = 0;
+    std::uint16_t rx_queue_capacity       = 0;
+    std::uint16_t rx_queue_peak_usage     = 0;
+    std::uint16_t hp_rx_queue_capacity    = 0;
+    std::uint16_t hp_rx_queue_peak_usage  = 0;
+} queue_statistics_;
 
-    BsPair solution(bs1_bs2_sum, ((7 * bs1_bs2_sum - 1) + 4) / 8);      // First attempt with rounding to nearest
+/**
+ * Kept after the interface is closed, so that the capture can be read at any time.
+ * Written from the RX and status change interrupts; accessed from the threads only in a critical section.
+ */
+CaptureBuffer capture_buffer_;
+
+/*
+ * 64-bit totals, which are kept even after the interface is closed.
+ * They are accumulated from the ISR counters by the threads, so they are protected by a mutex rather than by
+ * a critical section.
+ */
+chibios_rt::Mutex statistics_mutex_;
+Statistics statistics_;
+ISRCounters::Values folded_isr_counters_;       ///< The values that have already been added to the totals
 
-    if (solution.sample_point_permill > MaxSamplePointLocation)
+/**
+ * Adds the increments of the ISR counters since the previous call to the totals; the statistics mutex must be locked.
+ * The increments are computed modulo 2^32, so this function must be invoked before any of the counters has been
+ * incremented 2^32 times, see @ref pollStatistics().
+ */
+void foldStatistics()
+{
+    const auto counters = isr_counters_.read();
+    auto& folded = folded_isr_counters_;
+
+    if (counters.generation != folded.generation)       // The counters have been reset by open()
     {
-        solution = BsPair(bs1_bs2_sum, (7 * bs1_bs2_sum - 1) / 8);      // Second attempt with rounding to zero
+        statistics_ = Statistics();
+        folded = ISRCounters::Values();
     }
 
-    /*
-     * Final validation
-     * Helpful Python:
-     * def sample_point_from_btr(x):
-     *     assert 0b0011110010000000111111000000000 & x == 0
-     *     ts2,ts1,brp = (x>>20)&7, (x>>16)&15, x&511
-     *     return (1+ts1+1)/(1+ts1+1+ts2+1)
-     *
-     */
-    if ((target_bitrate != (pclk / (prescaler * (1 + solution.bs1 + solution.bs2)))) || !solution.isValid())
+    auto fold = [&counters, &folded](std::uint64_t& total, const ISRCounters::Counter counter)
     {
-        assert(0);
-        return -ErrLogic;
-    }
+        total += std::uint32_t(counters.*counter - folded.*counter);
+    };
 
-    DEBUG_LOG("Timings: quanta/bit: %d, sample point location: %.1f%%\n",
-              int(1 + solution.bs1 + solution.bs2), float(solution.sample_point_permill) / 10.F);
+    fold(statistics_.errors,                 &ISRCounters::Values::errors);
+    fold(statistics_.bus_off_events,         &ISRCounters::Values::bus_off_events);
+    fold(statistics_.bus_off_recoveries,     &ISRCounters::Values::bus_off_recoveries);
+    fold(statistics_.bus_off_dropped_frames, &ISRCounters::Values::bus_off_dropped_frames);
+    fold(statistics_.sw_rx_queue_overruns,   &ISRCounters::Values::sw_rx_queue_overruns);
+    fold(statistics_.hw_rx_queue_overruns,   &ISRCounters::Values::hw_rx_queue_overruns);
+    fold(statistics_.frames_tx,              &ISRCounters::Values::frames_tx);
+    fold(statistics_.frames_rx,              &ISRCounters::Values::frames_rx);
+    statistics_.tx_mailbox_peak_usage = std::uint8_t(counters.tx_mailbox_peak_usage);
+
+    folded = counters;
+}
 
-    out_timings.prescaler = std::uint16_t(prescaler - 1U);
-    out_timings.sjw = 0;                                        // Which means one
-    out_timings.bs1 = std::uint8_t(solution.bs1 - 1);
-    out_timings.bs2 = std::uint8_t(solution.bs2 - 1);
-    return 0;
+/*
+ * Number of timestamp rollovers since the timer was started, incremented from the timer ISR
+ */
+volatile std::uint32_t timestamp_epoch_ = 0;
+
+void handleTimestampRollover(GPTDriver*)
+{
+    timestamp_epoch_ = timestamp_epoch_ + 1;
+}
+
+/*
+ * Time from the submission of a frame via send() until its successful transmission, in microseconds
+ */
+LatencyHistogram tx_latency_histogram_;
+
+/*
+ * Driver events, see getEventSource()
+ */
+chibios_rt::EvtSource event_source_;
+
+/*
+ * Filter configuration is kept even after the interface is closed
+ */
+FilterBanks filter_banks_;
+
+/*
+ * Kept after the interface is closed like the filters; applied by open(). Protected by the critical section.
+ */
+BusOffRecoveryPolicy bus_off_recovery_policy_;
+
+/*
+ * Delays the bus-off recovery, see BusOffRecoveryPolicy; armed only while the interface is open
+ */
+::virtual_timer_t bus_off_recovery_timer_;
+
+/**
+ * Lower bound of the number of bit times from the capture of the hardware timestamp (which happens at the start of
+ * frame bit) until the end of frame interrupt. Bit stuffing and the interframe space are not accounted for.
+ * The interrupt is raised one bit before the end of the EOF field, a couple more bits are subtracted as a margin.
+ */
+inline unsigned computeMinFrameLengthBits(const Frame& frame)
+{
+    const unsigned overhead = frame.isExtended() ? 64U : 44U;
+    const unsigned data = frame.isRemoteTransmissionRequest() ? 0U : (8U * frame.dlc);
+    return overhead + data - 3U;
 }
 
-bool waitMSRINAKBitStateChange(bool target_state)
+/**
+ * Estimated number of bit times taken by the frame on the bus, including the interframe space, see @ref BusLoad.
+ * The bits from the start of frame until the end of CRC are subject to stuffing; the worst case is one stuff bit
+ * per four bits after the first one.
+ */
+inline unsigned estimateFrameLengthBits(const Frame& frame)
 {
-    constexpr unsigned Timeout = 1000;
-    for (unsigned wait_ack = 0; wait_ack < Timeout; wait_ack++)
-    {
-        const bool state = (CAN->MSR & CAN_MSR_INAK) != 0;
-        if (state == target_state)
-        {
-            return true;
-        }
-        ::usleep(1000);
-    }
-    return false;
+    static constexpr unsigned InterframeSpaceBits = 3;
+    const unsigned data = frame.isRemoteTransmissionRequest() ? 0U : (8U * frame.dlc);
+    const unsigned stuffable = (frame.isExtended() ? 54U : 34U) + data;
+    const unsigned unstuffed = (frame.isExtended() ? 64U : 44U) + data + InterframeSpaceBits;
+    return unstuffed + (stuffable - 1U) / 8U;
 }
 
 /**
- * TODO: use a different synchronization primitive, not semaphore
+ * Frame and bit counters over a one second window, see @ref BusLoad.
+ * A new window begins with the first event after the previous one has expired, so every window covers exactly one
+ * second, although there may be gaps between the windows if the bus is idle.
  */
-class Event
+struct TrafficWindow
 {
-    chibios_rt::CounterSemaphore sem_;
+    static constexpr std::uint32_t DurationUSec = 1000000;
+
+    std::uint32_t started_at_usec = 0;
+    std::uint32_t frames = 0;
+    std::uint32_t bits = 0;
+};
+
+/**
+ * Converts the hardware timestamps captured by the macrocell in the time triggered communication mode (TTCM)
+ * into the common time base of @ref getTimestampUSec().
+ *
+ * The macrocell latches its internal 16-bit counter, which is incremented once per CAN bit time, at the start of
+ * frame bit of every received and transmitted frame. The counter can't be read by software, so its phase is estimated
+ * from the interrupt timestamps: an end of frame interrupt can't occur earlier than the minimum frame length after
+ * the capture, so the estimate follows the lower envelope of the observations immediately, and slowly drifts towards
+ * the later observations in order to track the difference between the bus clock and the local clock.
+ * The result is free from the interrupt latency jitter; the remaining constant offset is irrelevant for time
+ * synchronization.
+ *
+ * Counter values are represented in the 24-bit domain of 1/256 of the bit time.
+ * Must be used from ISR only.
+ */
+class HardwareTimestampConverter
+{
+    static constexpr std::uint32_t SubticksPerBit = 256;
+    static constexpr std::uint32_t CounterMask = (1U << 24) - 1U;
+
+    /// Drift compensation rate is 2^-13 (about 120 ppm), which covers the usual crystal oscillator tolerances
+    static constexpr unsigned MaxDriftRateLog2 = 13;
+
+    /// Larger errors indicate that the phase estimate is lost, e.g. after a long period of silence
+    static constexpr std::int32_t MaxErrorSubticks = 1024 * SubticksPerBit;
+    static constexpr std::uint32_t MaxReferenceAgeUSec = 1000000;
+
+    const std::uint32_t subticks_per_usec_q16_;
+    const std::uint32_t usec_per_subtick_q16_;
+
+    std::uint32_t ref_usec_ = 0;
+    std::uint32_t ref_counter_ = 0;                   ///< Estimated counter value at ref_usec_
+    bool synchronized_ = false;
 
 public:
-    Event() : sem_(0) { }
+    /**
+     * @param pclk_per_bit  Bit time in PCLK cycles, exactly as configured in the bit timing register.
+     */
+    explicit HardwareTimestampConverter(const std::uint32_t pclk_per_bit) :
+        subticks_per_usec_q16_(std::uint32_t((std::uint64_t(STM32_PCLK1) << 24) /
+                                             (std::uint64_t(pclk_per_bit) * 1000000U))),
+        usec_per_subtick_q16_(std::uint32_t((std::uint64_t(pclk_per_bit) * 1000000U * 256U) / STM32_PCLK1))
+    { }
 
-    void waitForSysTicks(unsigned systicks) { (void)sem_.wait(systicks); }
+    /**
+     * @param can_time              The TIME field of the mailbox.
+     * @param isr_timestamp_usec    Timestamp sampled at the entry of the interrupt handler.
+     * @param frame                 The frame the hardware timestamp belongs to.
+     * @return Timestamp of the start of frame, see @ref getTimestampUSec().
+     */
+    std::uint32_t convert(const std::uint16_t can_time, const std::uint32_t isr_timestamp_usec, const Frame& frame)
+    {
+        const std::uint32_t capture = std::uint32_t(can_time) * SubticksPerBit;
+        const std::uint32_t min_elapsed = computeMinFrameLengthBits(frame) * SubticksPerBit;
 
-    void signalI() { sem_.signalI(); }
-};
+        const std::uint32_t since_ref_usec = computeTimestampDeltaUSec(ref_usec_, isr_timestamp_usec);
+        const std::uint32_t since_ref_subticks =
+            std::uint32_t((std::uint64_t(since_ref_usec) * subticks_per_usec_q16_) >> 16);
+        std::uint32_t counter = ref_counter_ + since_ref_subticks;
 
+        // Estimated time since the capture minus its lower bound, sign-extended from 24 bits
+        const std::int32_t error = std::int32_t(((counter - capture - min_elapsed) & CounterMask) << 8) >> 8;
 
-/*
- * Statistics are kept even after the interface is closed
- */
-Statistics statistics_;
+        if (!synchronized_ ||
+            (since_ref_usec > MaxReferenceAgeUSec) ||
+            (error < -MaxErrorSubticks) ||
+            (error > MaxErrorSubticks))
+        {
+            counter = capture + min_elapsed;
+            synchronized_ = true;
+        }
+        else if (error < 0)
+        {
+            counter -= error;
+        }
+        else
+        {
+            counter -= std::min(std::uint32_t(error), (since_ref_subticks >> MaxDriftRateLog2) + 1U);
+        }
+
+        ref_usec_ = isr_timestamp_usec;
+        ref_counter_ = counter & CounterMask;
+
+        const std::uint32_t elapsed_usec =
+            std::uint32_t((std::uint64_t((counter - capture) & CounterMask) * usec_per_subtick_q16_) >> 16);
+
+        return (isr_timestamp_usec >= elapsed_usec) ?
+               (isr_timestamp_usec - elapsed_usec) :
+               (isr_timestamp_usec + TimestampRolloverIntervalUSec - elapsed_usec);
+    }
+};
 
 /*
  * Driver state
  */
 struct DriverState
 {
-    RxQueue rx_queue;
-    TxQueue tx_queue;
-    Event rx_event;
+    /*
+     * Frames received via FIFO1 are placed into the high priority queue, which is always read out first.
+     * The high priority queue is smaller because it is expected to receive only a fraction of the traffic.
+     */
+    RxQueue<CAN_RX_QUEUE_CAPACITY> rx_queue;
+    RxQueue<CAN_HP_RX_QUEUE_CAPACITY> hp_rx_queue;
+    TxQueue<CAN_TX_QUEUE_CAPACITY> tx_queue;
     Event tx_event;
     TxItem pending_tx[NumTxMailboxes];
+    HardwareTimestampConverter hw_timestamp_converter;
     bool had_activity = false;
 
+    /*
+     * RX latency probe, see getRxLatencyProbe(). RxFrame has no room for the interrupt timestamp, so it is kept
+     * for one queued frame at a time; the next frame is tagged once the tagged one is committed.
+     */
+    const RxFrame* rx_probe_frame = nullptr;    ///< Null if the next frame is to be tagged
+    std::uint32_t rx_probe_isr_usec = 0;
+
+    /*
+     * Bus-off handling, see BusOffRecoveryPolicy
+     */
+    const BusOffRecoveryPolicy bus_off_policy;
+    bool bus_off = false;                   ///< Cleared by the first successful TX or RX after the bus-off
+    bool tx_flush_pending = false;          ///< The TX queue must be flushed, see flushTxQueueIfRequested()
+    std::uint32_t bus_off_at_usec = 0;
+    unsigned bus_off_backoff_ms = 0;        ///< The last delay; zero if there was none yet
+    ::systime_t bus_off_rejoined_at = 0;    ///< When the last delayed recovery was started
+
+    TrafficWindow traffic_window;
+    TrafficWindow last_traffic_window;      ///< The window that has expired most recently
+    IDRateTable id_rate_table;
+    std::uint64_t id_rate_table_reset_at_usec = 0;
+
     const bool loopback;
+    const std::uint32_t pclk_per_bit;
 
-    DriverState(bool option_loopback) :
-        loopback(option_loopback)
+    DriverState(bool option_loopback, std::uint32_t arg_pclk_per_bit, const BusOffRecoveryPolicy& arg_bus_off_policy) :
+        hw_timestamp_converter(arg_pclk_per_bit),
+        bus_off_policy(arg_bus_off_policy),
+        loopback(option_loopback),
+        pclk_per_bit(arg_pclk_per_bit)
     { }
 
     ~DriverState()
@@ -489,30 +701,96 @@ struct DriverState
         updateStatistics();
     }
 
-    void pushRxFromISR(const RxFrame& rxf)
+    /**
+     * The queues are lock-free, and all CAN interrupts have the same priority, so the critical section is needed
+     * only to signal the event. Threads can invoke this function from a critical section as well.
+     * @param isr_timestamp_usec    Timestamp sampled at the entry of the interrupt handler, see rx_probe_frame.
+     */
+    void pushRxFromISR(const RxFrame& rxf, const std::uint32_t isr_timestamp_usec, const bool high_priority = false)
     {
-        os::CriticalSectionLocker cs_locker;
-
-        if (!rx_queue.push(rxf))
+        if (!(high_priority ? hp_rx_queue.push(rxf) : rx_queue.push(rxf)))
         {
-            statistics_.sw_rx_queue_overruns++;
+            isr_counters_.increment(&ISRCounters::Values::sw_rx_queue_overruns);
+        }
+        else if ((rx_probe_frame == nullptr) && !rxf.failed)
+        {
+            rx_probe_frame = high_priority ? hp_rx_queue.getNewest() : rx_queue.getNewest();
+            rx_probe_isr_usec = isr_timestamp_usec;
         }
-        rx_event.signalI();
 
         if (!rxf.loopback && !rxf.failed)
         {
             had_activity = true;
-            statistics_.frames_rx++;
+            isr_counters_.increment(&ISRCounters::Values::frames_rx);
+            registerBusOperationalFromISR();
+        }
+
+        os::CriticalSectionLocker cs_locker;
+        rx_event_.signalI();
+    }
+
+    /// Must be invoked from ISR or Critical Section
+    void registerBusOperationalFromISR()
+    {
+        if UNLIKELY(bus_off)
+        {
+            bus_off = false;
+            isr_counters_.increment(&ISRCounters::Values::bus_off_recoveries);
+        }
+    }
+
+    /**
+     * Returns the delay before the next recovery attempt, see BusOffRecoveryPolicy.
+     * Must be invoked from ISR or Critical Section.
+     */
+    unsigned computeBusOffBackoffMSecCS()
+    {
+        const bool recurring = (bus_off_backoff_ms > 0) &&
+                               (chVTTimeElapsedSinceX(bus_off_rejoined_at) < MS2ST(bus_off_policy.max_backoff_ms));
+
+        bus_off_backoff_ms = recurring ? (bus_off_backoff_ms * 2U) : bus_off_policy.min_backoff_ms;
+        bus_off_backoff_ms = std::max<unsigned>(bus_off_policy.min_backoff_ms,
+                                                std::min<unsigned>(bus_off_backoff_ms, bus_off_policy.max_backoff_ms));
+        return bus_off_backoff_ms;
+    }
+
+    /// Must be invoked from ISR or Critical Section
+    void updateTrafficWindowCS(const std::uint32_t now_usec)
+    {
+        const std::uint32_t age = computeTimestampDeltaUSec(traffic_window.started_at_usec, now_usec);
+        if (age >= TrafficWindow::DurationUSec)
+        {
+            // If the window has expired more than one window ago, there was no traffic since then
+            last_traffic_window = (age < (2 * TrafficWindow::DurationUSec)) ? traffic_window : TrafficWindow();
+            traffic_window = TrafficWindow();
+            traffic_window.started_at_usec = now_usec;
         }
     }
 
+    /**
+     * Accounts for every frame that has been successfully transmitted or received.
+     */
+    void registerTrafficFromISR(const Frame& frame, const std::uint32_t timestamp_usec)
+    {
+        const unsigned bits = estimateFrameLengthBits(frame);
+
+        updateTrafficWindowCS(timestamp_usec);
+        traffic_window.frames++;
+        traffic_window.bits += bits;
+
+        id_rate_table.add(frame.id, bits);
+    }
+
     /// FIXME This is ugly but I don't have a better idea at the moment.
+    /// Must be invoked from ISR or Critical Section
     void updateStatistics() const
     {
-        statistics_.tx_queue_capacity   = tx_queue.getCapacity();
-        statistics_.tx_queue_peak_usage = tx_queue.getPeakUsage();
-        statistics_.rx_queue_capacity   = rx_queue.getCapacity();
-        statistics_.rx_queue_peak_usage = rx_queue.getPeakUsage();
+        queue_statistics_.tx_queue_capacity      = tx_queue.getCapacity();
+        queue_statistics_.tx_queue_peak_usage    = tx_queue.getPeakUsage();
+        queue_statistics_.rx_queue_capacity      = rx_queue.getCapacity();
+        queue_statistics_.rx_queue_peak_usage    = rx_queue.getPeakUsage();
+        queue_statistics_.hp_rx_queue_capacity   = hp_rx_queue.getCapacity();
+        queue_statistics_.hp_rx_queue_peak_usage = hp_rx_queue.getPeakUsage();
     }
 };
 
@@ -521,6 +799,8 @@ chibios_rt::Mutex rx_mutex_;
 chibios_rt::Mutex tx_mutex_;
 DriverState* state_ = nullptr;
 
+bool peeked_high_priority_queue_ = false;     ///< Protected by the RX mutex, see peekReceived()
+
 
 class CommonMutexLocker
 {
@@ -542,8 +822,14 @@ inline bool canAcceptNewTxFrameCS(const Frame& frame)
     /*
      * We can accept more frames only if the following conditions are satisfied:
      *  - There is at least one TX mailbox free (obvious enough);
-     *  - The priority of the new frame is higher than priority of all TX mailboxes.
+     *  - The priority of the new frame is higher than priority of all TX mailboxes;
+     *  - The TX queue is not being flushed after a bus-off, otherwise the frames would be sent anyway.
      */
+    if UNLIKELY(state_->tx_flush_pending)
+    {
+        return false;
+    }
+
     {
         static constexpr std::uint32_t TME = CAN_TSR_TME0 | CAN_TSR_TME1 | CAN_TSR_TME2;
         const std::uint32_t tme = CAN->TSR & TME;
@@ -571,7 +857,7 @@ inline bool canAcceptNewTxFrameCS(const Frame& frame)
 }
 
 /// Must be invoked from ISR or Critical Section
-inline void loadTxMailboxCS(const Frame& frame)
+inline void loadTxMailboxCS(const Frame& frame, const std::uint32_t submitted_at_usec)
 {
     /*
      * Seeking for an empty slot
@@ -595,7 +881,7 @@ inline void loadTxMailboxCS(const Frame& frame)
         return;         // No transmission for you.
     }
 
-    statistics_.tx_mailbox_peak_usage = std::max(statistics_.tx_mailbox_peak_usage, txmailbox); // Statistics
+    isr_counters_.updateTxMailboxPeakUsage(txmailbox);                  // Statistics
 
     /*
      * Setting up the mailbox
@@ -633,6 +919,7 @@ inline void loadTxMailboxCS(const Frame& frame)
      */
     auto& txi = state_->pending_tx[txmailbox];
     txi.frame   = frame;
+    txi.submitted_at_usec = submitted_at_usec;
     txi.pending = true;
 }
 
@@ -651,7 +938,7 @@ inline void endOfInterruptHandlerHook()
      */
     if UNLIKELY((CAN->ESR & CAN_ESR_LEC) != 0)
     {
-        statistics_.errors++;
+        isr_counters_.increment(&ISRCounters::Values::errors);
         CAN->ESR = 0;                   // Reset error code in order to not count this error twice
     }
 }
@@ -664,13 +951,25 @@ inline void handleTxMailboxInterrupt(const std::uint8_t mailbox_index, const boo
 {
     assert(mailbox_index < NumTxMailboxes);
 
+    // Must be read before the mailbox is reloaded
+    const auto can_time = std::uint16_t(CAN->sTxMailBox[mailbox_index].TDTR >> 16);
+
     /*
      * Updating statistics
      */
     if (txok)
     {
         state_->had_activity = true;
-        statistics_.frames_tx++;
+        isr_counters_.increment(&ISRCounters::Values::frames_tx);
+        state_->registerBusOperationalFromISR();
+
+        const auto& txi = state_->pending_tx[mailbox_index];
+        if (txi.pending)
+        {
+            // Ends at the entry of the TXOK interrupt, which follows the end of frame
+            tx_latency_histogram_.add(computeTimestampDeltaUSec(txi.submitted_at_usec, timestamp_usec));
+            state_->registerTrafficFromISR(txi.frame, timestamp_usec);
+        }
     }
 
     /*
@@ -682,12 +981,15 @@ inline void handleTxMailboxInterrupt(const std::uint8_t mailbox_index, const boo
         if (state_->loopback && txi.pending)
         {
             RxFrame rxf;
-            rxf.frame           = txi.frame;
+            rxf.setFrame(txi.frame);
             rxf.loopback        = true;
             rxf.failed          = !txok;
-            rxf.timestamp_usec  = timestamp_usec;
+            // The hardware timestamp of a failed frame may refer to an aborted attempt, so it is not used
+            rxf.timestamp_usec  = txok ?
+                                  state_->hw_timestamp_converter.convert(can_time, timestamp_usec, txi.frame) :
+                                  timestamp_usec;
 
-            state_->pushRxFromISR(rxf);
+            state_->pushRxFromISR(rxf, timestamp_usec);
         }
 
         txi.pending = false;
@@ -696,12 +998,14 @@ inline void handleTxMailboxInterrupt(const std::uint8_t mailbox_index, const boo
     /*
      * Handling other frames scheduled for transmission
      */
+    bool tx_queue_popped = false;
     if (const auto top = state_->tx_queue.peek())
     {
         if (canAcceptNewTxFrameCS(*top))
         {
-            loadTxMailboxCS(*top);
+            loadTxMailboxCS(*top, state_->tx_queue.getTopSubmissionTimestamp());
             state_->tx_queue.pop();
+            tx_queue_popped = true;
         }
     }
 
@@ -711,6 +1015,10 @@ inline void handleTxMailboxInterrupt(const std::uint8_t mailbox_index, const boo
     {
         os::CriticalSectionLocker cs_locker;
         state_->tx_event.signalI();
+        if (tx_queue_popped)
+        {
+            chEvtBroadcastFlagsI(&event_source_.ev_source, EventFlagTxQueueSpace);
+        }
     }
 
     endOfInterruptHandlerHook();
@@ -734,185 +1042,215 @@ inline void handleRxInterrupt(const std::uint8_t fifo_index, const std::uint32_t
      */
     if ((rfr_reg & CAN_RF0R_FOVR0) != 0)
     {
-        statistics_.hw_rx_queue_overruns++;
+        isr_counters_.increment(&ISRCounters::Values::hw_rx_queue_overruns);
     }
 
     /*
      * Read the frame contents
      */
-    RxFrame rxf;
-    rxf.timestamp_usec = timestamp_usec;
+    Frame frame;
 
     const auto& rf = CAN->sFIFOMailBox[fifo_index];
 
     if ((rf.RIR & CAN_RI0R_IDE) == 0)
     {
-        rxf.frame.id = Frame::MaskStdID & (rf.RIR >> 21);
+        frame.id = Frame::MaskStdID & (rf.RIR >> 21);
     }
     else
     {
-        rxf.frame.id = Frame::MaskExtID & (rf.RIR >> 3);
-        rxf.frame.id |= Frame::FlagEFF;
+        frame.id = Frame::MaskExtID & (rf.RIR >> 3);
+        frame.id |= Frame::FlagEFF;
     }
 
     if ((rf.RIR & CAN_RI0R_RTR) != 0)
     {
-        rxf.frame.id |= Frame::FlagRTR;
+        frame.id |= Frame::FlagRTR;
     }
 
-    rxf.frame.dlc = rf.RDTR & 15;
+    const std::uint32_t rdtr = rf.RDTR;
+    frame.dlc = rdtr & 15;
 
     {
         const std::uint32_t r = rf.RDLR;
-        rxf.frame.data[0] = std::uint8_t(0xFF & (r >> 0));
-        rxf.frame.data[1] = std::uint8_t(0xFF & (r >> 8));
-        rxf.frame.data[2] = std::uint8_t(0xFF & (r >> 16));
-        rxf.frame.data[3] = std::uint8_t(0xFF & (r >> 24));
+        frame.data[0] = std::uint8_t(0xFF & (r >> 0));
+        frame.data[1] = std::uint8_t(0xFF & (r >> 8));
+        frame.data[2] = std::uint8_t(0xFF & (r >> 16));
+        frame.data[3] = std::uint8_t(0xFF & (r >> 24));
     }
     {
         const std::uint32_t r = rf.RDHR;
-        rxf.frame.data[4] = std::uint8_t(0xFF & (r >> 0));
-        rxf.frame.data[5] = std::uint8_t(0xFF & (r >> 8));
-        rxf.frame.data[6] = std::uint8_t(0xFF & (r >> 16));
-        rxf.frame.data[7] = std::uint8_t(0xFF & (r >> 24));
+        frame.data[4] = std::uint8_t(0xFF & (r >> 0));
+        frame.data[5] = std::uint8_t(0xFF & (r >> 8));
+        frame.data[6] = std::uint8_t(0xFF & (r >> 16));
+        frame.data[7] = std::uint8_t(0xFF & (r >> 24));
     }
 
     rfr_reg = CAN_RF0R_RFOM0 | CAN_RF0R_FOVR0 | CAN_RF0R_FULL0;  // Release FIFO entry we just read
 
+    RxFrame rxf;
+    rxf.setFrame(frame);
+    rxf.timestamp_usec = state_->hw_timestamp_converter.convert(std::uint16_t(rdtr >> 16), timestamp_usec, frame);
+
+    state_->registerTrafficFromISR(frame, timestamp_usec);
+
+    capture_buffer_.add(rxf.timestamp_usec, frame.id, &frame.data[0], frame.dlc);
+
     /*
      * Store with timeout into the FIFO buffer and signal update event
      */
-    state_->pushRxFromISR(rxf);
+    state_->pushRxFromISR(rxf, timestamp_usec, fifo_index == 1);
 
     endOfInterruptHandlerHook();
 }
 
+void handleBusOffRecoveryTimer(void*)
+{
+    chSysLockFromISR();
+    if (state_ != nullptr)
+    {
+        // Leaving the initialization mode starts the recovery sequence
+        state_->bus_off_rejoined_at = chVTGetSystemTimeX();
+        CAN->MCR &= ~CAN_MCR_INRQ;
+    }
+    chSysUnlockFromISR();
+}
+
+/**
+ * Drops the frames that were left in the TX queue after the bus-off, see BusOffRecoveryPolicy.
+ * Invoked from the threads that use the driver; every frame is processed in a separate critical section, so that
+ * the interrupts are not delayed by more than one queue operation.
+ */
+void flushTxQueueIfRequested()
+{
+    while (true)
+    {
+        os::CriticalSectionLocker cs_locker;
+
+        if LIKELY((state_ == nullptr) || !state_->tx_flush_pending)
+        {
+            return;
+        }
+
+        const auto tx = state_->tx_queue.peek();
+        if (tx == nullptr)
+        {
+            state_->tx_flush_pending = false;
+            state_->tx_event.signalI();
+            chEvtBroadcastFlagsI(&event_source_.ev_source, EventFlagTxQueueSpace);
+            return;
+        }
+
+        isr_counters_.increment(&ISRCounters::Values::bus_off_dropped_frames);
+
+        if (state_->loopback && (state_->rx_queue.getLength() < (state_->rx_queue.getCapacity() / 2U)))
+        {
+            RxFrame rxf;
+            rxf.setFrame(*tx);
+            rxf.failed          = true;
+            rxf.loopback        = true;
+            rxf.timestamp_usec  = state_->bus_off_at_usec;
+
+            state_->pushRxFromISR(rxf, state_->bus_off_at_usec);
+        }
+
+        state_->tx_queue.pop();
+    }
+}
+
 inline void handleStatusChangeInterrupt(const std::uint32_t timestamp_usec)
 {
     CAN->MSR = CAN_MSR_ERRI;        // Clear error interrupt flag
 
+    if ((CAN->ESR & (CAN_ESR_EPVF | CAN_ESR_BOFF)) != 0)
+    {
+        capture_buffer_.notifyErrorState();
+    }
+
     /*
      * Handle bus-off event.
      * This event is edge-triggered, meaning that it will be generated only once per one bus-off occurence.
+     * The work done here is bounded; the TX queue is flushed later from a thread, see flushTxQueueIfRequested().
      */
     if UNLIKELY(bool(CAN->ESR & CAN_ESR_BOFF))
     {
-        statistics_.bus_off_events++;
-
-        bool tx_event_required = false;
+        isr_counters_.increment(&ISRCounters::Values::bus_off_events);
+        state_->bus_off = true;
+        state_->bus_off_at_usec = timestamp_usec;
 
-        // Requesting transmission abort for all mailboxes
-        CAN->TSR = CAN_TSR_ABRQ0 | CAN_TSR_ABRQ1 | CAN_TSR_ABRQ2;
-
-        // Marking TX mailboxes empty
-        for (unsigned i = 0; i < NumTxMailboxes; i++)
+        if (!state_->bus_off_policy.keep_tx_queue)
         {
-            auto& tx = state_->pending_tx[i];
-            if (tx.pending)
-            {
-                tx.pending = false;
+            // Requesting transmission abort for all mailboxes
+            CAN->TSR = CAN_TSR_ABRQ0 | CAN_TSR_ABRQ1 | CAN_TSR_ABRQ2;
 
-                // If loopback is enabled, reporting that the transmission has failed.
-                if (state_->loopback)
+            // The aborted frames are returned into the TX queue in order to be flushed together with the rest
+            for (unsigned i = 0; i < NumTxMailboxes; i++)
+            {
+                auto& tx = state_->pending_tx[i];
+                if (tx.pending)
                 {
-                    RxFrame rxf;
-                    rxf.frame           = tx.frame;
-                    rxf.failed          = true;
-                    rxf.loopback        = true;
-                    rxf.timestamp_usec  = timestamp_usec;
-
-                    state_->pushRxFromISR(rxf);
+                    tx.pending = false;
+                    if (!state_->tx_queue.push(tx.frame, tx.submitted_at_usec))
+                    {
+                        isr_counters_.increment(&ISRCounters::Values::bus_off_dropped_frames);
+                    }
                 }
-
-                tx_event_required = true;
-            }
-        }
-
-        // Flushing the TX queue
-        while (const auto tx = state_->tx_queue.peek())
-        {
-            tx_event_required = true;
-
-            // If loopback is enabled, reporting that the transmission has failed.
-            if (state_->loopback)
-            {
-                RxFrame rxf;
-                rxf.frame           = *tx;
-                rxf.failed          = true;
-                rxf.loopback        = true;
-                rxf.timestamp_usec  = timestamp_usec;
-
-                state_->pushRxFromISR(rxf);
             }
 
-            state_->tx_queue.pop();
+            state_->tx_flush_pending = true;
         }
 
-        // Signaling an event if needed
-        if (tx_event_required)
+        os::CriticalSectionLocker cs_locker;
+
+        if (state_->bus_off_policy.min_backoff_ms > 0)
         {
-            os::CriticalSectionLocker cs_locker;
-            state_->tx_event.signalI();
+            // The controller stays detached from the bus in the initialization mode until the timer expires
+            CAN->MCR |= CAN_MCR_INRQ;
+            chVTSetI(&bus_off_recovery_timer_, MS2ST(state_->computeBusOffBackoffMSecCS()),
+                     &handleBusOffRecoveryTimer, nullptr);
         }
+
+        // Waking up the threads that may be waiting for the flush, see flushTxQueueIfRequested()
+        rx_event_.signalI();
+        state_->tx_event.signalI();
     }
 
     endOfInterruptHandlerHook();
 }
 
-/*
- * Timestamping
- */
-__attribute__((always_inline))
-inline std::uint32_t getTimestampUSec()
+} // namespace
+
+std::uint32_t getTimestampUSec()
 {
     const auto value = gptGetCounterX(&CAN_GPT);
     assert(value < TimestampRolloverIntervalUSec);
     return value;
 }
 
-} // namespace
-
-inline bool Frame::priorityHigherThan(const Frame& rhs) const
+std::uint64_t extendTimestampUSec(const std::uint32_t timestamp_usec)
 {
-    const uint32_t clean_id     = id     & MaskExtID;
-    const uint32_t rhs_clean_id = rhs.id & MaskExtID;
-
-    /*
-     * STD vs EXT - if 11 most significant bits are the same, EXT loses.
-     */
-    const bool ext     = id     & FlagEFF;
-    const bool rhs_ext = rhs.id & FlagEFF;
-    if UNLIKELY(ext != rhs_ext)
+    std::uint32_t now = 0;
+    std::uint32_t epoch = 0;
     {
-        const uint32_t arb11     = ext     ? (clean_id >> 18)     : clean_id;
-        const uint32_t rhs_arb11 = rhs_ext ? (rhs_clean_id >> 18) : rhs_clean_id;
-        if (arb11 != rhs_arb11)
-        {
-            return arb11 < rhs_arb11;
-        }
-        else
+        os::CriticalSectionLocker cs_lock;
+        now = getTimestampUSec();
+        epoch = timestamp_epoch_;
+
+        // The rollover interrupt may be pending; the counter must be read again in order to get a consistent pair
+        if UNLIKELY((CAN_GPT.tim->SR & STM32_TIM_SR_UIF) != 0)
         {
-            return rhs_ext;
+            now = getTimestampUSec();
+            epoch++;
         }
     }
 
-    /*
-     * RTR vs Data frame - if frame identifiers and frame types are the same, RTR loses.
-     */
-    const bool rtr     = id     & FlagRTR;
-    const bool rhs_rtr = rhs.id & FlagRTR;
-    if UNLIKELY(clean_id == rhs_clean_id && rtr != rhs_rtr)
-    {
-        return rhs_rtr;
-    }
-
-    /*
-     * Plain ID arbitration - greater value loses.
-     */
-    return clean_id < rhs_clean_id;
+    const std::uint64_t now64 = std::uint64_t(epoch) * TimestampRolloverIntervalUSec + now;
+    return now64 - computeTimestampDeltaUSec(timestamp_usec, now);
 }
 
-int open(std::uint32_t bitrate, unsigned options)
+namespace
+{
+
+int openImpl(std::uint32_t bitrate, unsigned options, unsigned sample_point_permill, unsigned inak_timeout_ms)
 {
     CommonMutexLocker mutex_locker;
 
@@ -925,13 +1263,15 @@ int open(std::uint32_t bitrate, unsigned options)
         static const GPTConfig gpt_cfg =
         {
             1000 * 1000,        // Clock rate [Hz]
-            nullptr,            // Callback
+            &handleTimestampRollover,
             0,                  // CR2
             0                   // DIER
         };
         gptStart(&CAN_GPT, &gpt_cfg);
         gptStartContinuous(&CAN_GPT, TimestampRolloverIntervalUSec);
 
+        chVTObjectInit(&bus_off_recovery_timer_);
+
         /*
          * CAN macrocell and NVIC initialization (requires a critical section).
          */
@@ -975,7 +1315,7 @@ int open(std::uint32_t bitrate, unsigned options)
         NVIC_ClearPendingIRQ(static_cast<IRQn_Type>(CAN_SCE_IRQn));
     }
 
-    if (!waitMSRINAKBitStateChange(true))
+    if (!waitMSRINAKBitStateChange(true, inak_timeout_ms))
     {
         return -ErrMsrInakNotSet;
     }
@@ -984,32 +1324,51 @@ int open(std::uint32_t bitrate, unsigned options)
      * CAN timings for this bitrate
      */
     Timings timings;
-    const int timings_res = computeTimings(bitrate, timings);
-    if (timings_res < 0)
+    if (!computeTimings(STM32_PCLK1, bitrate, sample_point_permill, timings))
     {
-        return timings_res;
+        return -ErrInvalidBitRate;
     }
     DEBUG_LOG("Timings: presc=%u sjw=%u bs1=%u bs2=%u\n",
               unsigned(timings.prescaler), unsigned(timings.sjw), unsigned(timings.bs1), unsigned(timings.bs2));
+    DEBUG_LOG("Timings: quanta/bit: %u, sample point location: %.1f%%, bitrate: %u\n",
+              timings.getQuantaPerBit(), float(timings.getSamplePointPermill()) / 10.F,
+              unsigned(STM32_PCLK1 / timings.getPCLKPerBit()));
 
     /*
-     * Resetting driver state and statistics - CAN interrupts are disabled, so it's safe to modify it now
+     * Resetting driver state and statistics - CAN interrupts are disabled, so it's safe to modify it now.
+     * The state pointer is modified in a critical section because of sendI().
      */
-    if (state_ != nullptr)
+    BusOffRecoveryPolicy bus_off_policy;
     {
-        state_->~DriverState();
-        state_ = nullptr;
+        os::CriticalSectionLocker cs_lock;
+        chVTResetI(&bus_off_recovery_timer_);
+        if (state_ != nullptr)
+        {
+            state_->~DriverState();
+            state_ = nullptr;
+        }
+        bus_off_policy = bus_off_recovery_policy_;
     }
 
     static std::aligned_storage_t<sizeof(DriverState), alignof(DriverState)> _state_storage;
-    state_ = new (&_state_storage) DriverState((options & OptionLoopback) != 0);
+    auto* const new_state = new (&_state_storage) DriverState((options & OptionLoopback) != 0,
+                                                              timings.getPCLKPerBit(),
+                                                              bus_off_policy);
+    new_state->id_rate_table_reset_at_usec = extendTimestampUSec(getTimestampUSec());
 
-    statistics_ = Statistics();
+    {
+        os::CriticalSectionLocker cs_lock;
+        state_ = new_state;
+        isr_counters_.reset();
+        queue_statistics_ = QueueStatistics();
+    }
 
     /*
      * Hardware initialization (the hardware has already confirmed initialization mode, see above)
      */
-    CAN->MCR = CAN_MCR_ABOM | CAN_MCR_AWUM | CAN_MCR_INRQ;  // RM page 648
+    CAN->MCR = CAN_MCR_AWUM | CAN_MCR_INRQ |                 // RM page 648
+               CAN_MCR_TTCM |                                // Hardware timestamping, see HardwareTimestampConverter
+               ((bus_off_policy.min_backoff_ms == 0) ? CAN_MCR_ABOM : 0);  // Otherwise see BusOffRecoveryPolicy
 
     CAN->BTR = ((timings.sjw & 3U)  << 24) |
                ((timings.bs1 & 15U) << 16) |
@@ -1022,38 +1381,37 @@ int open(std::uint32_t bitrate, unsigned options)
                CAN_IER_FMPIE0 |         // RX FIFO 0 is not empty
                CAN_IER_FMPIE1 |         // RX FIFO 1 is not empty
                CAN_IER_ERRIE |          // General error IRQ
+               CAN_IER_EPVIE |          // Error passive reached, needed for the capture trigger
                CAN_IER_BOFIE;           // Bus-off reached (seems to be edge-triggered)
 
     CAN->MCR &= ~CAN_MCR_INRQ;          // Leave init mode
 
-    if (!waitMSRINAKBitStateChange(false))
+    if (!waitMSRINAKBitStateChange(false, inak_timeout_ms))
     {
+        os::CriticalSectionLocker cs_lock;
         state_->~DriverState();
         state_ = nullptr;
         return -ErrMsrInakNotCleared;
     }
 
-    os::CriticalSectionLocker cs_lock;  // Entering a critical section for the rest of initialization
-
     /*
-     * Default filter configuration
+     * Filter configuration
      */
-    CAN->FMR |= CAN_FMR_FINIT;
-
-    CAN->FMR &= 0xFFFFC0F1;
-    CAN->FMR |= static_cast<std::uint32_t>(27) << 8;    // Refer to the bxCAN macrocell documentation for explanation
+    {
+        os::CriticalSectionLocker cs_lock;
+        loadFilterBanksCS(filter_banks_);
+    }
 
-    CAN->FFA1R = 0;                     // All assigned to FIFO0 by default
-    CAN->FM1R = 0;                      // Indentifier Mask mode
+    event_source_.broadcastFlags(EventFlagOpened);
 
-    CAN->FS1R = 0x1fff;
-    CAN->sFilterRegister[0].FR1 = 0;
-    CAN->sFilterRegister[0].FR2 = 0;
-    CAN->FA1R = 1;
+    return 0;
+}
 
-    CAN->FMR &= ~CAN_FMR_FINIT;
+} // namespace
 
-    return 0;
+int open(std::uint32_t bitrate, unsigned options, unsigned sample_point_permill)
+{
+    return openImpl(bitrate, options, sample_point_permill, DefaultINAKTimeoutMSec);
 }
 
 void close()
@@ -1061,6 +1419,8 @@ void close()
     CommonMutexLocker mutex_locker;
     os::CriticalSectionLocker cs_lock;
 
+    chVTResetI(&bus_off_recovery_timer_);
+
     CAN->IER = 0;                                               // Disable interrupts
     CAN->TSR = CAN_TSR_ABRQ0 | CAN_TSR_ABRQ1 | CAN_TSR_ABRQ2;   // Cancel all transmissions
     CAN->MCR = CAN_MCR_SLEEP | CAN_MCR_RESET;                   // Force software reset of the macrocell
@@ -1075,6 +1435,54 @@ void close()
         state_->~DriverState();
         state_ = nullptr;
     }
+
+    rx_event_.signalI();                // The reader may be waiting, see peekReceived()
+}
+
+int detectBitRate(const std::uint32_t* const candidates, const unsigned num_candidates,
+                  const std::uint16_t listen_timeout_ms, const unsigned sample_point_permill)
+{
+    for (unsigned i = 0; i < num_candidates; i++)
+    {
+        // A busy bus may never let the controller leave the init mode at a wrong bitrate, so the timeout is short
+        if (openImpl(candidates[i], OptionSilentMode, sample_point_permill, BitRateDetectionINAKTimeoutMSec) < 0)
+        {
+            close();                    // Not supported (e.g. due to the clock frequency), or the wrong bitrate
+            continue;
+        }
+
+        bool detected = false;
+        const ::systime_t started_at = chVTGetSystemTime();
+        while (chVTTimeElapsedSinceX(started_at) < MS2ST(listen_timeout_ms))
+        {
+            ::usleep(1000);
+
+            const auto counters = isr_counters_.read();
+
+            // LEC is reset by the interrupt handlers, but REC (receive error counter) keeps the track of errors
+            const std::uint32_t esr = CAN->ESR;
+            if ((counters.errors > 0) || ((esr & CAN_ESR_LEC) != 0) || ((esr & CAN_ESR_REC) != 0))
+            {
+                break;                  // Wrong bitrate
+            }
+
+            if (counters.frames_rx > 0)
+            {
+                detected = true;
+                break;
+            }
+        }
+
+        close();
+
+        if (detected)
+        {
+            DEBUG_LOG("Bitrate detected: %u\n", unsigned(candidates[i]));
+            return int(candidates[i]);
+        }
+    }
+
+    return -ErrBitRateNotDetected;
 }
 
 bool isOpen()
@@ -1082,6 +1490,11 @@ bool isOpen()
     return state_ != nullptr;
 }
 
+event_source_t* getEventSource()
+{
+    return &event_source_.ev_source;
+}
+
 int send(const Frame& frame, std::uint16_t timeout_ms)
 {
     os::MutexLocker mutex_locker(tx_mutex_);
@@ -1096,20 +1509,23 @@ int send(const Frame& frame, std::uint16_t timeout_ms)
         return -ErrUnsupportedFrame;
     }
 
+    flushTxQueueIfRequested();
+
     const auto started_at = chVTGetSystemTimeX();
+    const auto submitted_at_usec = getTimestampUSec();
 
     while (true)
     {
         {
             os::CriticalSectionLocker cs_locker;
 
-            if (state_->tx_queue.push(frame))                   // Pushing the prioritized queue
+            if (state_->tx_queue.push(frame, submitted_at_usec))    // Pushing the prioritized queue
             {
                 const auto top = state_->tx_queue.peek();       // Returned frame may be different (always non-null)
 
                 if (canAcceptNewTxFrameCS(*top))                // Checking if the hardware can accept the frame
                 {
-                    loadTxMailboxCS(*top);                      // Starting transmission
+                    loadTxMailboxCS(*top, state_->tx_queue.getTopSubmissionTimestamp());    // Starting transmission
                     state_->tx_queue.pop();                     // Removing the top frame from the queue
                 }
 
@@ -1129,44 +1545,186 @@ int send(const Frame& frame, std::uint16_t timeout_ms)
     return -1;
 }
 
-int receive(RxFrame& out_frame, std::uint16_t timeout_ms)
+int sendI(const Frame& frame)
 {
-    os::MutexLocker mutex_locker(rx_mutex_);
+    os::CriticalSectionLocker cs_locker;
 
     if (state_ == nullptr)
     {
         return -ErrClosed;
     }
 
+    if (frame.isErrorFrame() || frame.dlc > 8)
+    {
+        return -ErrUnsupportedFrame;
+    }
+
+    if (!state_->tx_queue.push(frame, getTimestampUSec()))
+    {
+        return 0;
+    }
+
+    const auto top = state_->tx_queue.peek();
+    if (canAcceptNewTxFrameCS(*top))
+    {
+        loadTxMailboxCS(*top, state_->tx_queue.getTopSubmissionTimestamp());
+        state_->tx_queue.pop();
+    }
+
+    return 1;
+}
+
+int receive(RxFrame& out_frame, std::uint16_t timeout_ms)
+{
+    return receiveBatch(&out_frame, 1, timeout_ms);
+}
+
+int receiveBatch(RxFrame* out_frames, unsigned max_frames, std::uint16_t timeout_ms)
+{
+    if (out_frames == nullptr)
+    {
+        assert(false);
+        return -ErrLogic;
+    }
+
+    const RxFrame* frames = nullptr;
+    const int res = peekReceived(frames, max_frames, timeout_ms);
+    if (res > 0)
+    {
+        std::copy_n(frames, res, out_frames);
+        commitReceived(unsigned(res));
+    }
+    return res;
+}
+
+int peekReceived(const RxFrame*& out_frames, unsigned max_frames, std::uint16_t timeout_ms)
+{
+    if (max_frames == 0)
+    {
+        assert(false);
+        return -ErrLogic;
+    }
+
     const auto started_at = chVTGetSystemTimeX();
 
+    rx_mutex_.lock();                           // Will be unlocked in commitReceived() if there are frames
+
     while (true)
     {
+        // The channel may have been closed or reopened while the mutex was released
+        if (state_ == nullptr)
         {
-            os::CriticalSectionLocker cs_locker;
-            if (state_->rx_queue.getLength() > 0)
-            {
-                state_->rx_queue.pop(out_frame);
-                return 1;
-            }
+            rx_mutex_.unlock();
+            return -ErrClosed;
         }
 
-        // Blocking until next event or timeout
+        flushTxQueueIfRequested();
+
+        unsigned num_frames = state_->hp_rx_queue.peek(out_frames);
+        peeked_high_priority_queue_ = num_frames > 0;
+        if (!peeked_high_priority_queue_)
+        {
+            num_frames = state_->rx_queue.peek(out_frames);
+        }
+
+        if (num_frames > 0)
+        {
+            return int(std::min(num_frames, max_frames));
+        }
+
+        // Blocking until next event or timeout; the mutex is released so that open() and close() are not delayed
         const auto elapsed = chVTTimeElapsedSinceX(started_at);
         if (elapsed >= MS2ST(timeout_ms))
         {
+            rx_mutex_.unlock();
             return 0;
         }
-        state_->rx_event.waitForSysTicks(MS2ST(timeout_ms) - elapsed);
+        rx_mutex_.unlock();
+        rx_event_.waitForSysTicks(MS2ST(timeout_ms) - elapsed);
+        rx_mutex_.lock();
     }
 
     return -1;
 }
 
+void commitReceived(unsigned num_frames)
+{
+    // The state can't be destroyed while the RX mutex is locked
+    assert(state_ != nullptr);
+    if (state_ != nullptr)
+    {
+        const RxFrame* frames = nullptr;
+        (void)(peeked_high_priority_queue_ ? state_->hp_rx_queue.peek(frames) : state_->rx_queue.peek(frames));
+        {
+            os::CriticalSectionLocker cs_locker;
+            if ((state_->rx_probe_frame >= frames) && (state_->rx_probe_frame < (frames + num_frames)))
+            {
+                state_->rx_probe_frame = nullptr;           // Tagging the next frame
+            }
+        }
+
+        if (peeked_high_priority_queue_)
+        {
+            state_->hp_rx_queue.commit(num_frames);
+        }
+        else
+        {
+            state_->rx_queue.commit(num_frames);
+        }
+    }
+
+    rx_mutex_.unlock();
+}
+
+bool getRxLatencyProbe(const RxFrame* const frames, const unsigned num_frames, std::uint32_t& out_isr_timestamp_usec)
+{
+    assert(state_ != nullptr);
+    if (state_ == nullptr)
+    {
+        return false;
+    }
+
+    os::CriticalSectionLocker cs_locker;
+    if ((state_->rx_probe_frame >= frames) && (state_->rx_probe_frame < (frames + num_frames)))
+    {
+        out_isr_timestamp_usec = state_->rx_probe_isr_usec;
+        return true;
+    }
+    return false;
+}
+
+int setAcceptanceFilters(const AcceptanceFilterConfig* configs, unsigned num_configs)
+{
+    CommonMutexLocker mutex_locker;
+
+    FilterBanks banks;
+    const int res = computeFilterBanks(configs, num_configs, banks);
+    if (res < 0)
+    {
+        return res;
+    }
+
+    DEBUG_LOG("Filters: %u configs, active banks 0x%04x, list mode 0x%04x, 32-bit 0x%04x\n", num_configs,
+              unsigned(banks.fa1r), unsigned(banks.fm1r), unsigned(banks.fs1r));
+
+    os::CriticalSectionLocker cs_lock;
+
+    filter_banks_ = banks;
+    if (state_ != nullptr)
+    {
+        loadFilterBanksCS(filter_banks_);
+    }
+
+    return 0;
+}
+
 Statistics getStatistics()
 {
-    Statistics val;
+    os::MutexLocker mutex_locker(statistics_mutex_);
 
+    foldStatistics();
+
+    QueueStatistics queue_stats;
     {
         os::CriticalSectionLocker cs_locker;
 
@@ -1176,12 +1734,165 @@ Statistics getStatistics()
             state_->updateStatistics();
         }
 
-        val = statistics_;
+        queue_stats = queue_statistics_;
     }
 
+    Statistics val = statistics_;
+    val.tx_queue_capacity      = queue_stats.tx_queue_capacity;
+    val.tx_queue_peak_usage    = queue_stats.tx_queue_peak_usage;
+    val.rx_queue_capacity      = queue_stats.rx_queue_capacity;
+    val.rx_queue_peak_usage    = queue_stats.rx_queue_peak_usage;
+    val.hp_rx_queue_capacity   = queue_stats.hp_rx_queue_capacity;
+    val.hp_rx_queue_peak_usage = queue_stats.hp_rx_queue_peak_usage;
     return val;
 }
 
+std::uint64_t getRxOverrunCount()
+{
+    os::MutexLocker mutex_locker(statistics_mutex_);
+    foldStatistics();
+    return statistics_.hw_rx_queue_overruns + statistics_.sw_rx_queue_overruns;
+}
+
+void pollStatistics()
+{
+    flushTxQueueIfRequested();
+
+    os::MutexLocker mutex_locker(statistics_mutex_);
+    foldStatistics();
+}
+
+void setBusOffRecoveryPolicy(const BusOffRecoveryPolicy& policy)
+{
+    os::CriticalSectionLocker cs_locker;
+    bus_off_recovery_policy_ = policy;
+    bus_off_recovery_policy_.max_backoff_ms = std::max(policy.min_backoff_ms, policy.max_backoff_ms);
+}
+
+BusOffRecoveryPolicy getBusOffRecoveryPolicy()
+{
+    os::CriticalSectionLocker cs_locker;
+    return bus_off_recovery_policy_;
+}
+
+unsigned getTxQueueFreeSpace()
+{
+    os::CriticalSectionLocker cs_locker;
+    return (state_ == nullptr) ? 0 : (state_->tx_queue.getCapacity() - state_->tx_queue.getLength());
+}
+
+BusLoad getBusLoad()
+{
+    BusLoad out;
+    os::CriticalSectionLocker cs_locker;
+
+    if (state_ != nullptr)
+    {
+        state_->updateTrafficWindowCS(getTimestampUSec());
+        const auto& w = state_->last_traffic_window;
+
+        out.frames_per_sec = w.frames;
+        out.bits_per_sec = w.bits;
+
+        const std::uint32_t bitrate = STM32_PCLK1 / state_->pclk_per_bit;
+        out.utilization_permill = std::uint16_t((std::uint64_t(w.bits) * 1000U) / bitrate);
+    }
+
+    return out;
+}
+
+IDRateTable getIDRateTable(std::uint64_t& out_interval_usec)
+{
+    const std::uint64_t now = extendTimestampUSec(getTimestampUSec());
+
+    os::CriticalSectionLocker cs_locker;
+
+    if (state_ == nullptr)
+    {
+        out_interval_usec = 0;
+        return IDRateTable();
+    }
+
+    out_interval_usec = now - std::min(now, state_->id_rate_table_reset_at_usec);
+    return state_->id_rate_table;
+}
+
+void resetIDRateTable()
+{
+    const std::uint64_t now = extendTimestampUSec(getTimestampUSec());
+
+    os::CriticalSectionLocker cs_locker;
+
+    if (state_ != nullptr)
+    {
+        state_->id_rate_table.reset();
+        state_->id_rate_table_reset_at_usec = now;
+    }
+}
+
+void armCapture(const CaptureTrigger& trigger, const unsigned post_trigger_frames)
+{
+    os::CriticalSectionLocker cs_locker;
+    capture_buffer_.arm(trigger, post_trigger_frames);
+}
+
+void triggerCapture()
+{
+    os::CriticalSectionLocker cs_locker;
+    capture_buffer_.trigger();
+}
+
+void freezeCapture()
+{
+    os::CriticalSectionLocker cs_locker;
+    capture_buffer_.freeze();
+}
+
+CaptureStatus getCaptureStatus()
+{
+    os::CriticalSectionLocker cs_locker;
+    CaptureStatus out;
+    out.state = capture_buffer_.getState();
+    out.length = capture_buffer_.getLength();
+    out.trigger_index = capture_buffer_.getTriggerIndex();
+    return out;
+}
+
+unsigned readCapture(const unsigned index, RxFrame* const out_frames, const unsigned max_frames)
+{
+    os::CriticalSectionLocker cs_locker;
+
+    if (capture_buffer_.getState() != CaptureBuffer::State::Frozen)
+    {
+        return 0;
+    }
+
+    const unsigned num_frames = (index < capture_buffer_.getLength()) ?
+                                std::min(max_frames, capture_buffer_.getLength() - index) : 0;
+    for (unsigned i = 0; i < num_frames; i++)
+    {
+        const auto& r = capture_buffer_.getRecord(index + i);
+        out_frames[i] = RxFrame();
+        out_frames[i].timestamp_usec = r.timestamp_usec;
+        out_frames[i].id = r.id;
+        out_frames[i].dlc = r.dlc;
+        std::memcpy(&out_frames[i].data[0], &r.data[0], sizeof(r.data));
+    }
+    return num_frames;
+}
+
+LatencyHistogram getTxLatencyHistogram()
+{
+    os::CriticalSectionLocker cs_locker;
+    return tx_latency_histogram_;
+}
+
+void resetTxLatencyHistogram()
+{
+    os::CriticalSectionLocker cs_locker;
+    tx_latency_histogram_.reset();
+}
+
 Status getStatus()
 {
     const std::uint32_t esr = CAN->ESR;         // Access is atomic
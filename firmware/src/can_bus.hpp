@@ -7,6 +7,11 @@
 #include <cstdint>
 #include <cstring>
 #include <cassert>
+#include <ch.hpp>
+#include "can_frame.hpp"
+#include "latency_histogram.hpp"
+#include "id_rate_table.hpp"
+#include "capture_buffer.hpp"
 
 /**
  * This implementation has been borrowed from libuavcan.
@@ -26,70 +31,23 @@ static const std::int16_t ErrMsrInakNotSet           = 1005; ///< INAK bit of th
 static const std::int16_t ErrMsrInakNotCleared       = 1006; ///< INAK bit of the MSR register is not 0
 static const std::int16_t ErrBitRateNotDetected      = 1007; ///< Auto bit rate detection could not be finished
 static const std::int16_t ErrClosed                  = 1008; ///< The driver is not started
+static const std::int16_t ErrFilterNumConfigs        = 1009; ///< Number of filters is more than supported
 
 /**
- * SLCAN protocol requires the timestamp to be in the range from 0 to 60'000 milliseconds (not inclusive).
- * We could start a 16-bit timer at 1 kHz and use it for timestamping, but at our clock rates we can't make a timer
- * run slow enough. We can't slow down PCLK1 either, because the CAN macrocell requires at least 36 MHz clock
- * for accurate bit timings. We could resort to slowing down PCLK2 and using a PCLK2-clocked timer, but sadly
- * ChibiOS does not support PCLK2 timers, and also we have some other peripheral there like SPI which may benefit
- * from higher clock rates.
- * So the solution is to take a 32-bit timer and run it at a faster rate. This also forces a good idea of increasing
- * the resolution of timestamps to 1 microsecond (while keeping the interval exactly 1 minute for compatibility
- * reasons).
+ * Acceptance filter configuration, like in libuavcan.
+ * Both fields use the same format as @ref Frame::id. A frame is accepted if (frame.id & mask) == (id & mask), where:
+ *  - The flag EFF of the ID field selects the format of the identifier bits of both fields.
+ *  - The flag EFF of the mask field defines whether the frame format must match. If it is not set, a standard
+ *    identifier will be matched against the 11 most significant bits of extended identifiers, too.
+ *  - The flag RTR of the mask field defines whether the frame type must match.
+ * Frames accepted by high priority filters are received via a dedicated hardware FIFO and a dedicated software
+ * queue, and they are delivered by @ref receive() before all other frames, even if they arrived later.
  */
-static constexpr std::uint32_t TimestampRolloverIntervalUSec = 60 * 1000 * 1000;
-
-/**
- * Frame definition like in libuavcan
- */
-struct Frame
-{
-    static constexpr std::uint32_t MaskStdID = 0x000007FFU;
-    static constexpr std::uint32_t MaskExtID = 0x1FFFFFFFU;
-    static constexpr std::uint32_t FlagEFF = 1U << 31;          ///< Extended frame format
-    static constexpr std::uint32_t FlagRTR = 1U << 30;          ///< Remote transmission request
-    static constexpr std::uint32_t FlagERR = 1U << 29;          ///< Error frame
-
-    static constexpr std::uint8_t MaxDataLen = 8;
-
-    std::uint32_t id = 0;                                       ///< CAN ID with flags (above)
-    std::uint8_t data[MaxDataLen] = {};
-    std::uint8_t dlc = 0;                                       ///< Data Length Code
-
-    Frame() { }
-
-    Frame(std::uint32_t can_id, const void* can_data, std::uint8_t data_len) :
-        id(can_id),
-        dlc(data_len)
-    {
-        assert(can_data != nullptr);
-        assert(data_len <= MaxDataLen);
-        (void)std::memcpy(this->data, can_data, data_len);
-    }
-
-    bool isExtended()                  const { return id & FlagEFF; }
-    bool isRemoteTransmissionRequest() const { return id & FlagRTR; }
-    bool isErrorFrame()                const { return id & FlagERR; }
-
-    /**
-     * CAN frame arbitration rules, particularly STD vs EXT:
-     *     Marco Di Natale - "Understanding and using the Controller Area Network"
-     *     http://www6.in.tum.de/pub/Main/TeachingWs2013MSE/CANbus.pdf
-     */
-    bool priorityHigherThan(const Frame& rhs) const;
-    bool priorityLowerThan(const Frame& rhs) const { return rhs.priorityHigherThan(*this); }
-};
-
-/**
- * RX frame data.
- */
-struct RxFrame
+struct AcceptanceFilterConfig
 {
-    std::uint32_t timestamp_usec = 0;   ///< Timestamp, see @ref TimestampRolloverIntervalUSec
-    Frame frame;
-    bool loopback = false;
-    bool failed   = false;
+    std::uint32_t id = 0;
+    std::uint32_t mask = 0;
+    bool high_priority = false;
 };
 
 /**
@@ -99,6 +57,8 @@ struct Statistics
 {
     std::uint64_t errors                  = 0;
     std::uint64_t bus_off_events          = 0;
+    std::uint64_t bus_off_recoveries      = 0;        ///< Bus-off events followed by a successful TX or RX
+    std::uint64_t bus_off_dropped_frames  = 0;        ///< TX frames dropped on bus-off, see @ref BusOffRecoveryPolicy
     std::uint64_t sw_rx_queue_overruns    = 0;
     std::uint64_t hw_rx_queue_overruns    = 0;
     std::uint64_t frames_tx               = 0;
@@ -107,9 +67,44 @@ struct Statistics
     std::uint16_t tx_queue_peak_usage     = 0;
     std::uint16_t rx_queue_capacity       = 0;
     std::uint16_t rx_queue_peak_usage     = 0;
+    std::uint16_t hp_rx_queue_capacity    = 0;        ///< High priority RX queue, see @ref AcceptanceFilterConfig
+    std::uint16_t hp_rx_queue_peak_usage  = 0;
     std::uint8_t tx_mailbox_peak_usage    = 0;
 };
 
+/**
+ * Defines what happens when the controller goes bus-off, see @ref setBusOffRecoveryPolicy().
+ *
+ * If the TX queue is not kept, the frames in the TX mailboxes are aborted, and the TX queue is flushed from the
+ * thread context shortly afterwards, together with the frames submitted in the meantime. In the loopback mode
+ * the flushed frames are reported as failed, but only while the RX queue is less than half full, so that the reports
+ * do not displace the frames received after the recovery.
+ * If the TX queue is kept, the pending frames are transmitted after the recovery.
+ *
+ * The controller rejoins the bus after 128 occurrences of 11 consecutive recessive bits. If the minimum backoff is
+ * non-zero, this sequence is started only after the backoff delay, during which the controller is detached from the
+ * bus. The delay is doubled, up to the maximum, if the bus-off happens again less than the maximum backoff after the
+ * previous recovery attempt; otherwise it starts from the minimum.
+ */
+struct BusOffRecoveryPolicy
+{
+    bool keep_tx_queue = false;
+    std::uint16_t min_backoff_ms = 0;           ///< Zero means immediate automatic recovery
+    std::uint16_t max_backoff_ms = 1000;
+};
+
+/**
+ * Bus load over the last complete one second window, including the frames transmitted by this node.
+ * The number of bits per frame is estimated, because the number of stuff bits depends on the CRC, which is not known
+ * to the software; the estimate is halfway between the best and the worst case.
+ */
+struct BusLoad
+{
+    std::uint32_t frames_per_sec = 0;
+    std::uint32_t bits_per_sec = 0;
+    std::uint16_t utilization_permill = 0;          ///< Bits per second relative to the bitrate
+};
+
 struct Status
 {
     std::uint8_t receive_error_counter = 0;
@@ -144,12 +139,40 @@ struct Status
 static constexpr unsigned OptionSilentMode = 1;
 static constexpr unsigned OptionLoopback   = 2;
 
+/**
+ * Default location of the sample point, in permill of the bit time, as recommended by CiA.
+ */
+static constexpr unsigned DefaultSamplePointPermill = 875;
+
 /**
  * Opens the channel and resets all associated statistics.
+ * The bit timings are chosen so that the bitrate is as close to the requested one as possible; among the equally
+ * close solutions, the one with the sample point nearest to the requested location is used.
  * @param bitrate
+ * @param options
+ * @param sample_point_permill
  * @return negative on error
  */
-int open(std::uint32_t bitrate, unsigned options = 0);
+int open(std::uint32_t bitrate, unsigned options = 0, unsigned sample_point_permill = DefaultSamplePointPermill);
+
+/**
+ * Detects the bitrate of the bus by opening the channel in the silent mode at every candidate bitrate in turn, until
+ * a frame is received without errors. Silent mode guarantees that the bus is not disturbed by the wrong bitrates.
+ * A wrong bitrate is usually rejected as soon as the first frame appears on the bus, because it causes bit errors.
+ * Note that the acceptance filters must accept at least some of the traffic.
+ * The channel is closed afterwards.
+ * Every candidate takes at most listen_timeout_ms + BitRateDetectionOverheadMSec, so that the caller can bound the
+ * duration of the whole sequence, e.g. to fit into a watchdog timeout.
+ * @param candidates
+ * @param num_candidates
+ * @param listen_timeout_ms     How long to wait for a frame at every candidate bitrate.
+ * @param sample_point_permill  See @ref open().
+ * @return The detected bitrate if positive; -ErrBitRateNotDetected if no frames were received at any bitrate.
+ */
+static constexpr unsigned BitRateDetectionOverheadMSec = 20;
+
+int detectBitRate(const std::uint32_t* candidates, unsigned num_candidates, std::uint16_t listen_timeout_ms,
+                  unsigned sample_point_permill = DefaultSamplePointPermill);
 
 /**
  * Closes the channel.
@@ -172,6 +195,15 @@ bool isOpen();
  */
 int send(const Frame& frame, std::uint16_t timeout_ms);
 
+/**
+ * Same as @ref send() with zero timeout, but can be invoked from any context, including interrupt handlers.
+ * @param frame
+ * @retval 0 - the TX queue is full
+ *         1 - frame successfully scheduled for transmission
+ *         negative - error
+ */
+int sendI(const Frame& frame);
+
 /**
  * It is safe to call @ref send() and @ref receive() concurrently from different threads.
  * @param out_frame
@@ -182,13 +214,176 @@ int send(const Frame& frame, std::uint16_t timeout_ms);
  */
 int receive(RxFrame& out_frame, std::uint16_t timeout_ms);
 
+/**
+ * Same as @ref receive(), but drains up to @p max_frames frames from the RX queue at once.
+ * Blocks until at least one frame is available or the timeout expires; never waits for the batch to fill up.
+ * @param out_frames
+ * @param max_frames
+ * @param timeout_ms
+ * @retval 0 - timeout
+ *         positive - number of frames received, not greater than max_frames
+ *         negative - error
+ */
+int receiveBatch(RxFrame* out_frames, unsigned max_frames, std::uint16_t timeout_ms);
+
+/**
+ * Zero-copy alternative to @ref receiveBatch(): provides access to the received frames in place.
+ * If the returned value is positive, the caller must call @ref commitReceived() from the same thread when it is done
+ * with the frames; until then the RX mutex remains locked, so the channel can't be closed while the frames are
+ * being read.
+ * @param out_frames
+ * @param max_frames
+ * @param timeout_ms
+ * @retval 0 - timeout
+ *         positive - number of frames available at out_frames, not greater than max_frames
+ *         negative - error
+ */
+int peekReceived(const RxFrame*& out_frames, unsigned max_frames, std::uint16_t timeout_ms);
+
+/**
+ * Removes the frames returned by @ref peekReceived() from the RX queue and unlocks the RX mutex.
+ * @param num_frames    Not greater than the value returned by @ref peekReceived().
+ */
+void commitReceived(unsigned num_frames);
+
+/**
+ * RX latency probe. RxFrame carries the hardware start of frame timestamp, which includes the time the frame spent
+ * on the wire; the interrupt timestamp does not fit into it, so the driver keeps it for one queued frame at a time.
+ * Once the tagged frame is committed, the next received frame is tagged; hence there is at most one sample per batch.
+ * Must be invoked between @ref peekReceived() and @ref commitReceived().
+ * @param frames                    As returned by @ref peekReceived().
+ * @param num_frames                Not greater than the value returned by @ref peekReceived().
+ * @param out_isr_timestamp_usec    Timestamp sampled at the entry of the interrupt that queued the tagged frame.
+ * @return True if the tagged frame is among the specified frames.
+ */
+bool getRxLatencyProbe(const RxFrame* frames, unsigned num_frames, std::uint32_t& out_isr_timestamp_usec);
+
+/**
+ * Configures the hardware acceptance filters. A frame is accepted if it matches at least one filter.
+ * The filters are packed into the 14 filter banks of the macrocell automatically, picking list mode for exact
+ * matches and 16-bit scale where possible; hence the capacity depends on the configuration:
+ *  - Exact standard identifiers take one quarter of a bank;
+ *  - Masked standard identifiers and exact extended identifiers take one half of a bank;
+ *  - Masked extended identifiers take one bank.
+ * Filters of different priority classes never share a bank.
+ * The configuration is kept when the channel is closed and reopened. Empty configuration accepts all frames,
+ * which is the default.
+ * @param configs
+ * @param num_configs
+ * @return negative on error, e.g. if the configuration does not fit; in that case the old configuration is kept.
+ */
+int setAcceptanceFilters(const AcceptanceFilterConfig* configs, unsigned num_configs);
+
+/**
+ * Sets the bus-off recovery policy, see @ref BusOffRecoveryPolicy.
+ * The policy takes effect when the channel is opened the next time; it is kept when the channel is closed.
+ */
+void setBusOffRecoveryPolicy(const BusOffRecoveryPolicy& policy);
+
+BusOffRecoveryPolicy getBusOffRecoveryPolicy();
+
 /**
  * Returns the statistics collected since the last @ref open() call.
- * Note that the statistics object is large, and access to it is protected by a critical section,
- * so accessing this function may introduce a few microsecond latency to communications.
+ * The counters are read without locking out the interrupts, so this function does not affect the communications,
+ * although it may block for a few microseconds if the statistics are being read by another thread.
  */
 Statistics getStatistics();
 
+/**
+ * Same as the sum of the RX overrun counters of @ref getStatistics(), but cheaper.
+ */
+std::uint64_t getRxOverrunCount();
+
+/**
+ * The interrupt handlers use 32-bit counters, which are accumulated into the 64-bit totals of @ref Statistics.
+ * This function must be invoked periodically, at least once a minute, in order to not lose the counter overflows;
+ * once per second is recommended.
+ */
+void pollStatistics();
+
+/**
+ * Returns the bus load; zero if the channel is not open. See @ref BusLoad.
+ */
+BusLoad getBusLoad();
+
+/**
+ * Returns the most active IDs on the bus, including the frames transmitted by this node, see @ref IDRateTable.
+ * The bit counters are estimated like in @ref BusLoad.
+ * The table is reset by @ref open() and by @ref resetIDRateTable().
+ * @param out_interval_usec     Time since the table was reset; it allows to compute the rates.
+ */
+IDRateTable getIDRateTable(std::uint64_t& out_interval_usec);
+
+void resetIDRateTable();
+
+/**
+ * State of the capture buffer, see @ref CaptureBuffer.
+ */
+struct CaptureStatus
+{
+    CaptureBuffer::State state = CaptureBuffer::State::Idle;
+    unsigned length = 0;
+    unsigned trigger_index = 0;             ///< See @ref CaptureBuffer::getTriggerIndex()
+};
+
+/**
+ * Starts capturing the received frames into the capture buffer, see @ref CaptureBuffer.
+ * The error state trigger fires when the controller becomes error passive or bus off.
+ * The capture buffer is not affected by @ref open() and @ref close(), so it can be read after the channel is closed.
+ */
+void armCapture(const CaptureTrigger& trigger, unsigned post_trigger_frames);
+
+void triggerCapture();
+
+void freezeCapture();
+
+CaptureStatus getCaptureStatus();
+
+/**
+ * Copies the captured frames starting from the specified index, the oldest first.
+ * @return Number of frames copied; zero if the capture is not frozen or the index is out of range.
+ */
+unsigned readCapture(unsigned index, RxFrame* out_frames, unsigned max_frames);
+
+/**
+ * Event flags broadcasted by the driver via @ref getEventSource().
+ */
+static constexpr eventflags_t EventFlagOpened       = 1;    ///< The channel has been opened
+static constexpr eventflags_t EventFlagTxQueueSpace = 2;    ///< At least one frame has left the TX queue
+
+/**
+ * Event source that allows threads to wait for the driver events together with other events, see EventFlag*.
+ * Note that reception is signaled only to the thread blocked in @ref receive() or its alternatives.
+ */
+event_source_t* getEventSource();
+
+/**
+ * Returns the number of frames that can be passed to @ref send() without blocking; zero if the channel is not open.
+ */
+unsigned getTxQueueFreeSpace();
+
+/**
+ * Returns the current timestamp, see @ref TimestampRolloverIntervalUSec.
+ * This is the same time base that is used for @ref RxFrame::timestamp_usec.
+ */
+std::uint32_t getTimestampUSec();
+
+/**
+ * Converts a timestamp (see @ref TimestampRolloverIntervalUSec) into the 64-bit microsecond time base that does not
+ * roll over; its origin is the moment when the channel was opened for the first time.
+ * The timestamp must not be older than one rollover interval, otherwise the result will be off by a multiple of it.
+ */
+std::uint64_t extendTimestampUSec(std::uint32_t timestamp_usec);
+
+/**
+ * Returns the histogram of the TX latency in microseconds, which is measured from the call to @ref send()
+ * until the entry of the TXOK interrupt, i.e. it includes the transmission of the frame.
+ * The histogram is not affected by @ref open().
+ */
+LatencyHistogram getTxLatencyHistogram();
+
+void resetTxLatencyHistogram();
+
 /**
  * Returns current state of the CAN controller.
  * If the channel is not open, this function may return garbage.
@@ -0,0 +1,174 @@
+/*
+ * Copyright (C) 2015 Pavel Kirienko <pavel.kirienko@gmail.com>
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <cassert>
+
+/*
+ * This header does not depend on the OS, so that it can be used on the host as well.
+ * The branch prediction hints are the same as in the OS headers.
+ */
+#ifndef LIKELY
+# define LIKELY(x)      (__builtin_expect((x), true))
+#endif
+#ifndef UNLIKELY
+# define UNLIKELY(x)    (__builtin_expect((x), false))
+#endif
+
+namespace can
+{
+/**
+ * SLCAN protocol requires the timestamp to be in the range from 0 to 60'000 milliseconds (not inclusive).
+ * We could start a 16-bit timer at 1 kHz and use it for timestamping, but at our clock rates we can't make a timer
+ * run slow enough. We can't slow down PCLK1 either, because the CAN macrocell requires at least 36 MHz clock
+ * for accurate bit timings. We could resort to slowing down PCLK2 and using a PCLK2-clocked timer, but sadly
+ * ChibiOS does not support PCLK2 timers, and also we have some other peripheral there like SPI which may benefit
+ * from higher clock rates.
+ * So the solution is to take a 32-bit timer and run it at a faster rate. This also forces a good idea of increasing
+ * the resolution of timestamps to 1 microsecond (while keeping the interval exactly 1 minute for compatibility
+ * reasons).
+ */
+static constexpr std::uint32_t TimestampRolloverIntervalUSec = 60 * 1000 * 1000;
+
+/**
+ * Returns the interval between two timestamps taking the rollover into account.
+ */
+inline std::uint32_t computeTimestampDeltaUSec(std::uint32_t earlier, std::uint32_t later)
+{
+    return (later >= earlier) ? (later - earlier) : (later + TimestampRolloverIntervalUSec - earlier);
+}
+
+/**
+ * Frame definition like in libuavcan
+ */
+struct Frame
+{
+    static constexpr std::uint32_t MaskStdID = 0x000007FFU;
+    static constexpr std::uint32_t MaskExtID = 0x1FFFFFFFU;
+    static constexpr std::uint32_t FlagEFF = 1U << 31;          ///< Extended frame format
+    static constexpr std::uint32_t FlagRTR = 1U << 30;          ///< Remote transmission request
+    static constexpr std::uint32_t FlagERR = 1U << 29;          ///< Error frame
+
+    static constexpr std::uint8_t MaxDataLen = 8;
+
+    std::uint32_t id = 0;                                       ///< CAN ID with flags (above)
+    std::uint8_t data[MaxDataLen] = {};
+    std::uint8_t dlc = 0;                                       ///< Data Length Code
+
+    Frame() { }
+
+    Frame(std::uint32_t can_id, const void* can_data, std::uint8_t data_len) :
+        id(can_id),
+        dlc(data_len)
+    {
+        assert(can_data != nullptr);
+        assert(data_len <= MaxDataLen);
+        (void)std::memcpy(this->data, can_data, data_len);
+    }
+
+    bool isExtended()                  const { return id & FlagEFF; }
+    bool isRemoteTransmissionRequest() const { return id & FlagRTR; }
+    bool isErrorFrame()                const { return id & FlagERR; }
+
+    /**
+     * CAN frame arbitration rules, particularly STD vs EXT:
+     *     Marco Di Natale - "Understanding and using the Controller Area Network"
+     *     http://www6.in.tum.de/pub/Main/TeachingWs2013MSE/CANbus.pdf
+     */
+    bool priorityHigherThan(const Frame& rhs) const;
+    bool priorityLowerThan(const Frame& rhs) const { return rhs.priorityHigherThan(*this); }
+};
+
+/**
+ * RX frame data, 16 bytes per frame.
+ * Frame can't be embedded as is, because its DLC field is padded to a full word; instead, the DLC and the flags are
+ * stored in the spare bits of the timestamp, which never exceeds 26 bits. Use @ref getFrame() and @ref setFrame().
+ */
+struct RxFrame
+{
+    std::uint32_t id = 0;                                       ///< See Frame::id
+    std::uint8_t data[Frame::MaxDataLen] = {};
+
+    /**
+     * Timestamp of the start of frame, see @ref TimestampRolloverIntervalUSec.
+     * It is derived from the hardware timestamp captured by the macrocell, so it is not affected by the interrupt
+     * latency. Timestamps of failed loopback frames are taken at the interrupt instead.
+     */
+    std::uint32_t timestamp_usec : 26;
+    std::uint32_t dlc            : 4;
+    bool loopback : 1;
+    bool failed   : 1;
+
+    RxFrame() :
+        timestamp_usec(0),
+        dlc(0),
+        loopback(false),
+        failed(false)
+    { }
+
+    Frame getFrame() const
+    {
+        Frame f;
+        f.id = id;
+        f.dlc = std::uint8_t(dlc);
+        (void)std::memcpy(f.data, data, Frame::MaxDataLen);
+        return f;
+    }
+
+    void setFrame(const Frame& f)
+    {
+        id = f.id;
+        dlc = f.dlc;
+        (void)std::memcpy(data, f.data, Frame::MaxDataLen);
+    }
+};
+
+static_assert(TimestampRolloverIntervalUSec < (1U << 26), "Timestamp does not fit RxFrame::timestamp_usec");
+static_assert(Frame::MaxDataLen < (1U << 4), "DLC does not fit RxFrame::dlc");
+static_assert(sizeof(RxFrame) == 16, "RxFrame is not packed");
+
+inline bool Frame::priorityHigherThan(const Frame& rhs) const
+{
+    const std::uint32_t clean_id     = id     & MaskExtID;
+    const std::uint32_t rhs_clean_id = rhs.id & MaskExtID;
+
+    /*
+     * STD vs EXT - if 11 most significant bits are the same, EXT loses.
+     */
+    const bool ext     = id     & FlagEFF;
+    const bool rhs_ext = rhs.id & FlagEFF;
+    if UNLIKELY(ext != rhs_ext)
+    {
+        const std::uint32_t arb11     = ext     ? (clean_id >> 18)     : clean_id;
+        const std::uint32_t rhs_arb11 = rhs_ext ? (rhs_clean_id >> 18) : rhs_clean_id;
+        if (arb11 != rhs_arb11)
+        {
+            return arb11 < rhs_arb11;
+        }
+        else
+        {
+            return rhs_ext;
+        }
+    }
+
+    /*
+     * RTR vs Data frame - if frame identifiers and frame types are the same, RTR loses.
+     */
+    const bool rtr     = id     & FlagRTR;
+    const bool rhs_rtr = rhs.id & FlagRTR;
+    if UNLIKELY(clean_id == rhs_clean_id && rtr != rhs_rtr)
+    {
+        return rhs_rtr;
+    }
+
+    /*
+     * Plain ID arbitration - greater value loses.
+     */
+    return clean_id < rhs_clean_id;
+}
+
+}
@@ -0,0 +1,313 @@
+/*
+ * Copyright (C) 2015 Pavel Kirienko <pavel.kirienko@gmail.com>
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cassert>
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include "can_frame.hpp"
+
+/**
+ * Software RX and TX queues of the driver. They do not depend on the OS, the synchronization is the caller's
+ * responsibility, as described below.
+ */
+namespace can
+{
+
+/**
+ * Lock-free single producer single consumer ring buffer.
+ * The producer is the set of CAN interrupt handlers, which share the same priority level, so they can't preempt
+ * each other; the consumer is the thread that holds the RX mutex.
+ * The indices are free-running; since the capacity is a power of two, wraparound is handled by masking.
+ * When the queue is full, new frames are dropped, because the producer can't modify the consumer's index.
+ */
+template <unsigned Capacity_>
+class RxQueue
+{
+    static constexpr unsigned Capacity = Capacity_;
+    static constexpr unsigned IndexMask = Capacity - 1;
+
+    static_assert((Capacity > 0) && ((Capacity & IndexMask) == 0), "Capacity must be a power of two");
+
+    RxFrame buf_[Capacity];
+    std::atomic<std::uint32_t> in_{0};          ///< Modified only by the producer
+    std::atomic<std::uint32_t> out_{0};         ///< Modified only by the consumer
+    std::uint32_t peak_len_ = 0;
+
+public:
+    /**
+     * Producer only.
+     * @retval true - OK, false - Overflow
+     */
+    bool push(const RxFrame& frame)
+    {
+        const std::uint32_t in = in_.load(std::memory_order_relaxed);
+        const std::uint32_t len = in - out_.load(std::memory_order_acquire);
+        if UNLIKELY(len >= Capacity)
+        {
+            return false;
+        }
+
+        buf_[in & IndexMask] = frame;
+        in_.store(in + 1, std::memory_order_release);
+
+        if UNLIKELY(peak_len_ <= len)
+        {
+            peak_len_ = len + 1;
+        }
+        return true;
+    }
+
+    /**
+     * Producer only.
+     * @return The frame that was stored by the last successful push(); the queue must not be empty.
+     */
+    const RxFrame* getNewest() const
+    {
+        return &buf_[(in_.load(std::memory_order_relaxed) - 1U) & IndexMask];
+    }
+
+    /**
+     * Consumer only.
+     * Provides access to the oldest frames in place, without removing them from the queue.
+     * @return Number of frames that are stored contiguously starting from out_frames; zero if the queue is empty.
+     */
+    unsigned peek(const RxFrame*& out_frames) const
+    {
+        const std::uint32_t out = out_.load(std::memory_order_relaxed);
+        const std::uint32_t len = in_.load(std::memory_order_acquire) - out;
+        const unsigned index = out & IndexMask;
+        out_frames = &buf_[index];
+        return std::min<unsigned>(len, Capacity - index);
+    }
+
+    /**
+     * Consumer only.
+     * Removes the specified number of the oldest frames from the queue.
+     */
+    void commit(unsigned num_frames)
+    {
+        assert(num_frames <= getLength());
+        out_.store(out_.load(std::memory_order_relaxed) + num_frames, std::memory_order_release);
+    }
+
+    unsigned getLength() const
+    {
+        return in_.load(std::memory_order_acquire) - out_.load(std::memory_order_acquire);
+    }
+
+    unsigned getPeakUsage() const { return peak_len_; }
+    unsigned getCapacity() const  { return Capacity; }
+};
+
+/**
+ * Priority queue of the frames pending transmission, ordered by the CAN arbitration rules; frames of equal priority
+ * are transmitted in the order of insertion. See the host tests in firmware/test.
+ */
+template <unsigned Capacity_>
+class TxQueue
+{
+    static constexpr unsigned Capacity = Capacity_;
+
+    static_assert(Capacity > 0, "Capacity must be positive");
+
+    struct TxFrame
+    {
+        Frame frame;
+        std::uint32_t sequence_number;      ///< Frames of equal priority are transmitted in the order of insertion
+        std::uint32_t submitted_at_usec;    ///< For latency measurement
+
+        TxFrame(const Frame& f, std::uint32_t seq, std::uint32_t ts) :
+            frame(f),
+            sequence_number(seq),
+            submitted_at_usec(ts)
+        { }
+
+        bool goesBefore(const TxFrame& rhs) const
+        {
+            if (frame.priorityHigherThan(rhs.frame))
+            {
+                return true;
+            }
+            if (rhs.frame.priorityHigherThan(frame))
+            {
+                return false;
+            }
+            return std::int32_t(sequence_number - rhs.sequence_number) < 0;     // Overflow-safe comparison
+        }
+    };
+
+    class Allocator
+    {
+        union Node
+        {
+            alignas(TxFrame) std::uint8_t data[sizeof(TxFrame)];
+            Node* next;
+        };
+
+        alignas(Node) std::uint8_t pool_[Capacity * sizeof(Node)];
+        Node* free_list_;
+
+        unsigned used_ = 0;
+        unsigned max_used_ = 0;
+
+    public:
+        Allocator() :
+            free_list_(reinterpret_cast<Node*>(pool_))
+        {
+            (void)std::fill_n(pool_, sizeof(pool_), 0);
+            for (unsigned i = 0; (i + 1) < (Capacity - 1 + 1); i++) // -Werror=type-limits
+            {
+                // coverity[dead_error_line : FALSE]
+                free_list_[i].next = free_list_ + i + 1;
+            }
+            free_list_[Capacity - 1].next = nullptr;
+        }
+
+        template <typename... Args>
+        TxFrame* allocate(Args... args)
+        {
+            if UNLIKELY(free_list_ == nullptr)
+            {
+                return nullptr;
+            }
+
+            void* const pmem = free_list_;
+            free_list_ = free_list_->next;
+
+            // Statistics
+            assert(used_ < Capacity);
+            used_++;
+            if UNLIKELY(used_ > max_used_)
+            {
+                max_used_ = used_;
+            }
+
+            return new (pmem) TxFrame(args...);
+        }
+
+        void deallocate(void* ptr)
+        {
+            if UNLIKELY(ptr == nullptr)
+            {
+                assert(false);
+                return;
+            }
+
+            auto p = static_cast<Node*>(ptr);
+            p->next = free_list_;
+            free_list_ = p;
+
+            // Statistics
+            assert(used_ > 0);
+            used_--;
+        }
+
+        unsigned getPeakNumUsedBlocks() const { return max_used_; }
+    };
+
+    /*
+     * Binary min-heap of pointers to the frames allocated from the pool, ordered by TxFrame::goesBefore().
+     * Both push and pop take at most log2(Capacity) steps (7 for 100 entries), regardless of the frame priorities;
+     * the linked list that was used before required a linear search.
+     */
+    Allocator allocator_;
+    TxFrame* heap_[Capacity] = {};
+    unsigned size_ = 0;
+    std::uint32_t sequence_counter_ = 0;
+
+public:
+    bool push(const Frame& frame, const std::uint32_t submitted_at_usec)
+    {
+        auto* const txf = allocator_.allocate(frame, sequence_counter_, submitted_at_usec);
+        if UNLIKELY(txf == nullptr)
+        {
+            return false;
+        }
+        sequence_counter_++;
+
+        // Sifting up
+        assert(size_ < Capacity);
+        unsigned index = size_++;
+        while (index > 0)
+        {
+            const unsigned parent = (index - 1) / 2;
+            if LIKELY(!txf->goesBefore(*heap_[parent]))
+            {
+                break;
+            }
+            heap_[index] = heap_[parent];
+            index = parent;
+        }
+        heap_[index] = txf;
+
+        return true;
+    }
+
+    void pop()
+    {
+        if LIKELY(size_ > 0)
+        {
+            auto* const top = heap_[0];
+            top->~TxFrame();
+            allocator_.deallocate(top);
+
+            // Sifting down the last element from the root
+            size_--;
+            auto* const last = heap_[size_];
+            heap_[size_] = nullptr;
+
+            unsigned index = 0;
+            if LIKELY(size_ > 0)
+            {
+                while (true)
+                {
+                    unsigned child = index * 2 + 1;
+                    if (child >= size_)
+                    {
+                        break;
+                    }
+                    if (((child + 1) < size_) && heap_[child + 1]->goesBefore(*heap_[child]))
+                    {
+                        child++;
+                    }
+                    if (!heap_[child]->goesBefore(*last))
+                    {
+                        break;
+                    }
+                    heap_[index] = heap_[child];
+                    index = child;
+                }
+                heap_[index] = last;
+            }
+        }
+        else
+        {
+            assert(false);
+        }
+    }
+
+    const Frame* peek() const
+    {
+        return (size_ == 0) ? nullptr : &heap_[0]->frame;
+    }
+
+    /**
+     * Returns the submission timestamp of the frame returned by @ref peek(); the queue must not be empty.
+     */
+    std::uint32_t getTopSubmissionTimestamp() const
+    {
+        assert(size_ > 0);
+        return heap_[0]->submitted_at_usec;
+    }
+
+    unsigned getLength() const { return size_; }
+    unsigned getPeakUsage() const { return allocator_.getPeakNumUsedBlocks(); }
+    unsigned getCapacity() const { return Capacity; }
+};
+
+}
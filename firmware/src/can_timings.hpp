@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2015 Pavel Kirienko <pavel.kirienko@gmail.com>
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <algorithm>
+
+namespace can
+{
+/**
+ * Bit timing register values of the bxCAN macrocell. This header does not depend on the OS.
+ */
+struct Timings
+{
+    std::uint16_t prescaler = 0;
+    std::uint8_t sjw = 0;
+    std::uint8_t bs1 = 0;
+    std::uint8_t bs2 = 0;
+
+    /// The register values are offset by one
+    std::uint32_t getPCLKPerBit() const { return (prescaler + 1U) * (3U + bs1 + bs2); }
+    unsigned getQuantaPerBit() const { return 3U + bs1 + bs2; }
+    unsigned getSamplePointPermill() const { return (1000U * (2U + bs1)) / getQuantaPerBit(); }
+};
+
+/**
+ * Finds the timings that provide the closest bitrate, enumerating all valid combinations of the prescaler and the
+ * number of time quanta per bit. Among the solutions with the same bitrate error, the one with the sample point
+ * closest to the target is preferred, then the one with the highest number of quanta per bit, because it allows
+ * finer resynchronization.
+ * @param pclk      Clock rate of the macrocell, in hertz
+ * @return True if a solution was found, false if the bitrate is not supported.
+ */
+inline bool computeTimings(const std::uint32_t pclk, const std::uint32_t target_bitrate,
+                           const unsigned target_sample_point_permill, Timings& out_timings)
+{
+    if (target_bitrate < 1)
+    {
+        return false;
+    }
+
+    /*
+     * Hardware configuration
+     */
+
+    static constexpr unsigned MaxBS1 = 16;
+    static constexpr unsigned MaxBS2 = 8;
+    static constexpr unsigned MaxPrescaler = 1024;
+    static constexpr unsigned MinQuantaPerBit = 8;              ///< Fewer quanta don't allow proper resynchronization
+
+    /*
+     * The bitrate error must be well within the oscillator tolerance allowed by CAN.
+     * The worst case tolerance is defined by SJW; with SJW of one quantum and 25 quanta per bit it is about 0.2%.
+     */
+    static constexpr std::uint32_t MaxBitRateErrorPPM = 1000;
+
+    /*
+     *   BITRATE = PCLK / (PRESCALER * (1 + BS1 + BS2))                 -- See the Reference Manual
+     *   SAMPLE POINT = (1 + BS1) / (1 + BS1 + BS2)
+     * For every number of quanta per bit, only the nearest prescaler values are worth checking, and the sample point
+     * depends only on the number of quanta, so the complete search space is covered in a few dozen iterations.
+     */
+    struct Solution
+    {
+        std::uint32_t error_ppm = 0xFFFFFFFFU;
+        unsigned sample_point_error_permill = 0xFFFFFFFFU;
+        unsigned prescaler = 0;
+        unsigned bs1 = 0;
+        unsigned bs2 = 0;
+
+        bool isBetterThan(const Solution& rhs) const
+        {
+            if (error_ppm != rhs.error_ppm)
+            {
+                return error_ppm < rhs.error_ppm;
+            }
+            if (sample_point_error_permill != rhs.sample_point_error_permill)
+            {
+                return sample_point_error_permill < rhs.sample_point_error_permill;
+            }
+            return (bs1 + bs2) > (rhs.bs1 + rhs.bs2);
+        }
+    } best;
+
+    for (unsigned quanta = MinQuantaPerBit; quanta <= (1 + MaxBS1 + MaxBS2); quanta++)
+    {
+        // Placing the sample point; bs1 = quanta * sample_point - 1, rounded to nearest; unsigned, mind the wrap
+        const unsigned bs1_min = (quanta > (MaxBS2 + 1)) ? (quanta - 1 - MaxBS2) : 1;
+        const unsigned bs1_nominal = (quanta * target_sample_point_permill + 500) / 1000;
+        const unsigned bs1 = std::min(MaxBS1, std::max(bs1_min, (bs1_nominal > 1) ? (bs1_nominal - 1) : 1U));
+        const unsigned bs2 = quanta - 1 - bs1;
+        if ((bs1 < 1) || (bs2 < 1) || (bs2 > MaxBS2))
+        {
+            continue;
+        }
+
+        const unsigned sample_point_permill = (1000 * (1 + bs1)) / quanta;
+
+        const std::uint32_t prescaler_center = pclk / (target_bitrate * quanta);
+        for (unsigned prescaler = std::max(1U, prescaler_center); prescaler <= (prescaler_center + 1); prescaler++)
+        {
+            if (prescaler > MaxPrescaler)
+            {
+                break;
+            }
+
+            const std::uint32_t bitrate = pclk / (prescaler * quanta);
+            const std::uint32_t abs_error = (bitrate > target_bitrate) ? (bitrate - target_bitrate) :
+                                                                         (target_bitrate - bitrate);
+            Solution s;
+            s.error_ppm = std::uint32_t((std::uint64_t(abs_error) * 1000000U) / target_bitrate);
+            s.sample_point_error_permill = (sample_point_permill > target_sample_point_permill) ?
+                                           (sample_point_permill - target_sample_point_permill) :
+                                           (target_sample_point_permill - sample_point_permill);
+            s.prescaler = prescaler;
+            s.bs1 = bs1;
+            s.bs2 = bs2;
+
+            if (s.isBetterThan(best))
+            {
+                best = s;
+            }
+        }
+    }
+
+    if (best.error_ppm > MaxBitRateErrorPPM)
+    {
+        return false;                           // No solution
+    }
+
+    out_timings.prescaler = std::uint16_t(best.prescaler - 1U);
+    out_timings.sjw = 0;                                        // Which means one
+    out_timings.bs1 = std::uint8_t(best.bs1 - 1);
+    out_timings.bs2 = std::uint8_t(best.bs2 - 1);
+    return true;
+}
+
+}
@@ -0,0 +1,214 @@
+/*
+ * Copyright (C) 2015  Zubax Robotics  <info@zubax.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+/**
+ * Trigger condition of @ref CaptureBuffer.
+ * A frame matches if (frame.id & id_mask) == (id & id_mask), and every data byte selected by data_mask matches
+ * the pattern; the frame must be long enough to contain all selected bytes.
+ */
+struct CaptureTrigger
+{
+    bool on_frame = false;
+    std::uint32_t id = 0;                       ///< Same format as can::Frame::id, including the flags
+    std::uint32_t id_mask = 0;
+    std::uint8_t data[8] = {};
+    std::uint8_t data_mask[8] = {};
+
+    bool on_error_state = false;                ///< Fires when the controller becomes error passive or bus off
+
+    bool matches(const std::uint32_t frame_id, const std::uint8_t* const frame_data, const std::uint8_t dlc) const
+    {
+        if (!on_frame || (((frame_id ^ id) & id_mask) != 0))
+        {
+            return false;
+        }
+        for (unsigned i = 0; i < 8; i++)
+        {
+            if ((data_mask[i] != 0) && ((i >= dlc) || (((frame_data[i] ^ data[i]) & data_mask[i]) != 0)))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+/**
+ * Circular buffer of received frames that keeps recording until a trigger condition is met, then records the
+ * requested number of post-trigger frames and freezes, so that the frames around the event can be read out
+ * at any pace afterwards. It is updated from the RX interrupt, so it does not lose frames when the host link is
+ * slower than the bus.
+ * Records are kept compact because the buffer competes with the RX queues for RAM.
+ * This class is not thread safe; access must be synchronized externally.
+ */
+class CaptureBuffer
+{
+public:
+    static constexpr unsigned Capacity = 128;
+
+    enum class State : std::uint8_t
+    {
+        Idle,                   ///< Not recording, the buffer is empty
+        Armed,                  ///< Recording, waiting for the trigger
+        Triggered,              ///< Recording the post-trigger frames
+        Frozen                  ///< Not recording, the buffer can be read
+    };
+
+    struct Record
+    {
+        std::uint32_t timestamp_usec;
+        std::uint32_t id;
+        std::uint8_t data[8];
+        std::uint8_t dlc;
+    };
+
+private:
+    Record records_[Capacity];
+    unsigned next_ = 0;                         ///< Where the next record will be written
+    unsigned length_ = 0;
+    unsigned post_trigger_frames_ = 0;
+    unsigned frames_since_trigger_ = 0;
+    CaptureTrigger trigger_;
+    State state_ = State::Idle;
+
+    /// The frames are counted by add(), including the trigger frame
+    void fire()
+    {
+        state_ = State::Triggered;
+        frames_since_trigger_ = 0;
+    }
+
+    /// Triggers that are not frames freeze immediately if no post-trigger frames are needed
+    void fireWithoutFrame()
+    {
+        fire();
+        if (post_trigger_frames_ == 0)
+        {
+            state_ = State::Frozen;
+        }
+    }
+
+public:
+    /**
+     * Discards the recorded frames and starts recording.
+     * @param post_trigger_frames   Frames to record after the trigger fires, including the trigger frame itself;
+     *                              it is limited by the capacity minus one, so that at least one frame is kept from
+     *                              before the trigger.
+     */
+    void arm(const CaptureTrigger& trigger, const unsigned post_trigger_frames)
+    {
+        next_ = 0;
+        length_ = 0;
+        post_trigger_frames_ = (post_trigger_frames < Capacity) ? post_trigger_frames : (Capacity - 1);
+        frames_since_trigger_ = 0;
+        trigger_ = trigger;
+        state_ = State::Armed;
+    }
+
+    /**
+     * Fires the trigger manually; has no effect unless armed.
+     */
+    void trigger()
+    {
+        if (state_ == State::Armed)
+        {
+            fireWithoutFrame();
+        }
+    }
+
+    /**
+     * Stops recording immediately, keeping the recorded frames.
+     */
+    void freeze()
+    {
+        if ((state_ == State::Armed) || (state_ == State::Triggered))
+        {
+            state_ = State::Frozen;
+        }
+    }
+
+    void add(const std::uint32_t timestamp_usec, const std::uint32_t id,
+             const std::uint8_t* const data, const std::uint8_t dlc)
+    {
+        if ((state_ != State::Armed) && (state_ != State::Triggered))
+        {
+            return;
+        }
+
+        Record& r = records_[next_];
+        r.timestamp_usec = timestamp_usec;
+        r.id = id;
+        std::memcpy(r.data, data, sizeof(r.data));
+        r.dlc = dlc;
+
+        next_ = (next_ + 1 < Capacity) ? (next_ + 1) : 0;
+        length_ = (length_ < Capacity) ? (length_ + 1) : Capacity;
+
+        if ((state_ == State::Armed) && trigger_.matches(id, data, dlc))
+        {
+            fire();
+        }
+
+        if (state_ == State::Triggered)
+        {
+            frames_since_trigger_++;
+            if (frames_since_trigger_ >= post_trigger_frames_)
+            {
+                state_ = State::Frozen;
+            }
+        }
+    }
+
+    void notifyErrorState()
+    {
+        if ((state_ == State::Armed) && trigger_.on_error_state)
+        {
+            fireWithoutFrame();
+        }
+    }
+
+    State getState() const { return state_; }
+
+    unsigned getLength() const { return length_; }
+
+    /**
+     * Index of the first frame recorded after the trigger fired (the trigger frame itself, if it was a frame);
+     * equals the length if the trigger has not fired.
+     */
+    unsigned getTriggerIndex() const
+    {
+        return ((state_ == State::Triggered) || (state_ == State::Frozen)) ? (length_ - frames_since_trigger_)
+                                                                           : length_;
+    }
+
+    /**
+     * Returns the record by index, the oldest first; the index must be less than the length.
+     */
+    const Record& getRecord(const unsigned index) const
+    {
+        const unsigned oldest = (length_ < Capacity) ? 0 : next_;
+        const unsigned i = oldest + index;
+        return records_[(i < Capacity) ? i : (i - Capacity)];
+    }
+};
@@ -0,0 +1,171 @@
+/*
+ * Copyright (C) 2015  Zubax Robotics  <info@zubax.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+#pragma once
+
+#include <cstdint>
+
+/**
+ * ASCII hex conversion for the SLCAN hot path, shared by the frame encoder, the frame parsers, and the commands.
+ * The conversion is table-driven; the tables are defined in hex_codec.cpp and allocated in RAM, because it is faster
+ * than flash.
+ * The input is validated in the same pass: the decoding table maps invalid characters to a value with the highest
+ * bit set, which is accumulated across the digits and checked once at the end.
+ * Upper and lower case digits are accepted; the output is always upper case.
+ */
+namespace hex_codec
+{
+
+static constexpr std::uint8_t InvalidNibble = 0xFF;
+
+/**
+ * Upper case hex digits indexed by their values.
+ */
+extern std::uint8_t Nibble2HexTable[16];
+
+/**
+ * Nibble values indexed by characters; @ref InvalidNibble for anything that is not a hex digit.
+ */
+extern std::uint8_t Hex2NibbleTable[256];
+
+inline std::uint8_t nibble2hex(const std::uint8_t x)
+{
+    return Nibble2HexTable[x & 0x0F];
+}
+
+/**
+ * @return Value of the hex digit, or @ref InvalidNibble if the character is not a hex digit.
+ */
+inline std::uint8_t hex2nibble(const char ch)
+{
+    return Hex2NibbleTable[std::uint8_t(ch)];
+}
+
+/**
+ * Converts (2 * num_bytes) hex digits into bytes.
+ * Exactly (2 * num_bytes) characters are read from the input; it does not need to be null terminated.
+ * @return True if all digits are valid; otherwise the output is undefined.
+ */
+inline bool decodeBytes(const char* in, std::uint8_t* out, unsigned num_bytes)
+{
+    unsigned errors = 0;
+    while (num_bytes --> 0)
+    {
+        const std::uint8_t high = hex2nibble(in[0]);
+        const std::uint8_t low = hex2nibble(in[1]);
+        errors |= high | low;
+        *out++ = std::uint8_t((high << 4) | low);
+        in += 2;
+    }
+    return (errors & 0x80U) == 0;
+}
+
+/**
+ * Converts bytes into (2 * num_bytes) hex digits.
+ * @return Pointer past the last written character.
+ */
+inline std::uint8_t* encodeBytes(const std::uint8_t* in, unsigned num_bytes, std::uint8_t* out)
+{
+    for (unsigned i = 0; i < num_bytes; i++)
+    {
+        const std::uint8_t byte = in[i];
+        *out++ = nibble2hex(byte >> 4);
+        *out++ = nibble2hex(byte);
+    }
+    return out;
+}
+
+/**
+ * Converts eight hex digits into a 32-bit value.
+ * Exactly eight characters are read from the input; it does not need to be null terminated.
+ * @return True if all digits are valid; otherwise the output is undefined.
+ */
+inline bool decodeU32(const char* const in, std::uint32_t& out_value)
+{
+    const std::uint8_t n0 = hex2nibble(in[0]);
+    const std::uint8_t n1 = hex2nibble(in[1]);
+    const std::uint8_t n2 = hex2nibble(in[2]);
+    const std::uint8_t n3 = hex2nibble(in[3]);
+    const std::uint8_t n4 = hex2nibble(in[4]);
+    const std::uint8_t n5 = hex2nibble(in[5]);
+    const std::uint8_t n6 = hex2nibble(in[6]);
+    const std::uint8_t n7 = hex2nibble(in[7]);
+    out_value = (std::uint32_t(n0) << 28) | (std::uint32_t(n1) << 24) | (std::uint32_t(n2) << 20) |
+                (std::uint32_t(n3) << 16) | (std::uint32_t(n4) << 12) | (std::uint32_t(n5) << 8) |
+                (std::uint32_t(n6) << 4) | std::uint32_t(n7);
+    return ((n0 | n1 | n2 | n3 | n4 | n5 | n6 | n7) & 0x80U) == 0;
+}
+
+/**
+ * Converts a 32-bit value into eight hex digits.
+ * @return Pointer past the last written character.
+ */
+inline std::uint8_t* encodeU32(const std::uint32_t value, std::uint8_t* const out)
+{
+    out[0] = nibble2hex(std::uint8_t(value >> 28));
+    out[1] = nibble2hex(std::uint8_t(value >> 24));
+    out[2] = nibble2hex(std::uint8_t(value >> 20));
+    out[3] = nibble2hex(std::uint8_t(value >> 16));
+    out[4] = nibble2hex(std::uint8_t(value >> 12));
+    out[5] = nibble2hex(std::uint8_t(value >> 8));
+    out[6] = nibble2hex(std::uint8_t(value >> 4));
+    out[7] = nibble2hex(std::uint8_t(value >> 0));
+    return out + 8;
+}
+
+/**
+ * Converts the 16 least significant bits of the value into four hex digits, e.g. the SLCAN timestamp.
+ * @return Pointer past the last written character.
+ */
+inline std::uint8_t* encodeU16(const std::uint32_t value, std::uint8_t* const out)
+{
+    out[0] = nibble2hex(std::uint8_t(value >> 12));
+    out[1] = nibble2hex(std::uint8_t(value >> 8));
+    out[2] = nibble2hex(std::uint8_t(value >> 4));
+    out[3] = nibble2hex(std::uint8_t(value >> 0));
+    return out + 4;
+}
+
+/**
+ * Converts three hex digits into a value, which is intended for 11-bit CAN identifiers.
+ * Exactly three characters are read from the input.
+ * @return True if all digits are valid; otherwise the output is undefined.
+ */
+inline bool decodeU12(const char* const in, std::uint32_t& out_value)
+{
+    const std::uint8_t n0 = hex2nibble(in[0]);
+    const std::uint8_t n1 = hex2nibble(in[1]);
+    const std::uint8_t n2 = hex2nibble(in[2]);
+    out_value = (std::uint32_t(n0) << 8) | (std::uint32_t(n1) << 4) | std::uint32_t(n2);
+    return ((n0 | n1 | n2) & 0x80U) == 0;
+}
+
+/**
+ * Converts the 12 least significant bits of the value into three hex digits.
+ * @return Pointer past the last written character.
+ */
+inline std::uint8_t* encodeU12(const std::uint32_t value, std::uint8_t* const out)
+{
+    out[0] = nibble2hex(std::uint8_t(value >> 8));
+    out[1] = nibble2hex(std::uint8_t(value >> 4));
+    out[2] = nibble2hex(std::uint8_t(value >> 0));
+    return out + 3;
+}
+
+}
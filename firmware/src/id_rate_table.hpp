@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2015  Zubax Robotics  <info@zubax.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <algorithm>
+
+/**
+ * Fixed memory table of the most frequent CAN IDs, cheap enough to be updated from the interrupt handlers.
+ * It implements the Space-Saving algorithm (A. Metwally et al., "Efficient Computation of Frequent and Top-k Elements
+ * in Data Streams", 2005):
+ *  - If the ID is in the table, its counters are incremented.
+ *  - Otherwise, the entry with the smallest frame count is taken over by the new ID, and the counters are inherited.
+ *    The inherited frame count is the upper bound of the overestimation, it is stored in the field frames_error.
+ * Every ID that takes more than 1/NumEntries of all frames is guaranteed to be in the table.
+ * This class is not thread safe; access must be synchronized externally.
+ */
+class IDRateTable
+{
+public:
+    static constexpr unsigned NumEntries = 16;
+
+    struct Entry
+    {
+        std::uint32_t id = 0;                   ///< Same format as can::Frame::id, including the flags
+        std::uint32_t frames = 0;
+        std::uint32_t frames_error = 0;         ///< The counters may be overestimated by up to this number of frames
+        std::uint64_t bits = 0;
+    };
+
+private:
+    Entry entries_[NumEntries];
+    unsigned num_used_ = 0;
+
+public:
+    void add(const std::uint32_t id, const unsigned bits)
+    {
+        for (unsigned i = 0; i < num_used_; i++)
+        {
+            if (entries_[i].id == id)
+            {
+                entries_[i].frames++;
+                entries_[i].bits += bits;
+                return;
+            }
+        }
+
+        Entry* entry = nullptr;
+        if (num_used_ < NumEntries)
+        {
+            entry = &entries_[num_used_++];
+        }
+        else
+        {
+            entry = std::min_element(&entries_[0], &entries_[NumEntries],
+                                     [](const Entry& a, const Entry& b) { return a.frames < b.frames; });
+            entry->frames_error = entry->frames;
+        }
+
+        entry->id = id;
+        entry->frames++;
+        entry->bits += bits;
+    }
+
+    void reset() { *this = IDRateTable(); }
+
+    unsigned getNumEntries() const { return num_used_; }
+
+    const Entry& getEntry(unsigned index) const { return entries_[std::min(index, NumEntries - 1)]; }
+};
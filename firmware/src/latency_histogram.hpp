@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2015  Zubax Robotics  <info@zubax.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <algorithm>
+
+/**
+ * Fixed memory histogram of latency values with logarithmic buckets.
+ * Bucket 0 counts zero values; bucket N counts values in the range [2^(N-1), 2^N).
+ * This class is not thread safe; access must be synchronized externally.
+ */
+class LatencyHistogram
+{
+public:
+    static constexpr unsigned NumBuckets = 27;          ///< 2^26 usec is more than the timestamp rollover interval
+
+private:
+    std::uint32_t buckets_[NumBuckets] = {};
+    std::uint32_t count_ = 0;
+    std::uint32_t min_ = 0xFFFFFFFFU;
+    std::uint32_t max_ = 0;
+
+public:
+    void add(const std::uint32_t value)
+    {
+        const unsigned index = (value == 0) ? 0 : unsigned(32 - __builtin_clz(value));
+        buckets_[std::min(index, NumBuckets - 1)]++;
+        count_++;
+        min_ = std::min(min_, value);
+        max_ = std::max(max_, value);
+    }
+
+    void reset() { *this = LatencyHistogram(); }
+
+    std::uint32_t getCount() const { return count_; }
+    std::uint32_t getMin() const { return (count_ > 0) ? min_ : 0; }
+    std::uint32_t getMax() const { return max_; }
+
+    std::uint32_t getBucketCount(unsigned index) const { return (index < NumBuckets) ? buckets_[index] : 0; }
+
+    /**
+     * Returns the exclusive upper bound of the specified bucket.
+     */
+    static std::uint32_t getBucketUpperBound(unsigned index) { return 1U << std::min(index, 31U); }
+
+    /**
+     * Estimates the percentile from the buckets, so the result is accurate within a factor of two.
+     * The result is the upper bound of the bucket where the percentile falls, clamped to the observed min and max.
+     */
+    std::uint32_t getPercentile(const unsigned percent) const
+    {
+        if (count_ == 0)
+        {
+            return 0;
+        }
+
+        const std::uint64_t threshold = std::max<std::uint64_t>(1, (std::uint64_t(count_) * percent + 99U) / 100U);
+        std::uint64_t accumulated = 0;
+        for (unsigned i = 0; i < NumBuckets; i++)
+        {
+            accumulated += buckets_[i];
+            if (accumulated >= threshold)
+            {
+                const std::uint32_t estimate = (i == 0) ? 0 : (getBucketUpperBound(i) - 1U);
+                return std::max(min_, std::min(max_, estimate));
+            }
+        }
+        return max_;
+    }
+};
@@ -23,13 +23,21 @@
 #include <cstring>
 #include <cstdio>
 #include <cstdlib>
+#include <algorithm>
+#include <iterator>
 #include <zubax_chibios/os.hpp>
 #include <zubax_chibios/util/base64.hpp>
 #include <chprintf.h>
 
 #include "board/board.hpp"
 #include "usb_cdc.hpp"
+#include "uart_dma.hpp"
 #include "can_bus.hpp"
+#include "binary_protocol.hpp"
+#include "hex_codec.hpp"
+#include "slcan_codec.hpp"
+#include "periodic_tx.hpp"
+#include "profiler.hpp"
 
 // This is ugly, do something better.
 #include "../../bootloader/src/bootloader_app_interface.hpp"
@@ -56,33 +64,419 @@ static const volatile struct __attribute__((packed))
 
 
 constexpr unsigned WatchdogTimeoutMSec = 1500;
-constexpr unsigned CANTxTimeoutMSec = 50;
 
 os::config::Param<unsigned> cfg_can_bitrate  ("can.bitrate",            1000000, 10000, 1000000); // Exposed via SLCAN
 os::config::Param<bool> cfg_can_power_on     ("can.power_on",           false);
 os::config::Param<bool> cfg_can_terminator_on("can.terminator_on",      false);
+os::config::Param<unsigned> cfg_can_sample_point("can.sample_point_permill", can::DefaultSamplePointPermill, 500, 900);
+os::config::Param<bool> cfg_can_auto_open    ("can.auto_open",          false);
+os::config::Param<bool> cfg_can_bus_off_keep_tx("can.bus_off_keep_tx",  false);
+os::config::Param<unsigned> cfg_can_bus_off_min_backoff("can.bus_off_min_backoff_ms", 0, 0, 10000);
+os::config::Param<unsigned> cfg_can_bus_off_max_backoff("can.bus_off_max_backoff_ms", 1000, 0, 60000);
 
 os::config::Param<bool> cfg_timestamping_on("slcan.timestamping_on",    true);                    // Exposed via SLCAN
+os::config::Param<bool> cfg_timestamping_ext("slcan.timestamping_ext",  false);                   // Exposed via SLCAN
 os::config::Param<bool> cfg_flags_on       ("slcan.flags_on",           false);
+os::config::Param<bool> cfg_credits_on     ("slcan.credits_on",         false);
 
 os::config::Param<unsigned> cfg_baudrate("uart.baudrate", SERIAL_DEFAULT_BITRATE, 2400, 3000000); // Exposed via SLCAN
+os::config::Param<bool> cfg_uart_always_active("uart.always_active", false);
+
+os::config::Param<unsigned> cfg_capture_post_trigger_frames("capture.post_trigger_frames", 16, 0,
+                                                            CaptureBuffer::Capacity - 1);
+
+/**
+ * Persistent acceptance filter, see can::AcceptanceFilterConfig.
+ * Configuration parameters can't represent 32-bit integers exactly, so every field is stored as two 16-bit halves.
+ * A filter whose fields are all zero and whose priority class is normal is not used.
+ */
+class PersistentAcceptanceFilter
+{
+    os::config::Param<unsigned> id_hi_;
+    os::config::Param<unsigned> id_lo_;
+    os::config::Param<unsigned> mask_hi_;
+    os::config::Param<unsigned> mask_lo_;
+    os::config::Param<bool> high_priority_;
+
+public:
+    PersistentAcceptanceFilter(const char* id_hi_name,   const char* id_lo_name,
+                               const char* mask_hi_name, const char* mask_lo_name,
+                               const char* high_priority_name) :
+        id_hi_  (id_hi_name,   0, 0, 0xFFFF),
+        id_lo_  (id_lo_name,   0, 0, 0xFFFF),
+        mask_hi_(mask_hi_name, 0, 0, 0xFFFF),
+        mask_lo_(mask_lo_name, 0, 0, 0xFFFF),
+        high_priority_(high_priority_name, false)
+    { }
+
+    can::AcceptanceFilterConfig get() const
+    {
+        can::AcceptanceFilterConfig cfg;
+        cfg.id   = (std::uint32_t(id_hi_.get())   << 16) | std::uint32_t(id_lo_.get());
+        cfg.mask = (std::uint32_t(mask_hi_.get()) << 16) | std::uint32_t(mask_lo_.get());
+        cfg.high_priority = high_priority_.get();
+        return cfg;
+    }
+
+    bool isUsed() const
+    {
+        const auto cfg = get();
+        return (cfg.id != 0) || (cfg.mask != 0) || cfg.high_priority;
+    }
+
+    /**
+     * Does not save the configuration; call os::config::save() afterwards.
+     */
+    int set(const can::AcceptanceFilterConfig& cfg)
+    {
+        const int results[] =
+        {
+            id_hi_.set(cfg.id >> 16),
+            id_lo_.set(cfg.id & 0xFFFFU),
+            mask_hi_.set(cfg.mask >> 16),
+            mask_lo_.set(cfg.mask & 0xFFFFU),
+            high_priority_.set(cfg.high_priority)
+        };
+        return *std::min_element(std::begin(results), std::end(results));
+    }
+};
+
+#define PERSISTENT_ACCEPTANCE_FILTER(index) { "can.filter" #index ".id_hi",   "can.filter" #index ".id_lo", \
+                                              "can.filter" #index ".mask_hi", "can.filter" #index ".mask_lo", \
+                                              "can.filter" #index ".high_priority" }
+
+PersistentAcceptanceFilter cfg_acceptance_filters[] =
+{
+    PERSISTENT_ACCEPTANCE_FILTER(0),
+    PERSISTENT_ACCEPTANCE_FILTER(1),
+    PERSISTENT_ACCEPTANCE_FILTER(2),
+    PERSISTENT_ACCEPTANCE_FILTER(3),
+    PERSISTENT_ACCEPTANCE_FILTER(4),
+    PERSISTENT_ACCEPTANCE_FILTER(5),
+    PERSISTENT_ACCEPTANCE_FILTER(6),
+    PERSISTENT_ACCEPTANCE_FILTER(7)
+};
+
+constexpr unsigned NumPersistentAcceptanceFilters =
+    sizeof(cfg_acceptance_filters) / sizeof(cfg_acceptance_filters[0]);
+
+/**
+ * Encoding of the data exchanged with the host; ASCII SLCAN is the default, see binary_protocol.hpp for the other one.
+ */
+enum class Encoding
+{
+    ASCII,
+    Binary
+};
+
+/**
+ * Options of a host session. The defaults are defined by the configuration parameters.
+ */
+struct SessionOptions
+{
+    bool timestamping_on  = false;
+    bool timestamping_ext = false;
+    bool flags_on         = false;
+    bool credits_on       = false;
+    Encoding encoding     = Encoding::ASCII;
+    unsigned beacon_interval_ms = 0;    ///< Time beacons are disabled by default, see the SLCAN command Y
+
+    static SessionOptions makeDefault()
+    {
+        SessionOptions o;
+        o.timestamping_on  = cfg_timestamping_on;
+        o.timestamping_ext = cfg_timestamping_ext;
+        o.flags_on         = cfg_flags_on;
+        o.credits_on       = cfg_credits_on;
+        return o;
+    }
+};
+
+/**
+ * Every host interface is served by an independent session, so that USB and UART can be used at the same time,
+ * e.g. a logger on UART and an interactive tool on USB. Received frames are reported to all active sessions.
+ * The options are modified only with the session mutex locked, so that they can't change in the middle of an output
+ * transfer; the encoding is modified only by the main thread.
+ */
+class Session
+{
+    ::output_queue_t* const output_queue_;
+
+public:
+    ::BaseChannel* const channel;
+    chibios_rt::Mutex mutex;                    ///< Must be locked while writing to the channel
+    SessionOptions options;
+    bool active = false;                        ///< Modified only by the main thread
+
+    /// Frames that were not reported because the host was not reading fast enough; modified only by the RX thread
+    std::uint32_t dropped_frames = 0;
+
+    /**
+     * State of the time beacons, see the SLCAN command Y. Modified by the background thread with the mutex locked,
+     * except the latched timestamp, which is written from the interrupt context.
+     */
+    struct TimeBeacon
+    {
+        ::systime_t last_emitted_at = 0;
+        std::uint8_t sequence = 0;
+        bool capture_armed = false;     ///< The last beacon was written to an idle output, so its timing is exact
+        volatile bool latched = false;
+        volatile std::uint32_t latched_at_usec = 0;
+
+        /// Must be invoked with the kernel locked
+        void latchI()
+        {
+            latched_at_usec = can::getTimestampUSec();
+            latched = true;
+        }
+    } beacon;
+
+    Session(::BaseChannel* const ch, ::output_queue_t* const oq) :
+        output_queue_(oq),
+        channel(ch)
+    { }
+
+    bool isUSB() const
+    {
+        return channel == reinterpret_cast<::BaseChannel*>(usb_cdc::getSerialUSBDriver());
+    }
+
+    /**
+     * Returns the number of bytes that can be written to the channel without blocking;
+     * if the channel does not allow to find that out, returns a large value.
+     */
+    std::size_t getOutputSpace() const
+    {
+        if (isUSB())
+        {
+            return usb_cdc::getOutputSpace();
+        }
+        if (output_queue_ == nullptr)
+        {
+            return 0xFFFFFFFFU;
+        }
+        os::CriticalSectionLocker cs_locker;
+        return oqGetEmptyI(output_queue_);
+    }
+
+    /**
+     * Sends a response to the host using the encoding of this session.
+     * The caller must lock the mutex.
+     */
+    void writeResponse(const char* const response)
+    {
+        const unsigned len = std::strlen(response);
+
+        if LIKELY(options.encoding == Encoding::ASCII)
+        {
+            chnWriteTimeout(channel, reinterpret_cast<const std::uint8_t*>(response), len, MS2ST(1));
+        }
+        else
+        {
+            static constexpr unsigned MaxLength = 64;
+            static std::uint8_t buffer[binary_protocol::predictMaxEncodedPacketSize(MaxLength)];  // Main thread only
+            assert(len <= MaxLength);
+
+            binary_protocol::PacketEncoder encoder(&buffer[0], binary_protocol::PacketType::Text);
+            encoder.add(reinterpret_cast<const std::uint8_t*>(response), std::min(len, MaxLength));
+            chnWriteTimeout(channel, &buffer[0], encoder.finalize(), MS2ST(1));
+        }
+    }
+
+    /**
+     * Sends a time beacon to the host using the encoding of this session, see the SLCAN command Y.
+     * The beacon is written only if it fits into the output queue completely, so that it can't be truncated.
+     * The caller must lock the mutex.
+     * @return False if the beacon was skipped because there was not enough space.
+     */
+    bool writeTimeBeacon(const std::uint8_t sequence, const std::uint64_t reference_usec)
+    {
+        static constexpr unsigned ASCIISize = 20;       // Y, sequence, reference time, CR
+        static constexpr unsigned BinarySize =
+            binary_protocol::predictMaxEncodedPacketSize(binary_protocol::TimeBeaconPayloadSize);
+
+        std::uint8_t buffer[(ASCIISize > BinarySize) ? ASCIISize : BinarySize];
+        unsigned size = 0;
+
+        if LIKELY(options.encoding == Encoding::ASCII)
+        {
+            std::uint8_t* p = &buffer[0];
+            *p++ = 'Y';
+            p = hex_codec::encodeBytes(&sequence, 1, p);
+            p = hex_codec::encodeU32(std::uint32_t(reference_usec >> 32), p);
+            p = hex_codec::encodeU32(std::uint32_t(reference_usec), p);
+            *p++ = '\r';
+            size = unsigned(p - &buffer[0]);
+        }
+        else
+        {
+            binary_protocol::PacketEncoder encoder(&buffer[0], binary_protocol::PacketType::TimeBeacon);
+            encoder.add(sequence);
+            encoder.addU32(std::uint32_t(reference_usec));
+            encoder.addU32(std::uint32_t(reference_usec >> 32));
+            size = encoder.finalize();
+        }
+
+        if (getOutputSpace() < size)
+        {
+            return false;
+        }
+        return chnWriteTimeout(channel, &buffer[0], size, TIME_IMMEDIATE) == size;
+    }
+};
+
+Session usb_session (reinterpret_cast<::BaseChannel*>(usb_cdc::getSerialUSBDriver()), nullptr);
+Session uart_session(uart_dma::getChannel(), uart_dma::getOutputQueue());
+
+Session* const sessions[] = { &usb_session, &uart_session };
+
+/*
+ * Invoked from the interrupt context when the last time beacon has reached the host, or at least has been passed
+ * to the hardware; see usb_cdc::captureNextSOF() and uart_dma::captureTxCompletion().
+ */
+void latchUSBTimeBeacon()  { usb_session.beacon.latchI(); }
+void latchUARTTimeBeacon() { uart_session.beacon.latchI(); }
+
+/**
+ * The configuration parameters used to define the options of all sessions; this is the copy that was seen last time.
+ * When the parameters change, e.g. with the command cfg, the changed options are applied to all active sessions,
+ * but the others are not affected. The commands that change the options of one session, e.g. Z, update this copy
+ * together with the parameters, so that the other sessions are not affected.
+ */
+SessionOptions configured_session_options;
+chibios_rt::Mutex configured_session_options_mutex;
+
+/**
+ * Invoked by the background thread when the configuration changes.
+ */
+void reloadSessionOptions()
+{
+    os::MutexLocker mlocker(configured_session_options_mutex);
+
+    const auto old = configured_session_options;
+    configured_session_options = SessionOptions::makeDefault();
+    const auto& cfg = configured_session_options;
+
+    for (auto s : sessions)
+    {
+        os::MutexLocker session_mlocker(s->mutex);
+        auto& o = s->options;
+        o.timestamping_on  = (cfg.timestamping_on  != old.timestamping_on)  ? cfg.timestamping_on  : o.timestamping_on;
+        o.timestamping_ext = (cfg.timestamping_ext != old.timestamping_ext) ? cfg.timestamping_ext : o.timestamping_ext;
+        o.flags_on         = (cfg.flags_on         != old.flags_on)         ? cfg.flags_on         : o.flags_on;
+        o.credits_on       = (cfg.credits_on       != old.credits_on)       ? cfg.credits_on       : o.credits_on;
+    }
+}
+
+/**
+ * Invoked by the main thread when the interface is connected or disconnected.
+ * A newly activated session starts with the configured options; the new host may be unaware of the binary mode,
+ * so the encoding is always ASCII.
+ */
+chibios_rt::EvtSource session_activation_event_source;     ///< Broadcasted when a session becomes active
+
+bool isAnySessionActive()
+{
+    return std::any_of(std::begin(sessions), std::end(sessions), [](const Session* s) { return s->active; });
+}
+
+void setSessionActive(Session& session, const bool active)
+{
+    {
+        os::MutexLocker mlocker(configured_session_options_mutex);
+        os::MutexLocker session_mlocker(session.mutex);
+        if (active && !session.active)
+        {
+            session.options = SessionOptions::makeDefault();
+        }
+        session.active = active;
+    }
+
+    if (active)
+    {
+        session_activation_event_source.broadcastFlags(0);
+    }
+}
+
+/**
+ * SJA1000-style acceptance filter configured with the SLCAN commands M and m; it is not persistent.
+ * When enabled, it overrides the persistent filters; it is disabled when the mask is all ones, which is the default.
+ * Accessed from different threads, hence the critical section is needed.
+ */
+struct SJA1000AcceptanceFilter
+{
+    static constexpr std::uint32_t DisabledMask = 0xFFFFFFFFU;
+
+    std::uint32_t code = 0;
+    std::uint32_t mask = DisabledMask;      ///< Set bits are not matched
+} sja1000_acceptance_filter;
 
 /**
- * This struct keeps cached configuration parameters for quick access.
- * It is updated automatically when configuration changes from the background thread.
+ * Loads the currently configured acceptance filters into the CAN driver.
  */
-struct ParamCache
+int applyAcceptanceFilters()
 {
-    bool timestamping_on;
-    bool flags_on;
+    can::AcceptanceFilterConfig configs[NumPersistentAcceptanceFilters];
+    unsigned num_configs = 0;
+
+    SJA1000AcceptanceFilter sja1000;
+    {
+        os::CriticalSectionLocker cs_locker;
+        sja1000 = sja1000_acceptance_filter;
+    }
 
-    void reload()
+    if (sja1000.mask != sja1000.DisabledMask)
+    {
+        /*
+         * In the single filter mode, SJA1000 interprets the code and the mask differently depending on the frame type:
+         *  - Extended frames: bits 31..3 are the identifier, bit 2 is RTR;
+         *  - Standard frames: bits 31..21 are the identifier, bit 20 is RTR, bits 15..0 are the first two data bytes.
+         * Hence every frame type gets its own filter that matches the frame format. The data bytes can't be matched
+         * by the hardware, so they are ignored, i.e. more standard frames may be accepted than by SJA1000.
+         */
+        auto make_config = [&sja1000](const unsigned id_shift, const std::uint32_t id_mask, const unsigned rtr_bit,
+                                      const std::uint32_t flags)
+        {
+            const std::uint32_t match = ~sja1000.mask;
+            can::AcceptanceFilterConfig cfg;
+            cfg.id   = flags | ((sja1000.code >> id_shift) & id_mask);
+            cfg.mask = can::Frame::FlagEFF | ((match >> id_shift) & id_mask);
+            if (match & (1U << rtr_bit))
+            {
+                cfg.id   |= (sja1000.code & (1U << rtr_bit)) ? can::Frame::FlagRTR : 0;
+                cfg.mask |= can::Frame::FlagRTR;
+            }
+            return cfg;
+        };
+        configs[0] = make_config(3,  can::Frame::MaskExtID, 2,  can::Frame::FlagEFF);
+        configs[1] = make_config(21, can::Frame::MaskStdID, 20, 0);
+        num_configs = 2;
+    }
+    else
     {
-        timestamping_on = cfg_timestamping_on;
-        flags_on        = cfg_flags_on;
+        for (auto& f : cfg_acceptance_filters)
+        {
+            if (f.isUsed())
+            {
+                configs[num_configs++] = f.get();
+            }
+        }
     }
-} param_cache;
 
+    return can::setAcceptanceFilters(&configs[0], num_configs);
+}
+
+
+inline int openCAN(const unsigned options)
+{
+    can::BusOffRecoveryPolicy bus_off_policy;
+    bus_off_policy.keep_tx_queue  = cfg_can_bus_off_keep_tx.get();
+    bus_off_policy.min_backoff_ms = std::uint16_t(cfg_can_bus_off_min_backoff.get());
+    bus_off_policy.max_backoff_ms = std::uint16_t(cfg_can_bus_off_max_backoff.get());
+    can::setBusOffRecoveryPolicy(bus_off_policy);
+
+    return can::open(cfg_can_bitrate.get(), options, cfg_can_sample_point.get());
+}
 
 auto init()
 {
@@ -91,6 +485,23 @@ auto init()
      */
     auto watchdog = board::init(WatchdogTimeoutMSec, cfg_baudrate);
 
+    /*
+     * CAN auto-open is done before USB initialization, which takes over a second, so that the frames received right
+     * after power-up are not lost. They are kept in the RX queue until a session is activated, see RxThread.
+     */
+    if (cfg_can_auto_open)
+    {
+        board::enableCANPower(cfg_can_power_on);
+        board::enableCANTerminator(cfg_can_terminator_on);
+        (void)applyAcceptanceFilters();
+
+        const int res = openCAN(0);
+        if (res < 0)
+        {
+            os::lowsyslog("CAN auto-open failed: %d\n", res);
+        }
+    }
+
     /*
      * USB initialization
      */
@@ -104,12 +515,15 @@ auto init()
     usb_cdc::init(sn);                  // Must not exceed watchdog timeout
     watchdog.reset();
 
+    periodic_tx::init();
+
     return watchdog;
 }
 
 class BackgroundThread : public chibios_rt::BaseStaticThread<512>
 {
     static constexpr unsigned BaseFrameMSec = 25;
+    static constexpr unsigned StatisticsPollingIntervalMSec = 1000;
 
     static std::pair<unsigned, unsigned> getStatusOnOffDurationMSec()
     {
@@ -171,6 +585,77 @@ class BackgroundThread : public chibios_rt::BaseStaticThread<512>
         }
     }
 
+    /**
+     * The timestamp is latched for the beacon that was just sent and reported in the next one, see the command Y.
+     * The timestamp is exact only if the beacon is not queued behind other data: on USB the data that was pending
+     * may take several frames, and on UART it delays the beacon by its transmission time. Therefore the capture is
+     * armed only if the output was idle when the beacon was written; otherwise the next beacon reports all ones.
+     * A beacon that does not fit into the output queue is skipped, leaving the state unchanged.
+     */
+    static void emitTimeBeacons()
+    {
+        for (auto s : sessions)
+        {
+            if (!s->active || (s->options.beacon_interval_ms == 0))
+            {
+                continue;
+            }
+
+            os::MutexLocker mlocker(s->mutex);
+
+            const auto interval = s->options.beacon_interval_ms;
+            if ((interval == 0) || (chVTTimeElapsedSinceX(s->beacon.last_emitted_at) < MS2ST(interval)))
+            {
+                continue;
+            }
+            s->beacon.last_emitted_at += MS2ST(interval);
+            if (chVTTimeElapsedSinceX(s->beacon.last_emitted_at) >= MS2ST(interval))
+            {
+                s->beacon.last_emitted_at = chVTGetSystemTime();        // Fell behind, e.g. the host was not reading
+            }
+
+            bool latched = false;
+            std::uint32_t latched_at_usec = 0;
+            {
+                os::CriticalSectionLocker cs_locker;
+                latched = s->beacon.latched;
+                latched_at_usec = s->beacon.latched_at_usec;
+            }
+
+            const std::uint64_t reference_usec = (s->beacon.capture_armed && latched && can::isOpen()) ?
+                                                 can::extendTimestampUSec(latched_at_usec) : ~0ULL;
+
+            // The session mutex is locked, so the output can't be written by other threads until the beacon is
+            const bool idle = s->isUSB() ? usb_cdc::isOutputIdle() : uart_dma::isTxIdle();
+
+            if (!s->writeTimeBeacon(s->beacon.sequence, reference_usec))
+            {
+                continue;
+            }
+            s->beacon.sequence++;
+
+            {
+                os::CriticalSectionLocker cs_locker;
+                s->beacon.latched = false;
+            }
+
+            // If the output was idle, the capture of the previous beacon has been delivered already; otherwise it may
+            // still be delivered late, so the latched timestamp is ignored until the capture is armed again
+            s->beacon.capture_armed = idle;
+            if (idle)
+            {
+                if (s->isUSB())
+                {
+                    usb_cdc::captureNextSOF(&latchUSBTimeBeacon);
+                }
+                else
+                {
+                    uart_dma::captureTxCompletion(&latchUARTTimeBeacon);
+                }
+            }
+        }
+    }
+
     static void reloadConfigs()
     {
         board::enableCANPower(cfg_can_power_on);
@@ -178,21 +663,33 @@ class BackgroundThread : public chibios_rt::BaseStaticThread<512>
 
         board::reconfigureUART(cfg_baudrate.get());
 
-        param_cache.reload();
+        (void)applyAcceptanceFilters();
+
+        reloadSessionOptions();
     }
 
     void main() override
     {
         // This thread does not have a watchdog, it's intentional
+        board::initDeferred();
         reloadConfigs();
 
         ::systime_t next_step_at = chVTGetSystemTime();
         unsigned cfg_modcnt = 0;
+        unsigned statistics_polling_countdown = 0;
 
         while (true)
         {
             updateLED();                        // LEDs must be served first in order to reduce jitter
 
+            if (statistics_polling_countdown-- == 0)
+            {
+                statistics_polling_countdown = StatisticsPollingIntervalMSec / BaseFrameMSec;
+                can::pollStatistics();
+            }
+
+            emitTimeBeacons();
+
             const unsigned new_cfg_modcnt = os::config::getModificationCounter();
             if (new_cfg_modcnt != cfg_modcnt)
             {
@@ -214,305 +711,396 @@ class BackgroundThread : public chibios_rt::BaseStaticThread<512>
 } background_thread_;
 
 
-inline std::uint8_t nibble2hex(std::uint8_t x)
-{
-    // Allocating in RAM because it's faster
-    static std::uint8_t ConversionTable[] __attribute__((section(".data"))) =
-    {
-        '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F'
-    };
-    return ConversionTable[x & 0x0F];
-}
-
-
 class RxThread : public chibios_rt::BaseStaticThread<512>
 {
-    static constexpr unsigned ReadTimeoutMSec = 5;
+    static constexpr unsigned ReadTimeoutMSec = 100;        ///< Only needed to feed the watchdog while idle
     static constexpr unsigned WriteTimeoutMSec = 50;
 
+    static constexpr unsigned SLCANMaxFrameSize = slcan::MaxEncodedFrameSize;
+
     /**
-     * General frame format:
-     *  <type> <id> <dlc> <data> [timestamp msec] [flags]
-     * Types:
-     *  R - RTR extended
-     *  r - RTR standard
-     *  T - Data extended
-     *  t - Data standard
-     * Flags:
-     *  L - this frame is a loopback frame; timestamp field contains TX timestamp
+     * Frames are read from the driver and reported to the host in batches, which allows to fill USB packets
+     * completely and to amortize the cost of locking and I/O calls. The output buffer is sized as a multiple
+     * of the USB full speed bulk packet size, so that a full batch occupies an integer number of packets.
      */
-    static void reportFrame(const can::RxFrame& f)
-    {
-        constexpr unsigned SLCANMaxFrameSize = 40;
-        std::uint8_t buffer[SLCANMaxFrameSize];
-        std::uint8_t* p = &buffer[0];
+    static constexpr unsigned MaxFramesPerBatch = 16;
+    static constexpr unsigned USBPacketSize = 64;
+    static constexpr unsigned OutputBufferSize =
+        ((SLCANMaxFrameSize * MaxFramesPerBatch + USBPacketSize - 1) / USBPacketSize) * USBPacketSize;
 
-        if UNLIKELY(f.failed)
-        {
-            return;
-        }
+    static_assert(OutputBufferSize >= binary_protocol::predictMaxEncodedPacketSize(
+                      binary_protocol::MaxFrameRecordSize * MaxFramesPerBatch), "Output buffer is too small");
 
-        /*
-         * Frame type
-         */
-        if UNLIKELY(f.frame.isRemoteTransmissionRequest())
-        {
-            *p++ = f.frame.isExtended() ? 'R' : 'r';
-        }
-        else if UNLIKELY(f.frame.isErrorFrame())
-        {
-            return;     // Not supported
-        }
-        else
-        {
-            *p++ = f.frame.isExtended() ? 'T' : 't';
-        }
+    alignas(4) std::uint8_t output_buffer_[OutputBufferSize];
 
-        /*
-         * ID
-         */
-        {
-            const std::uint32_t id = f.frame.id & f.frame.MaskExtID;
-            if LIKELY(f.frame.isExtended())
-            {
-                *p++ = nibble2hex(id >> 28);
-                *p++ = nibble2hex(id >> 24);
-                *p++ = nibble2hex(id >> 20);
-                *p++ = nibble2hex(id >> 16);
-                *p++ = nibble2hex(id >> 12);
-            }
-            *p++ = nibble2hex(id >> 8);
-            *p++ = nibble2hex(id >> 4);
-            *p++ = nibble2hex(id >> 0);
-        }
+    /// Time from the RX interrupt until the frame is written to the host, in microseconds; see can::getRxLatencyProbe()
+    LatencyHistogram latency_histogram_;
 
-        /*
-         * DLC
-         */
-        *p++ = char('0' + f.frame.dlc);
+    /// Set by the main thread, cleared by this thread when the dump is finished; see dumpCapture()
+    Session* capture_dump_session_ = nullptr;
 
-        /*
-         * Data
-         */
-        for (unsigned i = 0; i < f.frame.dlc; i++)
-        {
-            const std::uint8_t byte = f.frame.data[i];
-            *p++ = nibble2hex(byte >> 4);
-            *p++ = nibble2hex(byte);
-        }
+    static constexpr unsigned CaptureDumpBatchSize = 8;
+    can::RxFrame capture_dump_batch_[CaptureDumpBatchSize];
 
-        /*
-         * Timestamp
-         */
-        if LIKELY(param_cache.timestamping_on)
-        {
-            // SLCAN format - [0, 60000) milliseconds
-            const auto slcan_timestamp = std::uint16_t(f.timestamp_usec / 1000U);
-            *p++ = nibble2hex(slcan_timestamp >> 12);
-            *p++ = nibble2hex(slcan_timestamp >> 8);
-            *p++ = nibble2hex(slcan_timestamp >> 4);
-            *p++ = nibble2hex(slcan_timestamp >> 0);
-        }
+    /// See slcan::encodeFrame()
+    static unsigned encodeFrame(const SessionOptions& options, const can::RxFrame& f, std::uint8_t* const out)
+    {
+        return slcan::encodeFrame(options, f, out, &can::extendTimestampUSec);
+    }
 
-        /*
-         * Flags
-         */
-        if LIKELY(param_cache.flags_on)
+    /**
+     * Binary counterpart of @ref encodeFrame(); all frames of the batch are packed into a single packet.
+     * @return Size of the packet, zero if there is nothing to report.
+     */
+    static unsigned encodeFramesBinary(const can::RxFrame* const frames, const unsigned num_frames,
+                                       std::uint8_t* const out)
+    {
+        binary_protocol::PacketEncoder encoder(out, binary_protocol::PacketType::CANFrames);
+        bool empty = true;
+
+        for (unsigned i = 0; i < num_frames; i++)
         {
-            if (f.loopback)
+            const auto& f = frames[i];
+            if LIKELY(!f.failed && !f.getFrame().isErrorFrame())
             {
-                *p++ = 'L';
+                encoder.addFrameRecord(f);
+                empty = false;
             }
         }
 
-        /*
-         * Finalization
-         */
-        *p++ = '\r';
-        const auto frame_size = unsigned(p - &buffer[0]);
-        assert(frame_size <= sizeof(buffer));
-
-        os::MutexLocker mlocker(os::getStdIOMutex());
-        chnWriteTimeout(os::getStdIOStream(), &buffer[0], frame_size, MS2ST(WriteTimeoutMSec));
+        return empty ? 0 : encoder.finalize();
     }
 
-    void main() override
+    /**
+     * Encodes the frames directly into the output buffers of the USB driver, see usb_cdc::acquireOutputBuffer().
+     * This saves two copies per frame compared to the regular stream output.
+     * @return Number of frames that could not be written.
+     */
+    static unsigned writeFramesToUSB(const SessionOptions& options,
+                                     const can::RxFrame* const frames, const unsigned num_frames,
+                                     const ::systime_t timeout)
     {
-        os::watchdog::Timer wdt;
-        wdt.startMSec((ReadTimeoutMSec + WriteTimeoutMSec) * 2);
-
-        while (true)
+        unsigned i = 0;
+        while (i < num_frames)
         {
-            wdt.reset();
-
-            can::RxFrame rxf;
-            const int res = can::receive(rxf, ReadTimeoutMSec);
-            if LIKELY(res > 0)
+            std::size_t available = 0;
+            std::uint8_t* const buffer = usb_cdc::acquireOutputBuffer(SLCANMaxFrameSize, available, timeout);
+            if UNLIKELY(buffer == nullptr)
             {
-                reportFrame(rxf);
+                break;                                          // The host is not reading, dropping the rest
             }
-            else if (res == -can::ErrClosed)
+
+            unsigned size = 0;
+            unsigned num_encoded = 0;
+            while (((i + num_encoded) < num_frames) && ((available - size) >= SLCANMaxFrameSize))
             {
-                ::usleep(1000);
+                size += encodeFrame(options, frames[i + num_encoded++], buffer + size);
             }
-            else
+
+            if UNLIKELY(!usb_cdc::commitOutputBuffer(size))
             {
-                ;
+                break;                                          // No free buffer left, dropping the rest
             }
+            i += num_encoded;
         }
+        return num_frames - i;
     }
-} rx_thread_;
 
-// Using global state is UGLY, but it's also FASTER
-static bool hex2nibble_error;
-std::uint8_t hex2nibble(char ch)
-{
-    // Must go into RAM, not flash, because flash is slow
-    static std::uint8_t ConversionTable[] __attribute__((section(".data"))) =
+    /**
+     * Encodes the batch into the output buffer and emits it with a single write call.
+     * If the timeout is zero, only the frames that fit into the output queue of the channel are written, so that
+     * the output is never truncated in the middle of a frame.
+     * The session mutex must be locked, because the options may be changed by other threads.
+     * @return Number of frames that could not be written.
+     */
+    unsigned writeFrames(const Session& session, const can::RxFrame* const frames, const unsigned num_frames,
+                         const ::systime_t timeout)
+    {
+        static_assert(OutputBufferSize >= (SLCANMaxFrameSize * MaxFramesPerBatch), "Output buffer is too small");
+        assert(num_frames <= MaxFramesPerBatch);
+
+        const auto& options = session.options;
+
+        if LIKELY((options.encoding == Encoding::ASCII) && session.isUSB())
+        {
+            return writeFramesToUSB(options, frames, num_frames, timeout);
+        }
+
+        const std::size_t space = (timeout == TIME_IMMEDIATE) ? session.getOutputSpace() : sizeof(output_buffer_);
+
+        unsigned size = 0;
+        unsigned num_encoded = 0;
+        if LIKELY(options.encoding == Encoding::ASCII)
+        {
+            for (; num_encoded < num_frames; num_encoded++)
+            {
+                const unsigned frame_size = encodeFrame(options, frames[num_encoded], &output_buffer_[size]);
+                if ((size + frame_size) > space)
+                {
+                    break;
+                }
+                size += frame_size;
+            }
+        }
+        else
+        {
+            size = encodeFramesBinary(frames, num_frames, &output_buffer_[0]);
+            num_encoded = (size <= space) ? num_frames : 0;
+            size = (size <= space) ? size : 0;
+        }
+        assert(size <= sizeof(output_buffer_));
+
+        if LIKELY(size > 0)
+        {
+            if (chnWriteTimeout(session.channel, &output_buffer_[0], size, timeout) < size)
+            {
+                return num_frames;
+            }
+        }
+        return num_frames - num_encoded;
+    }
+
+    /**
+     * The frames are reported to every active session. A session that can't accept the frames immediately must not
+     * throttle the others, hence the output is non-blocking unless there is only one active session; the frames
+     * that don't fit are dropped and counted per session.
+     *
+     * This is invoked with the RX mutex of the driver locked, see can::peekReceived(), so it never blocks on the
+     * session mutex: the main thread may hold it while executing a command that locks the driver mutexes, e.g.
+     * filter, which would be a deadlock. If the only active session is busy, the frames are not reported and stay
+     * in the RX queue, and the caller must wait for the session, see waitForSession().
+     * @return False if the frames were not reported and must not be committed; the busy session is returned via
+     *         the out parameter.
+     */
+    bool reportFrames(const can::RxFrame* const frames, const unsigned num_frames, Session*& out_busy_session)
     {
-        255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
-        255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
-        255, 255, 255, 255,
-        0, 1, 2, 3, 4, 5, 6, 7, 8, 9,           // 0..9
-        255, 255, 255, 255, 255, 255, 255,
-        10, 11, 12, 13, 14, 15,                 // A..F
-        255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
-        255, 255, 255, 255,
-        10, 11, 12, 13, 14, 15,                 // a..f
-        255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
-        255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
-        255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
-        255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
-        255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
-        255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
-        255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255
-    };
-    static_assert(sizeof(ConversionTable) == 256, "ConversionTable");
-    const std::uint8_t out = ConversionTable[int(ch)];
-    if UNLIKELY(out == 255)
+        unsigned num_active_sessions = 0;
+        for (auto s : sessions)
+        {
+            num_active_sessions += s->active ? 1U : 0U;
+        }
+        const bool exclusive = num_active_sessions <= 1;
+
+        bool reported = false;
+        for (auto s : sessions)
+        {
+            if (!s->active)
+            {
+                continue;
+            }
+
+            if (!s->mutex.tryLock())
+            {
+                if (exclusive)
+                {
+                    out_busy_session = s;
+                    return false;                               // Retrying later, nothing was written yet
+                }
+                s->dropped_frames += num_frames;                // The main thread is writing a long response
+                continue;
+            }
+
+            if LIKELY(s->active)
+            {
+                const unsigned num_dropped =
+                    writeFrames(*s, frames, num_frames, exclusive ? MS2ST(WriteTimeoutMSec) : TIME_IMMEDIATE);
+                s->dropped_frames += num_dropped;
+                reported = reported || (num_dropped < num_frames);
+            }
+
+            s->mutex.unlock();
+        }
+
+        std::uint32_t isr_timestamp_usec = 0;
+        if (reported && can::getRxLatencyProbe(frames, num_frames, isr_timestamp_usec))
+        {
+            const auto now = can::getTimestampUSec();
+            os::CriticalSectionLocker cs_locker;
+            latency_histogram_.add(can::computeTimestampDeltaUSec(isr_timestamp_usec, now));
+        }
+        return true;
+    }
+
+    /**
+     * Blocks until the session is released by the main thread, see reportFrames(). The RX mutex of the driver must
+     * not be locked by the caller, which is the case after can::commitReceived(). The session is held by the main
+     * thread at most for the duration of one command, which is bounded by the main thread watchdog.
+     */
+    static void waitForSession(Session& session)
     {
-        hex2nibble_error = true;
+        os::MutexLocker mlocker(session.mutex);
     }
-    return out;
-}
 
-/**
- * General frame format:
- *  <type> <id> <dlc> <data>
- * The emitting functions below are highly optimized for speed.
- */
-inline bool emitFrameDataExt(const char* cmd)
-{
-    can::Frame f;
-    hex2nibble_error = false;
-    f.id = f.FlagEFF |
-           (hex2nibble(cmd[1]) << 28) |
-           (hex2nibble(cmd[2]) << 24) |
-           (hex2nibble(cmd[3]) << 20) |
-           (hex2nibble(cmd[4]) << 16) |
-           (hex2nibble(cmd[5]) << 12) |
-           (hex2nibble(cmd[6]) <<  8) |
-           (hex2nibble(cmd[7]) <<  4) |
-           (hex2nibble(cmd[8]) <<  0);
-    if UNLIKELY(cmd[9] < '0' || cmd[9] > ('0' + can::Frame::MaxDataLen))
+    /**
+     * Writes the frozen capture to the session exactly like the received frames are reported, followed by the status
+     * code: CR if all frames were written, BELL otherwise. The received frames are not reported while the dump is in
+     * progress, so they are not interleaved with it; if the dump takes long, they may overflow the RX queue.
+     * Captures older than the timestamp rollover interval will be reported with wrong extended timestamps.
+     */
+    void dumpCapture(Session& session, os::watchdog::Timer& wdt)
     {
-        return false;
+        os::MutexLocker mlocker(session.mutex);
+
+        bool ok = true;
+        unsigned index = 0;
+        while (ok)
+        {
+            wdt.reset();
+            const unsigned n = can::readCapture(index, &capture_dump_batch_[0], CaptureDumpBatchSize);
+            if (n == 0)
+            {
+                break;
+            }
+            ok = writeFrames(session, &capture_dump_batch_[0], n, MS2ST(WriteTimeoutMSec)) == 0;
+            index += n;
+        }
+
+        // Session::writeResponse() can't be used here because its buffer belongs to the main thread
+        const std::uint8_t status = ok ? '\r' : '\a';
+        if (session.options.encoding == Encoding::ASCII)
+        {
+            chnWriteTimeout(session.channel, &status, 1, MS2ST(WriteTimeoutMSec));
+        }
+        else
+        {
+            std::uint8_t buffer[binary_protocol::predictMaxEncodedPacketSize(1)];
+            binary_protocol::PacketEncoder encoder(&buffer[0], binary_protocol::PacketType::Text);
+            encoder.add(&status, 1);
+            chnWriteTimeout(session.channel, &buffer[0], encoder.finalize(), MS2ST(WriteTimeoutMSec));
+        }
     }
-    f.dlc = cmd[9] - '0';
-    assert(f.dlc <= can::Frame::MaxDataLen);
+
+    void main() override
     {
-        const char* p = &cmd[10];
-        for (unsigned i = 0; i < f.dlc; i++)
+        // The thread may wait for a session as long as the main thread may execute a command, see waitForSession()
+        os::watchdog::Timer wdt;
+        wdt.startMSec(WatchdogTimeoutMSec + (ReadTimeoutMSec + WriteTimeoutMSec) * 2);
+
+        // While the channel is closed, the thread sleeps until it is opened
+        event_listener_t can_listener;
+        chEvtRegisterMaskWithFlags(can::getEventSource(), &can_listener, EVENT_MASK(0), can::EventFlagOpened);
+
+        // While there are no active sessions, the frames are kept in the RX queue, e.g. after auto-open at boot
+        event_listener_t session_listener;
+        chEvtRegisterMask(&session_activation_event_source.ev_source, &session_listener, EVENT_MASK(1));
+
+        while (true)
         {
-            f.data[i] = (hex2nibble(*p) << 4) | hex2nibble(*(p + 1));
-            p += 2;
+            wdt.reset();
+
+            Session* dump_session = nullptr;
+            {
+                os::CriticalSectionLocker cs_locker;
+                dump_session = capture_dump_session_;
+            }
+            if UNLIKELY(dump_session != nullptr)
+            {
+                dumpCapture(*dump_session, wdt);
+                os::CriticalSectionLocker cs_locker;
+                capture_dump_session_ = nullptr;
+            }
+
+            if UNLIKELY(!isAnySessionActive())
+            {
+                (void)chEvtWaitAnyTimeout(EVENT_MASK(1), MS2ST(ReadTimeoutMSec));
+                continue;
+            }
+
+            const can::RxFrame* frames = nullptr;
+            const int res = can::peekReceived(frames, MaxFramesPerBatch, ReadTimeoutMSec);
+            if LIKELY(res > 0)
+            {
+                // Reading the frames in place, without copying
+                Session* busy_session = nullptr;
+                const bool reported = reportFrames(frames, unsigned(res), busy_session);
+                can::commitReceived(reported ? unsigned(res) : 0U);
+                if UNLIKELY(!reported)
+                {
+                    waitForSession(*busy_session);              // The RX mutex is released meanwhile
+                }
+            }
+            else if (res == -can::ErrClosed)
+            {
+                (void)chEvtWaitAnyTimeout(EVENT_MASK(0), MS2ST(ReadTimeoutMSec));
+                (void)chEvtGetAndClearFlags(&can_listener);
+            }
+            else
+            {
+                ;
+            }
         }
     }
-    if UNLIKELY(hex2nibble_error)
+public:
+    LatencyHistogram getLatencyHistogram()
     {
-        return false;
+        os::CriticalSectionLocker cs_locker;
+        return latency_histogram_;
     }
-    return 0 <= can::send(f, CANTxTimeoutMSec);
-}
 
-inline bool emitFrameDataStd(const char* cmd)
-{
-    can::Frame f;
-    hex2nibble_error = false;
-    f.id = (hex2nibble(cmd[1]) << 8) |
-           (hex2nibble(cmd[2]) << 4) |
-           (hex2nibble(cmd[3]) << 0);
-    if UNLIKELY(cmd[4] < '0' || cmd[4] > ('0' + can::Frame::MaxDataLen))
+    void resetLatencyHistogram()
     {
-        return false;
+        os::CriticalSectionLocker cs_locker;
+        latency_histogram_.reset();
     }
-    f.dlc = cmd[4] - '0';
-    assert(f.dlc <= can::Frame::MaxDataLen);
+
+    /**
+     * Requests the capture to be dumped to the session, see dumpCapture(); the dump starts within the read timeout.
+     * @return False if the capture is not frozen or another dump is in progress.
+     */
+    bool requestCaptureDump(Session& session)
     {
-        const char* p = &cmd[5];
-        for (unsigned i = 0; i < f.dlc; i++)
+        if (can::getCaptureStatus().state != CaptureBuffer::State::Frozen)
         {
-            f.data[i] = (hex2nibble(*p) << 4) | hex2nibble(*(p + 1));
-            p += 2;
+            return false;
         }
+        os::CriticalSectionLocker cs_locker;
+        if (capture_dump_session_ != nullptr)
+        {
+            return false;
+        }
+        capture_dump_session_ = &session;
+        return true;
     }
-    if UNLIKELY(hex2nibble_error)
-    {
-        return false;
-    }
-    return 0 <= can::send(f, CANTxTimeoutMSec);
+} rx_thread_;
+
+/**
+ * Frames from the host are submitted without blocking, so that the serial port is never stalled by the CAN bus.
+ * If the TX queue is full, the frame is rejected immediately, and the host receives a NACK.
+ */
+inline bool submitFrame(const can::Frame& f)
+{
+    return can::send(f, 0) > 0;
+}
+
+inline bool emitFrameDataExt(const char* cmd)
+{
+    can::Frame f;
+    return slcan::parseFrameDataExt(cmd, f) && submitFrame(f);
+}
+
+inline bool emitFrameDataStd(const char* cmd)
+{
+    can::Frame f;
+    return slcan::parseFrameDataStd(cmd, f) && submitFrame(f);
 }
 
 inline bool emitFrameRTRExt(const char* cmd)
 {
     can::Frame f;
-    hex2nibble_error = false;
-    f.id = f.FlagEFF | f.FlagRTR |
-           (hex2nibble(cmd[1]) << 28) |
-           (hex2nibble(cmd[2]) << 24) |
-           (hex2nibble(cmd[3]) << 20) |
-           (hex2nibble(cmd[4]) << 16) |
-           (hex2nibble(cmd[5]) << 12) |
-           (hex2nibble(cmd[6]) <<  8) |
-           (hex2nibble(cmd[7]) <<  4) |
-           (hex2nibble(cmd[8]) <<  0);
-    if UNLIKELY(cmd[9] < '0' || cmd[9] > ('0' + can::Frame::MaxDataLen))
-    {
-        return false;
-    }
-    f.dlc = cmd[9] - '0';
-    assert(f.dlc <= can::Frame::MaxDataLen);
-    if UNLIKELY(hex2nibble_error)
-    {
-        return false;
-    }
-    return 0 <= can::send(f, CANTxTimeoutMSec);
+    return slcan::parseFrameRTRExt(cmd, f) && submitFrame(f);
 }
 
 inline bool emitFrameRTRStd(const char* cmd)
 {
     can::Frame f;
-    hex2nibble_error = false;
-    f.id = f.FlagRTR |
-           (hex2nibble(cmd[1]) << 8) |
-           (hex2nibble(cmd[2]) << 4) |
-           (hex2nibble(cmd[3]) << 0);
-    if UNLIKELY(cmd[4] < '0' || cmd[4] > ('0' + can::Frame::MaxDataLen))
-    {
-        return false;
-    }
-    f.dlc = cmd[4] - '0';
-    assert(f.dlc <= can::Frame::MaxDataLen);
-    if UNLIKELY(hex2nibble_error)
-    {
-        return false;
-    }
-    return 0 <= can::send(f, CANTxTimeoutMSec);
+    return slcan::parseFrameRTRStd(cmd, f) && submitFrame(f);
 }
 
-
 class CommandProcessor
 {
+    Session& session_;
+    char response_buffer_[48];
+
     void cmdConfig(int argc, char** argv)
     {
         (void)os::config::executeCLICommand(argc - 1, &argv[1]);
@@ -561,57 +1149,513 @@ class CommandProcessor
             {
                 std::puts("ERROR: Invalid base64");
             }
-
-            if (!board::tryWriteDeviceSignature(sign))
+
+            if (!board::tryWriteDeviceSignature(sign))
+            {
+                std::puts("ERROR: Write failed");
+            }
+        }
+        else
+        {
+            std::puts("ERROR: Invalid usage");
+        }
+    }
+
+    static void printLatencyHistogram(const char* const name, const char* const buckets_name,
+                                      const LatencyHistogram& hist)
+    {
+        std::printf("%-22s: count=%u min=%u p50=%u p90=%u p99=%u max=%u\n", name,
+                    unsigned(hist.getCount()), unsigned(hist.getMin()), unsigned(hist.getPercentile(50)),
+                    unsigned(hist.getPercentile(90)), unsigned(hist.getPercentile(99)), unsigned(hist.getMax()));
+
+        // Non-empty buckets are printed as <exclusive upper bound>:<count>
+        std::printf("%-22s:", buckets_name);
+        for (unsigned i = 0; i < hist.NumBuckets; i++)
+        {
+            if (hist.getBucketCount(i) > 0)
+            {
+                std::printf(" %u:%u", unsigned(hist.getBucketUpperBound(i)), unsigned(hist.getBucketCount(i)));
+            }
+        }
+        std::puts("");
+    }
+
+    /**
+     * Prints the most active IDs since the channel was opened or the statistics were reset, see IDRateTable.
+     * The output is sorted by the frame rate, or by the bandwidth if requested.
+     */
+    static void printIDRateTable(const bool sort_by_bandwidth)
+    {
+        std::uint64_t interval_usec = 0;
+        const auto table = can::getIDRateTable(interval_usec);
+        const std::uint64_t interval_msec = std::max<std::uint64_t>(1, interval_usec / 1000U);
+
+        const IDRateTable::Entry* entries[IDRateTable::NumEntries] = {};
+        for (unsigned i = 0; i < table.getNumEntries(); i++)
+        {
+            entries[i] = &table.getEntry(i);
+        }
+        std::sort(&entries[0], &entries[table.getNumEntries()],
+                  [sort_by_bandwidth](const IDRateTable::Entry* a, const IDRateTable::Entry* b)
+                  {
+                      return sort_by_bandwidth ? (a->bits > b->bits) : (a->frames > b->frames);
+                  });
+
+        std::printf("%-10s %10s %10s %12s %10s\n", "id", "frames", "frames/s", "bits/s", "error");
+        for (unsigned i = 0; i < table.getNumEntries(); i++)
+        {
+            const auto& e = *entries[i];
+            const bool ext = (e.id & can::Frame::FlagEFF) != 0;
+            std::printf(ext ? "%08x%s  %10u %10u %12u %10u\n" : "%03x%s       %10u %10u %12u %10u\n",
+                        unsigned(e.id & can::Frame::MaskExtID),
+                        ((e.id & can::Frame::FlagRTR) != 0) ? "r" : " ",
+                        unsigned(e.frames),
+                        unsigned((std::uint64_t(e.frames) * 1000U) / interval_msec),
+                        unsigned((e.bits * 1000U) / interval_msec),
+                        unsigned(e.frames_error));
+        }
+    }
+
+    void cmdStat(int argc, char** argv)
+    {
+        static constexpr auto FormatString = "%-22s: %s\n";
+
+        if ((argc == 2) && (std::strcmp(argv[1], "reset") == 0))
+        {
+            rx_thread_.resetLatencyHistogram();
+            can::resetTxLatencyHistogram();
+            can::resetIDRateTable();
+            return;
+        }
+
+        if ((argc >= 2) && (std::strcmp(argv[1], "ids") == 0))
+        {
+            printIDRateTable((argc == 3) && (std::strcmp(argv[2], "bw") == 0));
+            return;
+        }
+
+        // We can't use printf() for conversion because ChibiOS's printf() implementation does not support `long long`.
+#       define STAT_PRINT_ONE_KEY(object, field) \
+            std::printf(FormatString, STRINGIZE(field), os::uintToString(object . field).c_str());
+
+        std::printf(FormatString, "open",  can::isOpen() ? "true" : "false");
+
+        {
+            const auto status = can::getStatus();
+
+            std::printf(FormatString, "state", status.getStateAsString());
+            STAT_PRINT_ONE_KEY(status, receive_error_counter)
+            STAT_PRINT_ONE_KEY(status, transmit_error_counter)
+        }
+
+        {
+            const auto statistics = can::getStatistics();
+
+            STAT_PRINT_ONE_KEY(statistics, errors)
+            STAT_PRINT_ONE_KEY(statistics, bus_off_events)
+            STAT_PRINT_ONE_KEY(statistics, bus_off_recoveries)
+            STAT_PRINT_ONE_KEY(statistics, bus_off_dropped_frames)
+            STAT_PRINT_ONE_KEY(statistics, sw_rx_queue_overruns)
+            STAT_PRINT_ONE_KEY(statistics, hw_rx_queue_overruns)
+            STAT_PRINT_ONE_KEY(statistics, frames_tx)
+            STAT_PRINT_ONE_KEY(statistics, frames_rx)
+            STAT_PRINT_ONE_KEY(statistics, tx_queue_capacity)
+            STAT_PRINT_ONE_KEY(statistics, tx_queue_peak_usage)
+            STAT_PRINT_ONE_KEY(statistics, rx_queue_capacity)
+            STAT_PRINT_ONE_KEY(statistics, rx_queue_peak_usage)
+            STAT_PRINT_ONE_KEY(statistics, hp_rx_queue_capacity)
+            STAT_PRINT_ONE_KEY(statistics, hp_rx_queue_peak_usage)
+            STAT_PRINT_ONE_KEY(statistics, tx_mailbox_peak_usage)
+        }
+
+        {
+            const auto load = can::getBusLoad();
+
+            STAT_PRINT_ONE_KEY(load, frames_per_sec)
+            STAT_PRINT_ONE_KEY(load, bits_per_sec)
+            std::printf("%-22s: %u.%u%%\n", "bus_load",
+                        unsigned(load.utilization_permill / 10U), unsigned(load.utilization_permill % 10U));
+        }
+
+        std::printf("%-22s: %.1f\n", "bus_voltage", board::getBusVoltage());
+
+        std::printf(FormatString, "usb_dropped_frames", os::uintToString(usb_session.dropped_frames).c_str());
+        std::printf(FormatString, "uart_dropped_frames", os::uintToString(uart_session.dropped_frames).c_str());
+
+        {
+            const auto statistics = uart_dma::getStatistics();
+
+            std::printf(FormatString, "uart_rx_overruns", os::uintToString(statistics.rx_overruns).c_str());
+            std::printf(FormatString, "uart_rx_errors", os::uintToString(statistics.rx_errors).c_str());
+        }
+
+        std::printf(FormatString, "cyclic_skipped_frames",
+                    os::uintToString(periodic_tx::getNumSkippedFrames()).c_str());
+
+        printLatencyHistogram("rx_latency_usec", "rx_latency_buckets", rx_thread_.getLatencyHistogram());
+        printLatencyHistogram("tx_latency_usec", "tx_latency_buckets", can::getTxLatencyHistogram());
+    }
+
+    void cmdProf(int argc, char** argv)
+    {
+        if ((argc == 2) && (std::strcmp(argv[1], "reset") == 0))
+        {
+            profiler::reset();
+            return;
+        }
+
+        const auto report = profiler::getReport();
+        const std::uint64_t window = std::max<std::uint64_t>(1, report.window_cycles);
+        const std::uint64_t idle = report.getIdleCycles();
+
+        // Printed as a percentage with one decimal place
+        auto share = [window](std::uint64_t cycles) { return unsigned((cycles * 1000U) / window); };
+        auto to_usec_x10 = [&report](std::uint32_t cycles)
+        {
+            return unsigned((std::uint64_t(cycles) * 10U) / report.cycles_per_usec);
+        };
+
+        std::printf("%-22s: %u\n", "window_msec", unsigned(report.window_cycles / (report.cycles_per_usec * 1000U)));
+        std::printf("%-22s: %u.%u%%\n", "cpu_load", (1000U - share(idle)) / 10U, (1000U - share(idle)) % 10U);
+        std::printf("%-22s: %u.%u%%\n", "idle", share(idle) / 10U, share(idle) % 10U);
+
+        for (auto& x : report.irqs)
+        {
+            char name[23];
+            chsnprintf(&name[0], sizeof(name), "irq_%s", x.name);
+            std::printf("%-22s: load=%u.%u%% count=%u max_usec=%u.%u\n", name,
+                        share(x.cycles) / 10U, share(x.cycles) % 10U, unsigned(x.count),
+                        to_usec_x10(x.max_cycles) / 10U, to_usec_x10(x.max_cycles) % 10U);
+        }
+
+        for (unsigned i = 0; i < report.num_threads; i++)
+        {
+            const auto& x = report.threads[i];
+            char name[23];
+            chsnprintf(&name[0], sizeof(name), "thread_%s", x.name);
+            std::printf("%-22s: load=%u.%u%%", name, share(x.cycles) / 10U, share(x.cycles) % 10U);
+            if (x.stack_size > 0)
+            {
+                std::printf(" stack=%u/%u", x.stack_used, x.stack_size);
+            }
+            std::puts("");
+        }
+
+        std::printf("%-22s: %u/%u\n", "isr_stack", report.isr_stack_used, report.isr_stack_size);
+    }
+
+    void cmdFilter(int argc, char** argv)
+    {
+        auto parse_hex = [](const char* str, std::uint32_t& out_value)
+        {
+            char* end = nullptr;
+            out_value = std::uint32_t(std::strtoul(str, &end, 16));
+            return (end != str) && (*end == '\0');
+        };
+
+        if (argc == 1)
+        {
+            for (unsigned i = 0; i < NumPersistentAcceptanceFilters; i++)
+            {
+                if (cfg_acceptance_filters[i].isUsed())
+                {
+                    const auto cfg = cfg_acceptance_filters[i].get();
+                    std::printf("%u: id=%08x mask=%08x%s\n", i, unsigned(cfg.id), unsigned(cfg.mask),
+                                cfg.high_priority ? " high_priority" : "");
+                }
+            }
+            return;
+        }
+
+        if ((argc == 4 || argc == 5) && (std::strcmp(argv[1], "add") == 0))
+        {
+            can::AcceptanceFilterConfig cfg;
+            if (!parse_hex(argv[2], cfg.id) || !parse_hex(argv[3], cfg.mask))
+            {
+                std::puts("ERROR: Invalid hex");
+                return;
+            }
+
+            if (argc == 5)
+            {
+                if (std::strcmp(argv[4], "high_priority") != 0)
+                {
+                    std::puts("ERROR: Invalid priority class");
+                    return;
+                }
+                cfg.high_priority = true;
+            }
+
+            if ((cfg.id == 0) && (cfg.mask == 0) && !cfg.high_priority)
+            {
+                std::puts("ERROR: This filter accepts everything; use 'filter clear' instead");
+                return;
+            }
+
+            auto* const slot = std::find_if(std::begin(cfg_acceptance_filters), std::end(cfg_acceptance_filters),
+                                            [](const PersistentAcceptanceFilter& f) { return !f.isUsed(); });
+            if (slot == std::end(cfg_acceptance_filters))
+            {
+                std::puts("ERROR: No free slots");
+                return;
+            }
+
+            (void)slot->set(cfg);
+        }
+        else if ((argc == 2) && (std::strcmp(argv[1], "clear") == 0))
+        {
+            for (auto& f : cfg_acceptance_filters)
+            {
+                (void)f.set(can::AcceptanceFilterConfig());
+            }
+        }
+        else
+        {
+            std::puts("ERROR: Invalid usage; expected: filter [add <id> <mask> [high_priority] | clear]");
+            return;
+        }
+
+        const int save_res = os::config::save();
+        if (save_res < 0)
+        {
+            std::printf("ERROR: Could not save configuration: %d\n", save_res);
+        }
+
+        const int apply_res = applyAcceptanceFilters();
+        if (apply_res < 0)
+        {
+            std::printf("ERROR: Could not apply filters: %d\n", apply_res);
+        }
+    }
+
+    void cmdCyclic(int argc, char** argv)
+    {
+        auto parse_uint = [](const char* str, std::uint32_t& out_value)
+        {
+            char* end = nullptr;
+            out_value = std::uint32_t(std::strtoul(str, &end, 10));
+            return (end != str) && (*end == '\0');
+        };
+
+        if (argc == 1)
+        {
+            for (unsigned i = 0; i < periodic_tx::NumSlots; i++)
+            {
+                const auto slot = periodic_tx::getSlot(i);
+                if (slot.period_usec == 0)
+                {
+                    continue;
+                }
+
+                const auto& f = slot.frame;
+                const char type = f.isRemoteTransmissionRequest() ? (f.isExtended() ? 'R' : 'r')
+                                                                  : (f.isExtended() ? 'T' : 't');
+                std::printf(f.isExtended() ? "%u: %c%08x%u" : "%u: %c%03x%u",
+                            i, type, unsigned(f.id & f.MaskExtID), unsigned(f.dlc));
+                for (unsigned k = 0; (k < f.dlc) && !f.isRemoteTransmissionRequest(); k++)
+                {
+                    std::printf("%02x", unsigned(f.data[k]));
+                }
+                std::printf(" period_usec=%u phase_usec=%u\n", unsigned(slot.period_usec), unsigned(slot.phase_usec));
+            }
+            std::printf("skipped_frames: %s\n", os::uintToString(periodic_tx::getNumSkippedFrames()).c_str());
+            return;
+        }
+
+        std::uint32_t index = 0;
+        int res = 0;
+
+        if ((argc == 5 || argc == 6) && (std::strcmp(argv[1], "set") == 0))
+        {
+            can::Frame frame;
+            std::uint32_t period = 0;
+            std::uint32_t phase = 0;
+            if (!parse_uint(argv[2], index) || !slcan::parseFrame(argv[3], frame) || !parse_uint(argv[4], period) ||
+                ((argc == 6) && !parse_uint(argv[5], phase)))
+            {
+                std::puts("ERROR: Invalid arguments");
+                return;
+            }
+            res = periodic_tx::set(index, frame, period, phase);
+        }
+        else if ((argc == 4) && (std::strcmp(argv[1], "data") == 0))
+        {
+            std::uint8_t data[can::Frame::MaxDataLen] = {};
+            const unsigned len = std::strlen(argv[3]);
+            if (!parse_uint(argv[2], index) || (len % 2 != 0) || (len > can::Frame::MaxDataLen * 2) ||
+                !hex_codec::decodeBytes(argv[3], &data[0], len / 2))
+            {
+                std::puts("ERROR: Invalid arguments");
+                return;
+            }
+            res = periodic_tx::updatePayload(index, &data[0], std::uint8_t(len / 2));
+        }
+        else if ((argc == 3) && (std::strcmp(argv[1], "del") == 0))
+        {
+            if (!parse_uint(argv[2], index))
+            {
+                std::puts("ERROR: Invalid arguments");
+                return;
+            }
+            res = periodic_tx::remove(index);
+        }
+        else if ((argc == 2) && (std::strcmp(argv[1], "clear") == 0))
+        {
+            periodic_tx::removeAll();
+        }
+        else
+        {
+            std::puts("ERROR: Invalid usage; expected: cyclic [set <index> <frame> <period_usec> [phase_usec] | "
+                      "data <index> <hex> | del <index> | clear]");
+            return;
+        }
+
+        if (res < 0)
+        {
+            std::printf("ERROR: %d\n", res);
+        }
+    }
+
+    /**
+     * The capture is read with the command "capture dump", which is not a complex command, see processCommand().
+     */
+    void cmdCapture(int argc, char** argv)
+    {
+        auto parse_hex = [](const char* str, std::uint32_t& out_value)
+        {
+            char* end = nullptr;
+            out_value = std::uint32_t(std::strtoul(str, &end, 16));
+            return (end != str) && (*end == '\0');
+        };
+
+        auto parse_bytes = [](const char* str, std::uint8_t* out_bytes, unsigned& out_len)
+        {
+            const unsigned len = std::strlen(str);
+            out_len = len / 2;
+            return (len % 2 == 0) && (len <= can::Frame::MaxDataLen * 2) &&
+                   hex_codec::decodeBytes(str, out_bytes, out_len);
+        };
+
+        if (argc == 1)
+        {
+            static const char* const StateNames[] = { "idle", "armed", "triggered", "frozen" };
+            const auto status = can::getCaptureStatus();
+            std::printf("state: %s\n", StateNames[unsigned(status.state)]);
+            std::printf("frames: %u\n", status.length);
+            std::printf("trigger_index: %u\n", status.trigger_index);
+            return;
+        }
+
+        if ((argc >= 2) && (std::strcmp(argv[1], "arm") == 0))
+        {
+            CaptureTrigger trigger;
+
+            if ((argc == 3) && (std::strcmp(argv[2], "error") == 0))
+            {
+                trigger.on_error_state = true;
+            }
+            else if (argc == 4 || argc == 6)
+            {
+                trigger.on_frame = true;
+                unsigned data_len = 0;
+                unsigned data_mask_len = 0;
+                if (!parse_hex(argv[2], trigger.id) || !parse_hex(argv[3], trigger.id_mask) ||
+                    ((argc == 6) && (!parse_bytes(argv[4], &trigger.data[0], data_len) ||
+                                     !parse_bytes(argv[5], &trigger.data_mask[0], data_mask_len) ||
+                                     (data_len != data_mask_len))))
+                {
+                    std::puts("ERROR: Invalid arguments");
+                    return;
+                }
+            }
+            else if (argc != 2)
             {
-                std::puts("ERROR: Write failed");
+                std::puts("ERROR: Invalid usage; expected: capture arm [error | <id> <mask> [<data> <data_mask>]]");
+                return;
             }
+
+            can::armCapture(trigger, cfg_capture_post_trigger_frames.get());
+        }
+        else if ((argc == 2) && (std::strcmp(argv[1], "trigger") == 0))
+        {
+            can::triggerCapture();
+        }
+        else if ((argc == 2) && (std::strcmp(argv[1], "stop") == 0))
+        {
+            can::freezeCapture();
         }
         else
         {
-            std::puts("ERROR: Invalid usage");
+            std::puts("ERROR: Invalid usage; expected: capture [arm ... | trigger | stop]");
         }
     }
 
-    void cmdStat(int, char**)
+    /**
+     * Detects the bitrate of the bus and stores it in the configuration, so that the next SLCAN command O will use it.
+     * The whole sequence must fit into the watchdog timeout, hence the limit of the listening time.
+     * The channel must be closed, because the detection reopens it at every candidate bitrate.
+     */
+    void cmdAutobaud(int argc, char** argv)
     {
-        static constexpr auto FormatString = "%-22s: %s\n";
+        static constexpr unsigned DefaultListenTimeoutMSec = 50;
+        static constexpr unsigned MaxListenTimeoutMSec = 100;
 
-        // We can't use printf() for conversion because ChibiOS's printf() implementation does not support `long long`.
-#       define STAT_PRINT_ONE_KEY(object, field) \
-            std::printf(FormatString, STRINGIZE(field), os::uintToString(object . field).c_str());
+        // Ordered by popularity
+        static const std::uint32_t Candidates[] =
+        {
+            1000000, 500000, 250000, 125000, 100000, 800000, 50000, 20000, 10000
+        };
+        static constexpr unsigned NumCandidates = sizeof(Candidates) / sizeof(Candidates[0]);
 
-        std::printf(FormatString, "open",  can::isOpen() ? "true" : "false");
+        // A quarter of the watchdog timeout is left for the configuration storage and the rest of the main loop
+        static_assert(NumCandidates * (MaxListenTimeoutMSec + can::BitRateDetectionOverheadMSec) <=
+                      WatchdogTimeoutMSec * 3 / 4, "Autobaud may trigger the watchdog");
 
+        const unsigned listen_timeout = (argc > 1) ? unsigned(std::atoi(argv[1])) : DefaultListenTimeoutMSec;
+        if ((listen_timeout < 1) || (listen_timeout > MaxListenTimeoutMSec))
         {
-            const auto status = can::getStatus();
-
-            std::printf(FormatString, "state", status.getStateAsString());
-            STAT_PRINT_ONE_KEY(status, receive_error_counter)
-            STAT_PRINT_ONE_KEY(status, transmit_error_counter)
+            os::MutexLocker mlocker(session_.mutex);
+            std::printf("ERROR: Invalid usage; expected: autobaud [listen_msec <= %u]\n", MaxListenTimeoutMSec);
+            return;
         }
 
+        if (can::isOpen())
         {
-            const auto statistics = can::getStatistics();
+            os::MutexLocker mlocker(session_.mutex);
+            std::puts("ERROR: Close the channel first");
+            return;
+        }
 
-            STAT_PRINT_ONE_KEY(statistics, errors)
-            STAT_PRINT_ONE_KEY(statistics, bus_off_events)
-            STAT_PRINT_ONE_KEY(statistics, sw_rx_queue_overruns)
-            STAT_PRINT_ONE_KEY(statistics, hw_rx_queue_overruns)
-            STAT_PRINT_ONE_KEY(statistics, frames_tx)
-            STAT_PRINT_ONE_KEY(statistics, frames_rx)
-            STAT_PRINT_ONE_KEY(statistics, tx_queue_capacity)
-            STAT_PRINT_ONE_KEY(statistics, tx_queue_peak_usage)
-            STAT_PRINT_ONE_KEY(statistics, rx_queue_capacity)
-            STAT_PRINT_ONE_KEY(statistics, rx_queue_peak_usage)
-            STAT_PRINT_ONE_KEY(statistics, tx_mailbox_peak_usage)
+        /*
+         * The detection opens and closes the channel repeatedly, which locks the driver mutexes for a long time;
+         * this handler is invoked without the session lock, so the session is locked only around the output.
+         */
+        const int res = can::detectBitRate(&Candidates[0], NumCandidates, std::uint16_t(listen_timeout),
+                                           cfg_can_sample_point.get());
+        const int save_res = (res < 0) ? 0 : cfg_can_bitrate.setAndSave(unsigned(res));
+
+        os::MutexLocker mlocker(session_.mutex);
+        if (res < 0)
+        {
+            std::printf("ERROR: Could not detect bitrate: %d\n", res);
+            return;
         }
 
-        std::printf("%-22s: %.1f\n", "bus_voltage", board::getBusVoltage());
+        std::printf("bitrate: %d\n", res);
+
+        if (save_res < 0)
+        {
+            std::printf("ERROR: Could not save configuration: %d\n", save_res);
+        }
     }
 
     void cmdReboot(int, char**)
     {
+        // The bootloader does not need to wait for the host, this reboot was requested by it already
+        bootloader_app_interface::AppShared apsh;
+        apsh.setFlag(bootloader_app_interface::AppShared::FlagSkipBootDelay);
+        bootloader_app_interface::write(apsh);
+
         os::requestReboot();
     }
 
@@ -629,11 +1673,8 @@ class CommandProcessor
         return std::strncmp(prefix, str, std::strlen(prefix)) == 0;
     }
 
-    const char* processComplexCommand(char* buf, void (CommandProcessor::*handler)(int, char**))
+    void invokeComplexCommandHandler(char* buf, void (CommandProcessor::*handler)(int, char**))
     {
-        // Replying with echo
-        std::puts(buf);
-
         // Parsing the line
         class Tokenizer
         {
@@ -662,7 +1703,7 @@ class CommandProcessor
             }
         };
 
-        constexpr unsigned MaxArgs = 5;
+        constexpr unsigned MaxArgs = 6;
         char* args[MaxArgs] = {nullptr};
         std::uint8_t idx = 0;
         Tokenizer tokenizer;
@@ -682,6 +1723,41 @@ class CommandProcessor
         {
             (this->*handler)(idx, args);
         }
+    }
+
+    /**
+     * The output is directed to the session the command came from. The session is locked while the handler is
+     * running, so that the output is not interleaved with the frames. The handlers that keep the driver busy for
+     * a long time are invoked with lock_session=false; such handlers must lock the session around their output.
+     */
+    const char* processComplexCommand(char* buf, void (CommandProcessor::*handler)(int, char**),
+                                      const bool lock_session = true)
+    {
+        // Multi-line text output can't be framed in the binary mode
+        if (session_.options.encoding != Encoding::ASCII)
+        {
+            return getASCIIStatusCode(false);
+        }
+
+        ::BaseChannel* const stdio_stream = os::getStdIOStream();
+        os::setStdIOStream(session_.channel);
+
+        if (lock_session)
+        {
+            os::MutexLocker mlocker(session_.mutex);
+            std::puts(buf);                             // Replying with echo
+            invokeComplexCommandHandler(buf, handler);
+        }
+        else
+        {
+            {
+                os::MutexLocker mlocker(session_.mutex);
+                std::puts(buf);
+            }
+            invokeComplexCommandHandler(buf, handler);
+        }
+
+        os::setStdIOStream(stdio_stream);
 
         // Returning the end of the multi-line response marker
         return "\x03\r\n";
@@ -690,6 +1766,18 @@ class CommandProcessor
     static inline const char* getASCIIStatusCode(bool status) { return status ? "\r" : "\a"; }
 
 public:
+    explicit CommandProcessor(Session& session) :
+        session_(session)
+    { }
+
+    /**
+     * Returns true if the command is a frame transmission command, which never writes anything by itself.
+     */
+    static bool isFrameCommand(const char* cmd)
+    {
+        return (cmd[0] == 'T') || (cmd[0] == 't') || (cmd[0] == 'R') || ((cmd[0] == 'r') && (cmd[1] <= '9'));
+    }
+
     /**
      * Accepts command string, returns response string or nullptr if no response is needed.
      */
@@ -719,6 +1807,14 @@ public:
             ; // Looking further
         }
 
+        /*
+         * The capture dump is performed by the RX thread in the current encoding, it writes the status code when done
+         */
+        if (std::strcmp(cmd, "capture dump") == 0)
+        {
+            return rx_thread_.requestCaptureDump(session_) ? nullptr : getASCIIStatusCode(false);
+        }
+
         /*
          * Complex commands
          * These are handled before the single-letter SLCAN commands to avoid unwanted greedy matching
@@ -735,6 +1831,26 @@ public:
         {
             return processComplexCommand(cmd, &CommandProcessor::cmdStat);
         }
+        else if (startsWith(cmd, "prof"))
+        {
+            return processComplexCommand(cmd, &CommandProcessor::cmdProf);
+        }
+        else if (startsWith(cmd, "filter"))
+        {
+            return processComplexCommand(cmd, &CommandProcessor::cmdFilter);
+        }
+        else if (startsWith(cmd, "capture"))
+        {
+            return processComplexCommand(cmd, &CommandProcessor::cmdCapture);
+        }
+        else if (startsWith(cmd, "cyclic"))
+        {
+            return processComplexCommand(cmd, &CommandProcessor::cmdCyclic);
+        }
+        else if (startsWith(cmd, "autobaud"))
+        {
+            return processComplexCommand(cmd, &CommandProcessor::cmdAutobaud, false);
+        }
         else if (startsWith(cmd, "bootloader"))
         {
             return processComplexCommand(cmd, &CommandProcessor::cmdBootloader);
@@ -781,17 +1897,17 @@ public:
         case 'O':               // Open CAN in normal mode
         {
             DEBUG_LOG("Open normal\n");
-            return getASCIIStatusCode(0 <= can::open(cfg_can_bitrate.get()));
+            return getASCIIStatusCode(0 <= openCAN(0));
         }
         case 'L':               // Open CAN in listen-only mode
         {
             DEBUG_LOG("Open silent\n");
-            return getASCIIStatusCode(0 <= can::open(cfg_can_bitrate.get(), can::OptionSilentMode));
+            return getASCIIStatusCode(0 <= openCAN(can::OptionSilentMode));
         }
         case 'l':               // Open CAN with loopback enabled
         {
             DEBUG_LOG("Open loopback\n");
-            return getASCIIStatusCode(0 <= can::open(cfg_can_bitrate.get(), can::OptionLoopback));
+            return getASCIIStatusCode(0 <= openCAN(can::OptionLoopback));
         }
         case 'C':               // Close CAN
         {
@@ -804,14 +1920,26 @@ public:
         {
             /*
              * These SLCAN commands were designed to work with the SJA1000 controller.
-             * SJA1000's hardware acceptance filters are very peculiar to say the least,
-             * so implementing compatible commands would require to implement all of that ugly trickery
-             * to mimic SJA1000.
-             * I see litle value in prolonging the life of such brain-dead conventions, so this feature will
-             * remain unimplemented until someone explicitly requested it.
-             * If you REALLY need this feature, please contact us at http://productforums.zubax.com.
+             * Only the identifier part of its single filter mode is emulated, see applyAcceptanceFilters().
+             * Native filters are much more capable, see the command "filter".
              */
-            return getASCIIStatusCode(true);    // Returning success for compatibility reasons
+            if (std::strlen(cmd) != 9)
+            {
+                return getASCIIStatusCode(false);
+            }
+
+            std::uint32_t value = 0;
+            if (!hex_codec::decodeU32(&cmd[1], value))
+            {
+                return getASCIIStatusCode(false);
+            }
+
+            {
+                os::CriticalSectionLocker cs_locker;
+                ((cmd[0] == 'M') ? sja1000_acceptance_filter.code : sja1000_acceptance_filter.mask) = value;
+            }
+
+            return getASCIIStatusCode(applyAcceptanceFilters() >= 0);
         }
         case 'U':               // Set UART baud rate, see http://www.can232.com/docs/can232_v3.pdf
         {
@@ -836,17 +1964,31 @@ public:
 
             return getASCIIStatusCode(cfg_baudrate.setAndSave(baudrate) >= 0);
         }
-        case 'Z':               // Enable/disable RX and loopback timestamping
+        case 'Z':               // Enable/disable RX and loopback timestamping; Z2 selects the extended format
         {
-            if (cmd[1] < '0' || cmd[1] > '1')
+            if (cmd[1] < '0' || cmd[1] > '2')
             {
                 return getASCIIStatusCode(false);
             }
 
-            const bool on = cmd[1] == '1';
-            DEBUG_LOG("Timestamping %u\n", unsigned(on));
+            const bool on  = cmd[1] != '0';
+            const bool ext = cmd[1] == '2';
+            DEBUG_LOG("Timestamping %u ext %u\n", unsigned(on), unsigned(ext));
+
+            // Only this session is affected, the configuration defines the default for the new sessions
+            os::MutexLocker mlocker(configured_session_options_mutex);
+            {
+                os::MutexLocker session_mlocker(session_.mutex);
+                session_.options.timestamping_on  = on;
+                session_.options.timestamping_ext = ext;
+            }
+            configured_session_options.timestamping_on  = on;
+            configured_session_options.timestamping_ext = ext;
 
-            return getASCIIStatusCode(cfg_timestamping_on.setAndSave(on) >= 0);
+            const bool ok = (cfg_timestamping_on.set(on) >= 0) &&
+                            (cfg_timestamping_ext.set(ext) >= 0) &&
+                            (os::config::save() >= 0);
+            return getASCIIStatusCode(ok);
         }
         case 'F':               // Get status flags
         {
@@ -870,10 +2012,8 @@ public:
             }
 
             // RX overrun flag
-            const auto stats = can::getStatistics();
-
             static std::uint64_t last_rx_overrun_cnt = 0;
-            const std::uint64_t rx_overrun_cnt = stats.hw_rx_queue_overruns + stats.sw_rx_queue_overruns;
+            const std::uint64_t rx_overrun_cnt = can::getRxOverrunCount();
 
             if (rx_overrun_cnt > last_rx_overrun_cnt)
             {
@@ -884,27 +2024,75 @@ public:
             DEBUG_LOG("Flags %02X\n", unsigned(response));
 
             // Responding
-            std::printf("F%02X\r", unsigned(response));
-            return nullptr;
+            chsnprintf(&response_buffer_[0], sizeof(response_buffer_), "F%02X\r", unsigned(response));
+            return &response_buffer_[0];
         }
         case 'V':               // HW/SW version
         {
-            std::printf("V%x%x%x%x\r", HW_VERSION, 0, FW_VERSION_MAJOR, FW_VERSION_MINOR);
-            return nullptr;
+            chsnprintf(&response_buffer_[0], sizeof(response_buffer_), "V%x%x%x%x\r",
+                       HW_VERSION, 0, FW_VERSION_MAJOR, FW_VERSION_MINOR);
+            return &response_buffer_[0];
         }
         case 'N':               // Serial number
         {
+            const auto uid = board::readUniqueID();
             char buf[std::tuple_size<board::UniqueID>::value * 2 + 1] = { '\0' };
-            char* pos = &buf[0];
-            for (auto x : board::readUniqueID())
+            *hex_codec::encodeBytes(uid.data(), uid.size(), reinterpret_cast<std::uint8_t*>(&buf[0])) = '\0';
+            chsnprintf(&response_buffer_[0], sizeof(response_buffer_), "N%s\r", &buf[0]);
+            return &response_buffer_[0];
+        }
+        case 'B':               // Select encoding, see binary_protocol.hpp
+        {
+            if (cmd[1] < '0' || cmd[1] > '1')
             {
-                *pos++ = nibble2hex(x >> 4);
-                *pos++ = nibble2hex(x);
+                return getASCIIStatusCode(false);
             }
-            *pos++ = '\0';
-            std::printf("N%s\r", &buf[0]);
+
+            const auto new_encoding = (cmd[1] == '1') ? Encoding::Binary : Encoding::ASCII;
+            DEBUG_LOG("Encoding %u\n", unsigned(new_encoding));
+
+            // The response is sent using the old encoding; everything that follows will be using the new one
+            os::MutexLocker mlocker(session_.mutex);
+            session_.writeResponse(getASCIIStatusCode(true));
+            session_.options.encoding = new_encoding;
             return nullptr;
         }
+        case 'Y':               // Set time beacon interval in milliseconds, zero disables; not persistent
+        {
+            /*
+             * Every beacon carries the reference time of the previous one, i.e. the timestamp of the moment when
+             * the previous beacon was passed to the host: the start of the following USB frame, or the end of the
+             * stop bit of its last byte on UART. The timestamps are extended, like with the command Z2.
+             * The reference time is all ones if it is not known, e.g. in the first beacon, or while the CAN channel
+             * is closed, because the time base is started when the channel is opened for the first time
+             * The reference time is also all ones if the previous beacon was queued behind other output, because then
+             * its timing is not exact. A beacon that does not fit into the output queue is skipped, not truncated.
+             */
+            static constexpr unsigned MaxIntervalMSec = 30000;
+
+            if (cmd[1] < '0' || cmd[1] > '9')
+            {
+                return getASCIIStatusCode(false);
+            }
+
+            const unsigned interval = unsigned(std::atoi(&cmd[1]));
+            if (interval > MaxIntervalMSec)
+            {
+                return getASCIIStatusCode(false);
+            }
+            DEBUG_LOG("Time beacon interval %u\n", interval);
+
+            os::MutexLocker mlocker(session_.mutex);
+            session_.options.beacon_interval_ms = interval;
+            session_.beacon.last_emitted_at = chVTGetSystemTime();
+            session_.beacon.sequence = 0;
+            session_.beacon.capture_armed = false;
+            {
+                os::CriticalSectionLocker cs_locker;
+                session_.beacon.latched = false;
+            }
+            return getASCIIStatusCode(true);
+        }
         default:
         {
             break;
@@ -922,15 +2110,144 @@ class CommandParser
     char buf_[BufferSize + 1];
     std::uint8_t pos_ = 0;
 
+    Session& session_;
     CommandProcessor proc_;
 
+    /*
+     * Responses to frame transmission commands are accumulated here and written at once by flush(), which saves
+     * a mutex acquisition and a write call per frame. Other responses are written in order, after the ACKs.
+     */
+    static constexpr unsigned AckBufferSize = 64;
+    char ack_buf_[AckBufferSize + 1];
+    std::uint8_t ack_len_ = 0;
+
+    unsigned last_reported_credits_ = 0xFFFFFFFFU;
+
+    void addAck(const char* const response)
+    {
+        const unsigned len = std::strlen(response);
+        if UNLIKELY((ack_len_ + len) > AckBufferSize)
+        {
+            flush();
+        }
+        assert(len <= AckBufferSize);
+        std::memcpy(&ack_buf_[ack_len_], response, len);
+        ack_len_ = std::uint8_t(ack_len_ + len);
+    }
+
+    void processPacket()
+    {
+        auto* const data = reinterpret_cast<std::uint8_t*>(&buf_[0]);
+
+        binary_protocol::PacketType type = binary_protocol::PacketType();
+        const int payload_len = binary_protocol::decodePacket(data, pos_, type);
+        if UNLIKELY(payload_len < 0)
+        {
+            return;                                             // Malformed packets are silently dropped
+        }
+
+        const std::uint8_t* const payload = data + 1;
+        const char* response = nullptr;
+
+        if LIKELY(type == binary_protocol::PacketType::CANFrames)
+        {
+            // Each frame produces the same response as in the ASCII mode; all of them are sent in one packet
+            static constexpr unsigned MaxFramesPerPacket = BufferSize / binary_protocol::FrameRecordHeaderSize;
+            char frame_responses[MaxFramesPerPacket * 2 + 2];
+            char* out = &frame_responses[0];
+
+            const std::uint8_t* ptr = payload;
+            const std::uint8_t* const end = payload + payload_len;
+            while (ptr < end)
+            {
+                can::Frame f;
+                if UNLIKELY(!binary_protocol::parseFrameRecord(ptr, end, f))
+                {
+                    *out++ = '\a';
+                    break;                                      // The rest of the packet can't be parsed
+                }
+
+                if LIKELY(submitFrame(f))
+                {
+                    *out++ = f.isExtended() ? 'Z' : 'z';
+                    *out++ = '\r';
+                }
+                else
+                {
+                    *out++ = '\a';
+                }
+            }
+
+            *out++ = '\0';
+            assert(out <= &frame_responses[sizeof(frame_responses)]);
+            addAck(&frame_responses[0]);
+        }
+        else if (type == binary_protocol::PacketType::Text)
+        {
+            // The decoded packet is always shorter than the encoded one because of the type and CRC
+            data[1 + payload_len] = '\0';
+            auto* const cmd = reinterpret_cast<char*>(data + 1);
+            if LIKELY(CommandProcessor::isFrameCommand(cmd))
+            {
+                addAck(proc_.processCommand(cmd));
+            }
+            else
+            {
+                flush();
+                response = proc_.processCommand(cmd);
+            }
+        }
+        else
+        {
+            ;                                                   // Unknown packet type, ignoring
+        }
+
+        if (response != nullptr)
+        {
+            os::MutexLocker mlocker(session_.mutex);
+            session_.writeResponse(response);
+        }
+    }
+
+    inline void addBinaryByte(const std::uint8_t byte)
+    {
+        if (byte == binary_protocol::PacketDelimiter)
+        {
+            if LIKELY(pos_ > 0)
+            {
+                processPacket();
+            }
+            reset();
+        }
+        else if LIKELY(pos_ < BufferSize)
+        {
+            buf_[pos_] = char(byte);
+            pos_ += 1;
+        }
+        else
+        {
+            reset();                                            // Buffer overrun; the rest will fail CRC check
+        }
+    }
+
 public:
+    explicit CommandParser(Session& session) :
+        session_(session),
+        proc_(session)
+    { }
+
+    Session& getSession() const { return session_; }
+
     /**
      * Please keep in mind that this function is strongly optimized for speed.
      */
     inline void addByte(const std::uint8_t byte)
     {
-        if LIKELY((byte >= 32 && byte <= 126))                  // Normal printable ASCII character
+        if UNLIKELY(session_.options.encoding != Encoding::ASCII)
+        {
+            addBinaryByte(byte);
+        }
+        else if LIKELY((byte >= 32 && byte <= 126))             // Normal printable ASCII character
         {
             if LIKELY(pos_ < BufferSize)
             {
@@ -946,15 +2263,23 @@ public:
         {
             // Processing the command
             buf_[pos_] = '\0';
-            const char* const response = proc_.processCommand(reinterpret_cast<char*>(&buf_[0]));
-            reset();
-
-            // Sending the response if provided
-            if LIKELY(response != nullptr)
+            if LIKELY(CommandProcessor::isFrameCommand(&buf_[0]))
             {
-                os::MutexLocker mlocker(os::getStdIOMutex());
-                chnWriteTimeout(os::getStdIOStream(), reinterpret_cast<const std::uint8_t*>(response),
-                                std::strlen(response), MS2ST(1));
+                addAck(proc_.processCommand(&buf_[0]));
+                reset();
+            }
+            else
+            {
+                flush();
+                const char* const response = proc_.processCommand(&buf_[0]);
+                reset();
+
+                // Sending the response if provided
+                if LIKELY(response != nullptr)
+                {
+                    os::MutexLocker mlocker(session_.mutex);
+                    session_.writeResponse(response);
+                }
             }
         }
         else if UNLIKELY(byte == 8 || byte == 127)              // DEL or BS (backspace)
@@ -973,11 +2298,71 @@ public:
         assert(pos_ <= BufferSize);
     }
 
+    /**
+     * If enabled with the parameter slcan.credits_on, the number of free slots in the TX queue is reported to the
+     * host whenever it changes, so that the host can keep the queue full without ever getting a NACK:
+     *  Q<credits:3 hex digits>\r
+     * The report follows the ACKs of the same batch, so it accounts for all the frames it acknowledges.
+     * @param min_increase  Smaller increases are not reported, which limits the rate of the reports while the queue
+     *                      is draining. Decreases are always reported.
+     */
+    void reportCredits(const unsigned min_increase)
+    {
+        const unsigned credits = can::getTxQueueFreeSpace();
+        if ((credits < last_reported_credits_) ||
+            ((credits - last_reported_credits_) >= min_increase))
+        {
+            last_reported_credits_ = credits;   // Updated first because addAck() may invoke flush()
+
+            char report[] = "Q000\r";
+            (void)hex_codec::encodeU12(credits, reinterpret_cast<std::uint8_t*>(&report[1]));
+            addAck(&report[0]);
+        }
+    }
+
+    /**
+     * Writes the accumulated ACKs, see addAck(). Must be invoked after every batch of input bytes,
+     * and also while there is no input, in order to report the credits.
+     * @param min_credits_increase  See reportCredits().
+     */
+    void flush(const unsigned min_credits_increase = 1)
+    {
+        if UNLIKELY(session_.options.credits_on)
+        {
+            reportCredits(min_credits_increase);
+        }
+
+        if (ack_len_ > 0)
+        {
+            ack_buf_[ack_len_] = '\0';
+            ack_len_ = 0;
+            os::MutexLocker mlocker(session_.mutex);
+            session_.writeResponse(&ack_buf_[0]);
+        }
+    }
+
     void reset()
     {
         pos_ = 0;
     }
-} command_parser_;
+
+    /**
+     * Invoked by the main thread when the interface is connected or disconnected, see setSessionActive().
+     */
+    void setActive(const bool active)
+    {
+        if (active != session_.active)
+        {
+            reset();
+            ack_len_ = 0;
+            last_reported_credits_ = 0xFFFFFFFFU;
+            setSessionActive(session_, active);
+        }
+    }
+};
+
+CommandParser usb_command_parser_(usb_session);
+CommandParser uart_command_parser_(uart_session);
 
 }
 }
@@ -991,52 +2376,113 @@ int main()
 
     chibios_rt::BaseThread::setPriority(NORMALPRIO);
 
+    profiler::init();
+
     app::background_thread_.start(LOWPRIO);
     app::rx_thread_.start(NORMALPRIO - 1);
+    profiler::registerThread("background", app::background_thread_);
+    profiler::registerThread("rx", app::rx_thread_);
+
+    /*
+     * Running the serial port processing loop.
+     * The loop is event driven: the thread sleeps until there is input from either interface, the USB connection
+     * state changes, or the CAN driver reports free space in the TX queue (needed for the credit reports only).
+     * The timeout is needed to feed the watchdog and to catch the interface changes that are not signaled.
+     * The USB session is active while USB is connected; the UART session is active while USB is not connected,
+     * or always if configured so.
+     */
+    static constexpr unsigned IdleTimeoutMSec = 100;
+    static constexpr unsigned CreditsReportHysteresis = 8;
 
     /*
-     * Running the serial port processing loop
+     * If the channel was opened at boot, the UART session is not activated until USB had a chance to enumerate,
+     * so that the frames received since power-up are delivered to the USB host if there is one.
      */
-    static constexpr unsigned ReadTimeoutMSec = 5;
+    static constexpr unsigned USBEnumerationTimeoutMSec = 1000;
+    const ::systime_t started_at = chVTGetSystemTime();
+
+    static constexpr eventmask_t USBEventMask  = EVENT_MASK(0);
+    static constexpr eventmask_t UARTEventMask = EVENT_MASK(1);
+    static constexpr eventmask_t CANEventMask  = EVENT_MASK(2);
+
+    app::CommandParser* const parsers[] = { &app::usb_command_parser_, &app::uart_command_parser_ };
 
-    const auto usb_port = usb_cdc::getSerialUSBDriver();
-    const auto uart_port = &STDOUT_SD;
+    event_listener_t usb_listener;
+    event_listener_t uart_listener;
+    event_listener_t can_listener;
+    chEvtRegisterMaskWithFlags(chnGetEventSource(app::usb_session.channel), &usb_listener, USBEventMask,
+                               CHN_INPUT_AVAILABLE | CHN_CONNECTED | CHN_DISCONNECTED);
+    chEvtRegisterMaskWithFlags(chnGetEventSource(app::uart_session.channel), &uart_listener, UARTEventMask,
+                               CHN_INPUT_AVAILABLE);
+    chEvtRegisterMaskWithFlags(can::getEventSource(), &can_listener, CANEventMask, can::EventFlagTxQueueSpace);
 
     while (true)
     {
         watchdog.reset();
 
-        ::BaseChannel* const stdio_stream = os::getStdIOStream();
-
         static std::uint8_t buf[128];
 
-        // First, read as much as possible without blocking to maximize throughput; if nothing is available, block
-        std::size_t nread = chnReadTimeout(stdio_stream, buf, sizeof(buf), TIME_IMMEDIATE);
-        if UNLIKELY(nread == 0)         // This branch will be taken only when traffic is low
+        // Reading everything that is available without blocking; the events are latched, so none can be missed
+        // The input of inactive sessions is discarded
+        bool had_input = false;
+        for (auto p : parsers)
+        {
+            const std::size_t nread = chnReadTimeout(p->getSession().channel, buf, sizeof(buf), TIME_IMMEDIATE);
+            if (nread > 0)
+            {
+                had_input = true;
+                if LIKELY(p->getSession().active)
+                {
+                    for (unsigned i = 0; i < nread; i++)
+                    {
+                        p->addByte(buf[i]);
+                    }
+                    p->flush();
+                }
+            }
+        }
+        if LIKELY(had_input)
+        {
+            continue;
+        }
+
+        // Activating and deactivating the sessions if necessary
+        const bool usb_connected = usb_cdc::getState() == usb_cdc::State::Connected;
+        const bool uart_held = app::cfg_can_auto_open.get() && !usb_connected &&
+                               (chVTTimeElapsedSinceX(started_at) < MS2ST(USBEnumerationTimeoutMSec));
+        const bool uart_active = (!usb_connected && !uart_held) || app::cfg_uart_always_active.get();
+        if ((app::usb_session.active != usb_connected) || (app::uart_session.active != uart_active))
         {
-            nread = chnReadTimeout(stdio_stream, buf, 1, MS2ST(ReadTimeoutMSec));
+            DEBUG_LOG("Sessions: USB %u UART %u\n", unsigned(usb_connected), unsigned(uart_active));
+            app::usb_command_parser_.setActive(usb_connected);
+            app::uart_command_parser_.setActive(uart_active);
+
+            // The log output goes to the primary interface
+            os::setStdIOStream(usb_connected ? app::usb_session.channel : app::uart_session.channel);
+            continue;
         }
 
-        if LIKELY(nread > 0)
+        // The CAN driver events are not waited for unless they are needed, which saves a wakeup per frame
+        bool credits_on = false;
+        for (auto p : parsers)
         {
-            for (unsigned i = 0; i < nread; i++)
-            {
-                app::command_parser_.addByte(buf[i]);
-            }
+            credits_on = credits_on || (p->getSession().active && p->getSession().options.credits_on);
         }
-        else
+
+        const eventmask_t wait_mask = credits_on ? ALL_EVENTS : (ALL_EVENTS & ~CANEventMask);
+        const eventmask_t events = chEvtWaitAnyTimeout(wait_mask, MS2ST(IdleTimeoutMSec));
+        (void)chEvtGetAndClearFlags(&usb_listener);
+        (void)chEvtGetAndClearFlags(&uart_listener);
+        (void)chEvtGetAndClearFlags(&can_listener);
+
+        if ((events == CANEventMask) || (events == 0))
         {
-            // Switching interfaces if necessary
-            const bool using_usb = reinterpret_cast<::BaseChannel*>(stdio_stream) ==
-                                   reinterpret_cast<::BaseChannel*>(usb_port);
-            const bool usb_connected = usb_cdc::getState() == usb_cdc::State::Connected;
-            if (using_usb != usb_connected)
-            {
-                DEBUG_LOG("Switching to %s\n", usb_connected ? "USB" : "UART");
-                os::setStdIOStream(usb_connected ?
-                                   reinterpret_cast<::BaseChannel*>(usb_port) :
-                                   reinterpret_cast<::BaseChannel*>(uart_port));
-                app::command_parser_.reset();
+            for (auto p : parsers)
+            {
+                if (p->getSession().active)
+                {
+                    p->flush((events == CANEventMask) ? CreditsReportHysteresis : 1);
+                }
             }
         }
     }
@@ -0,0 +1,251 @@
+/*
+ * Copyright (C) 2015  Zubax Robotics  <info@zubax.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+#include "periodic_tx.hpp"
+#include <zubax_chibios/os.hpp>
+#include <hal.h>
+#include <algorithm>
+#include <cstring>
+
+/*
+ * The timer is 16 bit, so longer intervals are split into multiple wakeups.
+ */
+#define SCHEDULER_GPT           GPTD6
+
+namespace periodic_tx
+{
+namespace
+{
+
+constexpr std::uint32_t MaxTimerIntervalUSec = 0xFFFF;
+constexpr std::uint32_t MinTimerIntervalUSec = 2;   ///< The GPT driver sets ARR = interval - 1; ARR = 0 stops the timer
+
+struct SlotState
+{
+    Slot config;
+    std::uint64_t deadline_usec = 0;
+
+    bool isUsed() const { return config.period_usec > 0; }
+};
+
+SlotState slots_[NumSlots];
+
+std::uint32_t num_skipped_frames_ = 0;
+
+
+std::uint64_t getMonotonicUSec()
+{
+    return can::extendTimestampUSec(can::getTimestampUSec());
+}
+
+/**
+ * Returns the nearest moment (N * period + phase) that is strictly later than the specified time.
+ */
+std::uint64_t computeNextDeadline(const std::uint64_t now_usec, const Slot& config)
+{
+    std::uint64_t deadline = (now_usec / config.period_usec) * config.period_usec + config.phase_usec;
+    if (deadline <= now_usec)
+    {
+        deadline += config.period_usec;
+    }
+    return deadline;
+}
+
+/**
+ * Submits the frames that are due and re-arms the timer for the nearest deadline.
+ * Must be invoked from a critical section, with the timer stopped.
+ */
+void serviceI()
+{
+    const std::uint64_t now = getMonotonicUSec();
+
+    std::uint64_t nearest_deadline = now + MaxTimerIntervalUSec;
+    bool any_used = false;
+
+    for (auto& s : slots_)
+    {
+        if (!s.isUsed())
+        {
+            continue;
+        }
+
+        if (s.deadline_usec <= now)
+        {
+            if (can::sendI(s.config.frame) <= 0)
+            {
+                num_skipped_frames_++;
+            }
+
+            s.deadline_usec += s.config.period_usec;
+            if UNLIKELY(s.deadline_usec <= now)            // Some periods were missed, they are skipped
+            {
+                const std::uint64_t next_deadline = computeNextDeadline(now, s.config);
+                num_skipped_frames_ += std::uint32_t((next_deadline - s.deadline_usec) / s.config.period_usec);
+                s.deadline_usec = next_deadline;
+            }
+        }
+
+        nearest_deadline = std::min(nearest_deadline, s.deadline_usec);
+        any_used = true;
+    }
+
+    if (!any_used)
+    {
+        return;                 // The timer will be restarted when the table is changed
+    }
+
+    const auto interval = std::max<std::uint64_t>(MinTimerIntervalUSec,
+                                                  std::min<std::uint64_t>(MaxTimerIntervalUSec, nearest_deadline - now));
+    gptStartOneShotI(&SCHEDULER_GPT, gptcnt_t(interval));
+}
+
+/**
+ * Re-evaluates the schedule after the table was changed.
+ * Must be invoked from a critical section.
+ */
+void rescheduleI()
+{
+    if (SCHEDULER_GPT.state == GPT_ONESHOT)
+    {
+        gptStopTimerI(&SCHEDULER_GPT);
+    }
+    serviceI();
+}
+
+void handleTimerExpiration(GPTDriver*)
+{
+    os::CriticalSectionLocker cs_lock;
+    serviceI();
+}
+
+bool isSlotIndexValid(const unsigned index)
+{
+    return index < NumSlots;
+}
+
+}
+
+void init()
+{
+    static const GPTConfig gpt_cfg =
+    {
+        1000 * 1000,        // Clock rate [Hz]
+        &handleTimerExpiration,
+        0,                  // CR2
+        0                   // DIER
+    };
+    gptStart(&SCHEDULER_GPT, &gpt_cfg);
+
+    os::CriticalSectionLocker cs_lock;
+    rescheduleI();
+}
+
+int set(const unsigned index, const can::Frame& frame, const std::uint32_t period_usec,
+        const std::uint32_t phase_usec)
+{
+    if (!isSlotIndexValid(index))
+    {
+        return -ErrInvalidSlot;
+    }
+
+    if (period_usec < MinPeriodUSec || period_usec > MaxPeriodUSec || phase_usec >= period_usec)
+    {
+        return -ErrInvalidPeriod;
+    }
+
+    if (frame.isErrorFrame() || frame.dlc > 8)
+    {
+        return -can::ErrUnsupportedFrame;
+    }
+
+    os::CriticalSectionLocker cs_lock;
+
+    auto& s = slots_[index];
+    s.config.frame = frame;
+    s.config.period_usec = period_usec;
+    s.config.phase_usec = phase_usec;
+    s.deadline_usec = computeNextDeadline(getMonotonicUSec(), s.config);
+
+    rescheduleI();
+    return 0;
+}
+
+int updatePayload(const unsigned index, const std::uint8_t* const data, const std::uint8_t dlc)
+{
+    if (!isSlotIndexValid(index))
+    {
+        return -ErrInvalidSlot;
+    }
+
+    if (dlc > 8)
+    {
+        return -can::ErrUnsupportedFrame;
+    }
+
+    os::CriticalSectionLocker cs_lock;
+
+    auto& s = slots_[index];
+    if (!s.isUsed())
+    {
+        return -ErrSlotNotUsed;
+    }
+
+    s.config.frame.dlc = dlc;
+    std::memcpy(s.config.frame.data, data, dlc);
+    return 0;
+}
+
+int remove(const unsigned index)
+{
+    if (!isSlotIndexValid(index))
+    {
+        return -ErrInvalidSlot;
+    }
+
+    os::CriticalSectionLocker cs_lock;
+    slots_[index] = SlotState();
+    rescheduleI();
+    return 0;
+}
+
+void removeAll()
+{
+    os::CriticalSectionLocker cs_lock;
+    std::fill(std::begin(slots_), std::end(slots_), SlotState());
+    rescheduleI();
+}
+
+Slot getSlot(const unsigned index)
+{
+    if (!isSlotIndexValid(index))
+    {
+        return Slot();
+    }
+
+    os::CriticalSectionLocker cs_lock;
+    return slots_[index].config;
+}
+
+std::uint32_t getNumSkippedFrames()
+{
+    os::CriticalSectionLocker cs_lock;
+    return num_skipped_frames_;
+}
+
+}
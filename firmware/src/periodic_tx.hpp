@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2015  Zubax Robotics  <info@zubax.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+#pragma once
+
+#include <cstdint>
+#include "can_bus.hpp"
+
+/**
+ * On-device scheduler of cyclic frames, e.g. heartbeats and setpoints, which removes the host and the USB scheduling
+ * jitter from the loop. The frames are submitted into the CAN TX queue directly from the timer interrupt.
+ *
+ * Every frame is transmitted at the moments (N * period + phase) of the 64-bit time base of
+ * can::extendTimestampUSec(), so that the frames of the same period keep their relative phase. The frames that
+ * could not be submitted because the TX queue was full, or because the channel was closed, are skipped.
+ * The table is not persistent.
+ */
+namespace periodic_tx
+{
+/**
+ * Error codes.
+ * These values can be returned from the functions negated.
+ */
+static const std::int16_t ErrInvalidSlot    = 2001;     ///< Slot index is out of range
+static const std::int16_t ErrInvalidPeriod  = 2002;     ///< Period or phase is out of range
+static const std::int16_t ErrSlotNotUsed    = 2003;     ///< Payload can't be updated because the slot is empty
+
+static constexpr unsigned NumSlots = 32;
+
+static constexpr std::uint32_t MinPeriodUSec = 1000;
+static constexpr std::uint32_t MaxPeriodUSec = 60 * 1000 * 1000;
+
+struct Slot
+{
+    can::Frame frame;
+    std::uint32_t period_usec = 0;          ///< Zero if the slot is not used
+    std::uint32_t phase_usec = 0;           ///< Less than the period
+};
+
+/**
+ * Must be invoked once before other functions.
+ */
+void init();
+
+/**
+ * Configures the slot; the first transmission happens at the nearest moment defined by the period and the phase.
+ * @return negative on error
+ */
+int set(unsigned index, const can::Frame& frame, std::uint32_t period_usec, std::uint32_t phase_usec);
+
+/**
+ * Replaces the payload of the frame in place; the schedule is not affected.
+ * @return negative on error
+ */
+int updatePayload(unsigned index, const std::uint8_t* data, std::uint8_t dlc);
+
+/**
+ * Stops the transmission of the frame and frees the slot.
+ * @return negative on error
+ */
+int remove(unsigned index);
+
+void removeAll();
+
+/**
+ * Returns the configuration of the slot; the period is zero if the slot is not used or the index is invalid.
+ */
+Slot getSlot(unsigned index);
+
+/**
+ * Number of frames that could not be submitted, since start.
+ */
+std::uint32_t getNumSkippedFrames();
+
+}
@@ -0,0 +1,347 @@
+/*
+ * Copyright (C) 2015  Zubax Robotics  <info@zubax.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+#include "profiler.hpp"
+#include <zubax_chibios/os.hpp>
+#include <hal.h>
+#include <cassert>
+
+/*
+ * Defined by the linker script; the ISR stack is the main stack, the main thread uses the process stack.
+ */
+extern const std::uint8_t __main_stack_base__[];
+extern const std::uint8_t __main_stack_end__[];
+extern const std::uint8_t __main_thread_stack_base__[];
+extern const std::uint8_t __main_thread_stack_end__[];
+
+namespace profiler
+{
+namespace
+{
+
+constexpr std::uint8_t StackFillPattern = 0x55;
+
+constexpr unsigned MaxIRQNesting = 4;
+
+struct TrackedIRQ
+{
+    unsigned vector;                    ///< Exception number, as reported by SCB->ICSR
+    const char* name;
+};
+
+constexpr unsigned ExternalIRQOffset = 16;
+
+const TrackedIRQ TrackedIRQs[Report::NumIRQs - 1] =
+{
+    { ExternalIRQOffset + STM32_CAN1_TX_NUMBER,  "can_tx"  },
+    { ExternalIRQOffset + STM32_CAN1_RX0_NUMBER, "can_rx0" },
+    { ExternalIRQOffset + STM32_CAN1_RX1_NUMBER, "can_rx1" },
+    { ExternalIRQOffset + STM32_CAN1_SCE_NUMBER, "can_sce" },
+    { ExternalIRQOffset + STM32_USB1_HP_NUMBER,  "usb_hp"  },
+    { ExternalIRQOffset + STM32_USB1_LP_NUMBER,  "usb_lp"  }
+};
+
+struct IRQCounter
+{
+    std::uint64_t cycles = 0;
+    std::uint32_t max_cycles = 0;
+    std::uint32_t count = 0;
+};
+
+struct ThreadCounter
+{
+    const char* name = "";
+    const ::thread_t* thread = nullptr;
+    const std::uint8_t* stack_begin = nullptr;
+    const std::uint8_t* stack_end = nullptr;
+    std::uint64_t cycles = 0;
+};
+
+/*
+ * IRQ state, modified by the IRQ hooks with the kernel locked
+ */
+struct IRQFrame
+{
+    std::uint32_t started_at;
+    std::uint32_t nested_cycles;
+    std::uint8_t irq_index;
+};
+
+IRQFrame irq_stack_[MaxIRQNesting];
+unsigned irq_depth_ = 0;
+std::uint32_t irq_total_cycles_ = 0;            ///< Free-running, the difference is taken
+
+IRQCounter irq_counters_[Report::NumIRQs];
+
+/*
+ * Thread state, modified by the context switch hook and the reporting function with the kernel locked
+ */
+ThreadCounter thread_counters_[MaxThreads + 1];
+unsigned num_threads_ = 0;
+
+std::uint32_t last_switch_at_ = 0;
+std::uint32_t irq_total_cycles_at_last_switch_ = 0;
+
+::systime_t window_started_at_ = 0;
+
+
+inline std::uint32_t getCycles()
+{
+    return DWT->CYCCNT;
+}
+
+inline std::uint8_t findIRQIndex(const unsigned vector)
+{
+    for (unsigned i = 0; i < (Report::NumIRQs - 1); i++)
+    {
+        if (TrackedIRQs[i].vector == vector)
+        {
+            return std::uint8_t(i);
+        }
+    }
+    return Report::NumIRQs - 1;
+}
+
+inline ThreadCounter& findThreadCounter(const ::thread_t* const tp)
+{
+    for (unsigned i = 0; i < num_threads_; i++)
+    {
+        if (thread_counters_[i].thread == tp)
+        {
+            return thread_counters_[i];
+        }
+    }
+    return thread_counters_[MaxThreads];
+}
+
+/**
+ * Charges the time since the last context switch, except the interrupts, to the specified thread.
+ * Must be invoked with the kernel locked.
+ */
+void chargeThread(const ::thread_t* const tp)
+{
+    const std::uint32_t now = getCycles();
+    const std::uint32_t irq_cycles = irq_total_cycles_ - irq_total_cycles_at_last_switch_;
+    const std::uint32_t thread_cycles = (now - last_switch_at_) - irq_cycles;
+
+    last_switch_at_ = now;
+    irq_total_cycles_at_last_switch_ = irq_total_cycles_;
+
+    if (tp->p_prio != IDLEPRIO)         // The idle time is computed separately, see the header
+    {
+        findThreadCounter(tp).cycles += thread_cycles;
+    }
+}
+
+unsigned computeStackUsage(const std::uint8_t* const begin, const std::uint8_t* const end)
+{
+    // The stack grows downwards, so the unused part is at the beginning
+    const std::uint8_t* p = begin;
+    while ((p < end) && (*p == StackFillPattern))
+    {
+        p++;
+    }
+    return unsigned(end - p);
+}
+
+}
+
+std::uint64_t Report::getIdleCycles() const
+{
+    std::uint64_t busy = 0;
+    for (auto& x : irqs)
+    {
+        busy += x.cycles;
+    }
+    for (unsigned i = 0; i < num_threads; i++)
+    {
+        busy += threads[i].cycles;
+    }
+    return (window_cycles > busy) ? (window_cycles - busy) : 0;
+}
+
+void init()
+{
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+    os::CriticalSectionLocker cs_lock;
+
+    thread_counters_[MaxThreads].name = "other";
+
+    // The main thread is tracked as usual, its stack is defined by the linker script
+    auto& main_thread = thread_counters_[num_threads_++];
+    main_thread.name = "main";
+    main_thread.thread = chThdGetSelfX();
+    main_thread.stack_begin = &__main_thread_stack_base__[0];
+    main_thread.stack_end = &__main_thread_stack_end__[0];
+
+    last_switch_at_ = getCycles();
+    window_started_at_ = chVTGetSystemTimeX();
+}
+
+void registerThread(const char* const name, const ::thread_t* const thread, const unsigned working_area_size)
+{
+    os::CriticalSectionLocker cs_lock;
+
+    if (num_threads_ >= MaxThreads)
+    {
+        assert(false);
+        return;
+    }
+
+    // The working area begins with the thread structure, the rest is the stack
+    auto& tc = thread_counters_[num_threads_++];
+    tc.name = name;
+    tc.thread = thread;
+    tc.stack_begin = reinterpret_cast<const std::uint8_t*>(thread) + sizeof(::thread_t);
+    tc.stack_end = reinterpret_cast<const std::uint8_t*>(thread) + working_area_size;
+}
+
+Report getReport()
+{
+    Report r;
+    r.cycles_per_usec = STM32_HCLK / 1000000U;
+
+    std::uint32_t window_msec = 0;
+    {
+        os::CriticalSectionLocker cs_lock;
+
+        chargeThread(chThdGetSelfX());
+        window_msec = ST2MS(chVTTimeElapsedSinceX(window_started_at_));
+
+        for (unsigned i = 0; i < Report::NumIRQs; i++)
+        {
+            r.irqs[i].name = (i < (Report::NumIRQs - 1)) ? TrackedIRQs[i].name : "other";
+            r.irqs[i].cycles = irq_counters_[i].cycles;
+            r.irqs[i].max_cycles = irq_counters_[i].max_cycles;
+            r.irqs[i].count = irq_counters_[i].count;
+        }
+
+        for (unsigned i = 0; i < num_threads_; i++)
+        {
+            r.threads[i].name = thread_counters_[i].name;
+            r.threads[i].cycles = thread_counters_[i].cycles;
+        }
+        r.threads[num_threads_].name = thread_counters_[MaxThreads].name;
+        r.threads[num_threads_].cycles = thread_counters_[MaxThreads].cycles;
+        r.num_threads = num_threads_ + 1;
+    }
+
+    r.window_cycles = std::uint64_t(window_msec) * (STM32_HCLK / 1000U);
+
+    // The stacks are scanned outside of the critical section, the result is approximate anyway
+    for (unsigned i = 0; i < (r.num_threads - 1); i++)
+    {
+        const auto& tc = thread_counters_[i];
+        r.threads[i].stack_size = unsigned(tc.stack_end - tc.stack_begin);
+        r.threads[i].stack_used = computeStackUsage(tc.stack_begin, tc.stack_end);
+    }
+
+    r.isr_stack_size = unsigned(&__main_stack_end__[0] - &__main_stack_base__[0]);
+    r.isr_stack_used = computeStackUsage(&__main_stack_base__[0], &__main_stack_end__[0]);
+
+    return r;
+}
+
+void reset()
+{
+    os::CriticalSectionLocker cs_lock;
+
+    chargeThread(chThdGetSelfX());
+
+    for (auto& x : irq_counters_)
+    {
+        x = IRQCounter();
+    }
+    for (auto& x : thread_counters_)
+    {
+        x.cycles = 0;
+    }
+
+    window_started_at_ = chVTGetSystemTimeX();
+}
+
+}
+
+/*
+ * Kernel hooks, see chconf.h
+ */
+extern "C"
+{
+
+void profilerIRQPrologueHook(void)
+{
+    const std::uint32_t now = DWT->CYCCNT;
+    const unsigned vector = SCB->ICSR & SCB_ICSR_VECTACTIVE_Msk;
+
+    // The hook is invoked before the kernel is aware of the interrupt, so the port level locking is used
+    port_lock_from_isr();
+    using namespace profiler;
+    if LIKELY(irq_depth_ < MaxIRQNesting)
+    {
+        auto& frame = irq_stack_[irq_depth_];
+        frame.started_at = now;
+        frame.nested_cycles = 0;
+        frame.irq_index = findIRQIndex(vector);
+    }
+    irq_depth_++;
+    port_unlock_from_isr();
+}
+
+void profilerIRQEpilogueHook(void)
+{
+    port_lock_from_isr();
+    using namespace profiler;
+    assert(irq_depth_ > 0);
+    irq_depth_--;
+    if LIKELY(irq_depth_ < MaxIRQNesting)
+    {
+        const auto& frame = irq_stack_[irq_depth_];
+        const std::uint32_t total = DWT->CYCCNT - frame.started_at;
+        const std::uint32_t own = total - frame.nested_cycles;
+
+        auto& counter = irq_counters_[frame.irq_index];
+        counter.cycles += own;
+        counter.count++;
+        if (own > counter.max_cycles)
+        {
+            counter.max_cycles = own;
+        }
+
+        if (irq_depth_ > 0)
+        {
+            irq_stack_[irq_depth_ - 1].nested_cycles += total;
+        }
+        else
+        {
+            irq_total_cycles_ += total;
+        }
+    }
+    port_unlock_from_isr();
+}
+
+void profilerContextSwitchHook(const void* const ntp, const void* const otp)
+{
+    (void)ntp;
+    profiler::chargeThread(static_cast<const ::thread_t*>(otp));
+}
+
+}
@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2015  Zubax Robotics  <info@zubax.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <ch.hpp>
+
+/**
+ * Built-in CPU load profiler based on the DWT cycle counter.
+ *
+ * Every interrupt handler that uses CH_IRQ_PROLOGUE()/CH_IRQ_EPILOGUE() is measured via the kernel's IRQ hooks,
+ * see chconf.h; the handlers are identified by the active vector number. The time of the nested interrupts is
+ * excluded from the time of the preempted handler.
+ * Threads are measured via the context switch hook, excluding the time spent in the interrupts; the threads that
+ * were not registered are accounted together.
+ * The idle time is computed as the remainder of the measurement window, because the cycle counter may not run
+ * while the core is sleeping.
+ *
+ * Stack usage is determined by looking for the fill pattern, which is written by the startup code and, for the
+ * threads, by the kernel (CH_DBG_FILL_THREADS).
+ */
+namespace profiler
+{
+
+static constexpr unsigned MaxThreads = 4;
+
+struct IRQStatistics
+{
+    const char* name = "";
+    std::uint64_t cycles = 0;
+    std::uint32_t max_cycles = 0;
+    std::uint32_t count = 0;
+};
+
+struct ThreadStatistics
+{
+    const char* name = "";
+    std::uint64_t cycles = 0;
+    unsigned stack_size = 0;            ///< Zero if the stack usage is not known
+    unsigned stack_used = 0;            ///< High-water mark
+};
+
+struct Report
+{
+    static constexpr unsigned NumIRQs = 7;
+
+    std::uint64_t window_cycles = 0;    ///< Since the last reset
+    std::uint32_t cycles_per_usec = 0;
+
+    IRQStatistics irqs[NumIRQs];        ///< The last one is for all other handlers
+
+    ThreadStatistics threads[MaxThreads + 1];   ///< The last one is for all other threads, except idle
+    unsigned num_threads = 0;                   ///< Including the last one
+
+    unsigned isr_stack_size = 0;
+    unsigned isr_stack_used = 0;
+
+    /// The cycles that were not spent in the interrupts or threads other than idle
+    std::uint64_t getIdleCycles() const;
+};
+
+/**
+ * Must be invoked once from the main thread, before the other threads are started.
+ * The main thread is registered automatically.
+ */
+void init();
+
+/**
+ * Registers a thread for measurement; the name must be a static string.
+ * Threads that are not registered are still measured, but they can't be told apart.
+ */
+void registerThread(const char* name, const ::thread_t* thread, unsigned working_area_size);
+
+template <int StackSize>
+inline void registerThread(const char* name, const chibios_rt::BaseStaticThread<StackSize>& thread)
+{
+    registerThread(name, thread.thread_ref, THD_WORKING_AREA_SIZE(StackSize));
+}
+
+Report getReport();
+
+/**
+ * Restarts the measurement window; the stack high-water marks are not affected.
+ */
+void reset();
+
+}
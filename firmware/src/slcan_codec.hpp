@@ -0,0 +1,244 @@
+/*
+ * Copyright (C) 2015  Zubax Robotics  <info@zubax.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <cassert>
+#include "can_frame.hpp"
+#include "hex_codec.hpp"
+
+/**
+ * ASCII SLCAN frame encoding and parsing. This header does not depend on the OS.
+ */
+namespace slcan
+{
+
+static constexpr unsigned MaxEncodedFrameSize = 44;     ///< Extended frame with 8 bytes and extended timestamp
+
+/**
+ * General frame format:
+ *  <type> <id> <dlc> <data> [timestamp] [flags]
+ * Types:
+ *  R - RTR extended
+ *  r - RTR standard
+ *  T - Data extended
+ *  t - Data standard
+ * Timestamp:
+ *  Default         - 4 hex digits, milliseconds in the range [0, 60000)
+ *  Extended (Z2)   - 16 hex digits, microseconds in the 64-bit time base that does not roll over
+ * Flags:
+ *  L - this frame is a loopback frame; timestamp field contains TX timestamp
+ * @param options             Any type with the boolean fields timestamping_on, timestamping_ext, flags_on
+ * @param extend_timestamp    Converts RxFrame::timestamp_usec into the 64-bit time base, see
+ *                            can::extendTimestampUSec(); invoked only if the extended timestamps are enabled
+ * @return Number of bytes written into the output buffer, which must be at least MaxEncodedFrameSize bytes large;
+ *         zero if the frame should not be reported.
+ */
+template <typename Options, typename TimestampExtender>
+inline unsigned encodeFrame(const Options& options, const can::RxFrame& f, std::uint8_t* const out,
+                            TimestampExtender extend_timestamp)
+{
+    std::uint8_t* p = out;
+
+    if UNLIKELY(f.failed)
+    {
+        return 0;
+    }
+
+    const can::Frame frame = f.getFrame();
+
+    /*
+     * Frame type
+     */
+    if UNLIKELY(frame.isRemoteTransmissionRequest())
+    {
+        *p++ = frame.isExtended() ? 'R' : 'r';
+    }
+    else if UNLIKELY(frame.isErrorFrame())
+    {
+        return 0;   // Not supported
+    }
+    else
+    {
+        *p++ = frame.isExtended() ? 'T' : 't';
+    }
+
+    /*
+     * ID
+     */
+    {
+        const std::uint32_t id = frame.id & frame.MaskExtID;
+        p = LIKELY(frame.isExtended()) ? hex_codec::encodeU32(id, p) : hex_codec::encodeU12(id, p);
+    }
+
+    /*
+     * DLC
+     */
+    *p++ = char('0' + frame.dlc);
+
+    /*
+     * Data
+     */
+    p = hex_codec::encodeBytes(&frame.data[0], frame.dlc, p);
+
+    /*
+     * Timestamp
+     */
+    if LIKELY(options.timestamping_on)
+    {
+        if LIKELY(!options.timestamping_ext)
+        {
+            // SLCAN format - [0, 60000) milliseconds
+            p = hex_codec::encodeU16(f.timestamp_usec / 1000U, p);
+        }
+        else
+        {
+            const std::uint64_t ext_timestamp = extend_timestamp(f.timestamp_usec);
+            p = hex_codec::encodeU32(std::uint32_t(ext_timestamp >> 32), p);
+            p = hex_codec::encodeU32(std::uint32_t(ext_timestamp), p);
+        }
+    }
+
+    /*
+     * Flags
+     */
+    if LIKELY(options.flags_on)
+    {
+        if (f.loopback)
+        {
+            *p++ = 'L';
+        }
+    }
+
+    /*
+     * Finalization
+     */
+    *p++ = '\r';
+    const auto frame_size = unsigned(p - out);
+    assert(frame_size <= MaxEncodedFrameSize);
+    return frame_size;
+}
+
+/**
+ * General frame format:
+ *  <type> <id> <dlc> <data>
+ * The parsing functions below are highly optimized for speed, see hex_codec.hpp.
+ */
+inline bool parseFrameDataExt(const char* cmd, can::Frame& f)
+{
+    if UNLIKELY(!hex_codec::decodeU32(&cmd[1], f.id) || (f.id > f.MaskExtID))
+    {
+        return false;
+    }
+    f.id |= f.FlagEFF;
+    if UNLIKELY(cmd[9] < '0' || cmd[9] > ('0' + can::Frame::MaxDataLen))
+    {
+        return false;
+    }
+    f.dlc = cmd[9] - '0';
+    assert(f.dlc <= can::Frame::MaxDataLen);
+    return hex_codec::decodeBytes(&cmd[10], &f.data[0], f.dlc);
+}
+
+inline bool parseFrameDataStd(const char* cmd, can::Frame& f)
+{
+    if UNLIKELY(!hex_codec::decodeU12(&cmd[1], f.id) || (f.id > f.MaskStdID))
+    {
+        return false;
+    }
+    if UNLIKELY(cmd[4] < '0' || cmd[4] > ('0' + can::Frame::MaxDataLen))
+    {
+        return false;
+    }
+    f.dlc = cmd[4] - '0';
+    assert(f.dlc <= can::Frame::MaxDataLen);
+    return hex_codec::decodeBytes(&cmd[5], &f.data[0], f.dlc);
+}
+
+inline bool parseFrameRTRExt(const char* cmd, can::Frame& f)
+{
+    if UNLIKELY(!hex_codec::decodeU32(&cmd[1], f.id) || (f.id > f.MaskExtID))
+    {
+        return false;
+    }
+    f.id |= f.FlagEFF | f.FlagRTR;
+    if UNLIKELY(cmd[9] < '0' || cmd[9] > ('0' + can::Frame::MaxDataLen))
+    {
+        return false;
+    }
+    f.dlc = cmd[9] - '0';
+    assert(f.dlc <= can::Frame::MaxDataLen);
+    return true;
+}
+
+inline bool parseFrameRTRStd(const char* cmd, can::Frame& f)
+{
+    if UNLIKELY(!hex_codec::decodeU12(&cmd[1], f.id) || (f.id > f.MaskStdID))
+    {
+        return false;
+    }
+    f.id |= f.FlagRTR;
+    if UNLIKELY(cmd[4] < '0' || cmd[4] > ('0' + can::Frame::MaxDataLen))
+    {
+        return false;
+    }
+    f.dlc = cmd[4] - '0';
+    assert(f.dlc <= can::Frame::MaxDataLen);
+    return true;
+}
+
+/**
+ * Parses a null terminated frame in any of the SLCAN formats above. Unlike the functions above, it rejects
+ * trailing characters, because it is used with the arguments of complex commands.
+ */
+inline bool parseFrame(const char* const str, can::Frame& f)
+{
+    const bool ext = (str[0] == 'T') || (str[0] == 'R');
+    const bool rtr = (str[0] == 'R') || (str[0] == 'r');
+    if (!ext && (str[0] != 't') && (str[0] != 'r'))
+    {
+        return false;
+    }
+
+    // Validating the length before parsing, so that nothing is read past the end of the string
+    const unsigned len = std::strlen(str);
+    const unsigned dlc_pos = ext ? 9 : 4;
+    if ((len <= dlc_pos) || (str[dlc_pos] < '0') || (str[dlc_pos] > ('0' + can::Frame::MaxDataLen)))
+    {
+        return false;
+    }
+    const unsigned expected_len = dlc_pos + 1U + (rtr ? 0U : unsigned(str[dlc_pos] - '0') * 2U);
+    if (len != expected_len)
+    {
+        return false;
+    }
+
+    if (ext)
+    {
+        return rtr ? parseFrameRTRExt(str, f) : parseFrameDataExt(str, f);
+    }
+    else
+    {
+        return rtr ? parseFrameRTRStd(str, f) : parseFrameDataStd(str, f);
+    }
+}
+
+}
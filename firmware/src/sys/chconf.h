@@ -20,8 +20,33 @@
 #pragma once
 
 #define CH_CFG_USE_SEMAPHORES           TRUE
+
+// All threads are event driven, so the core can sleep between the interrupts
+#define CORTEX_ENABLE_WFI_IDLE          TRUE
 //#define CH_CFG_USE_REGISTRY             TRUE
 
+/*
+ * CPU load profiler, see profiler.hpp.
+ * The stacks of the threads are filled with a pattern in order to find the high-water marks.
+ */
+#define CH_DBG_FILL_THREADS                     TRUE
+
+#if !defined(_FROM_ASM_)
+#ifdef __cplusplus
+extern "C" {
+#endif
+void profilerIRQPrologueHook(void);
+void profilerIRQEpilogueHook(void);
+void profilerContextSwitchHook(const void* ntp, const void* otp);
+#ifdef __cplusplus
+}
+#endif
+#endif
+
+#define CH_CFG_IRQ_PROLOGUE_HOOK()              profilerIRQPrologueHook()
+#define CH_CFG_IRQ_EPILOGUE_HOOK()              profilerIRQEpilogueHook()
+#define CH_CFG_CONTEXT_SWITCH_HOOK(ntp, otp)    profilerContextSwitchHook(ntp, otp)
+
 //#define PORT_INT_REQUIRED_STACK         256
 
 #include <zubax_chibios/sys/chconf_tail.h>
@@ -35,7 +35,7 @@
 #define HAL_USE_PWM                 FALSE
 #define HAL_USE_RTC                 FALSE
 #define HAL_USE_SDC                 FALSE
-#define HAL_USE_SERIAL              TRUE
+#define HAL_USE_SERIAL              TRUE        // Only for STDOUT_SD, the CLI UART uses uart_dma.hpp
 #define HAL_USE_SERIAL_USB          TRUE
 #define HAL_USE_SPI                 FALSE
 #define HAL_USE_UART                FALSE
@@ -43,7 +43,7 @@
 #define HAL_USE_WDG                 FALSE
 
 #define SERIAL_DEFAULT_BITRATE      115200
-#define SERIAL_BUFFERS_SIZE         1792
+#define SERIAL_BUFFERS_SIZE         16
 
 #define SERIAL_USB_BUFFERS_NUMBER   15
 #define SERIAL_USB_BUFFERS_SIZE     128
@@ -121,7 +121,7 @@
 #define STM32_GPT_USE_TIM3                  FALSE
 #define STM32_GPT_USE_TIM4                  FALSE
 #define STM32_GPT_USE_TIM5                  TRUE        // CAN timestamping
-#define STM32_GPT_USE_TIM6                  FALSE
+#define STM32_GPT_USE_TIM6                  TRUE        // Periodic transmission scheduler
 #define STM32_GPT_USE_TIM7                  FALSE
 #define STM32_GPT_USE_TIM12                 FALSE
 #define STM32_GPT_USE_TIM14                 FALSE
@@ -173,9 +173,10 @@
 
 /*
  * SERIAL driver system settings.
+ * USART1 is served by the application, see uart_dma.hpp. USART2 is only needed for STDOUT_SD, see the Makefile.
  */
-#define STM32_SERIAL_USE_USART1             TRUE
-#define STM32_SERIAL_USE_USART2             FALSE
+#define STM32_SERIAL_USE_USART1             FALSE
+#define STM32_SERIAL_USE_USART2             TRUE
 #define STM32_SERIAL_USE_USART3             FALSE
 #define STM32_SERIAL_USE_UART4              FALSE
 #define STM32_SERIAL_USE_UART5              FALSE
@@ -0,0 +1,372 @@
+/*
+ * Copyright (C) 2015  Zubax Robotics  <info@zubax.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+#include "uart_dma.hpp"
+#include <zubax_chibios/os.hpp>
+#include <algorithm>
+#include <cassert>
+
+namespace uart_dma
+{
+namespace
+{
+
+constexpr unsigned IRQPriority = 4;             ///< Same as was used by the serial driver, below CAN
+constexpr unsigned DMAPriority = 2;
+
+constexpr std::uint32_t DMACommonMode = STM32_DMA_CR_PL(DMAPriority) |
+                                        STM32_DMA_CR_PSIZE_BYTE | STM32_DMA_CR_MSIZE_BYTE | STM32_DMA_CR_MINC |
+                                        STM32_DMA_CR_TCIE | STM32_DMA_CR_TEIE;
+
+constexpr std::uint32_t RxDMAMode = DMACommonMode | STM32_DMA_CR_DIR_P2M | STM32_DMA_CR_CIRC | STM32_DMA_CR_HTIE;
+constexpr std::uint32_t TxDMAMode = DMACommonMode | STM32_DMA_CR_DIR_M2P;
+
+/*
+ * Fixed mapping on STM32F37x
+ */
+const stm32_dma_stream_t* const TxDMAStream = STM32_DMA1_STREAM4;
+const stm32_dma_stream_t* const RxDMAStream = STM32_DMA1_STREAM5;
+
+struct Driver
+{
+    ::BaseAsynchronousChannel channel;          ///< Must be the first member, the VMT methods rely on that
+    ::input_queue_t iqueue;
+    ::output_queue_t oqueue;
+    unsigned rx_last_pos = 0;                   ///< Position of the RX DMA at the last update
+    unsigned tx_size = 0;                       ///< Size of the ongoing TX transfer; zero if TX is idle
+    TxCompletionCallback tx_completion_callback = nullptr;
+    unsigned tx_completion_remaining = 0;       ///< Bytes to send before the completion is awaited
+    bool tx_held = false;                       ///< Waiting for the completion, see captureTxCompletion()
+    Statistics statistics;
+    bool started = false;
+};
+
+Driver driver_;
+
+std::uint8_t rx_buffer_[RxBufferSize];
+std::uint8_t tx_buffer_[TxBufferSize];
+
+/**
+ * Starts the TX DMA if it is idle and there is data to send.
+ * Must be invoked with the kernel locked.
+ */
+void startTransmissionI()
+{
+    auto& q = driver_.oqueue;
+    if ((driver_.tx_size > 0) || driver_.tx_held || oqIsEmptyI(&q))
+    {
+        return;
+    }
+
+    // The queued data may wrap around the end of the buffer, the remainder will be sent by the next transfer
+    driver_.tx_size = std::min<unsigned>(oqGetFullI(&q), unsigned(q.q_top - q.q_rdptr));
+
+    // The transfer must end where the completion is awaited
+    if (driver_.tx_completion_callback != nullptr)
+    {
+        driver_.tx_size = std::min(driver_.tx_size, driver_.tx_completion_remaining);
+    }
+
+    dmaStreamSetMemory0(TxDMAStream, q.q_rdptr);
+    dmaStreamSetTransactionSize(TxDMAStream, driver_.tx_size);
+    dmaStreamSetMode(TxDMAStream, TxDMAMode);
+    dmaStreamEnable(TxDMAStream);
+}
+
+/**
+ * The USART sets the TC flag when the last byte written to the data register has been sent; the flag is cleared
+ * by the next write, which is why the transmission is held meanwhile.
+ * Must be invoked with the kernel locked.
+ */
+void awaitTxCompletionI()
+{
+    driver_.tx_held = true;
+    USART1->CR1 |= USART_CR1_TCIE;
+}
+
+/**
+ * Makes the data written by the RX DMA since the last update available to the readers.
+ * Must be invoked with the kernel locked.
+ */
+void updateRxI()
+{
+    auto& q = driver_.iqueue;
+
+    const unsigned pos = (RxBufferSize - unsigned(dmaStreamGetTransactionSize(RxDMAStream))) % RxBufferSize;
+    const unsigned received = (pos + RxBufferSize - driver_.rx_last_pos) % RxBufferSize;
+    driver_.rx_last_pos = pos;
+    if (received == 0)
+    {
+        return;
+    }
+
+    q.q_wrptr = q.q_buffer + pos;
+    q.q_counter += received;
+
+    // The DMA has overwritten the data that was not read yet, the contents of the queue are not usable anymore
+    if UNLIKELY(q.q_counter > RxBufferSize)
+    {
+        q.q_rdptr = q.q_wrptr;
+        q.q_counter = 0;
+        driver_.statistics.rx_overruns++;
+        return;
+    }
+
+    osalThreadDequeueAllI(&q.q_waiting, Q_OK);
+    chnAddFlagsI(&driver_.channel, CHN_INPUT_AVAILABLE);
+}
+
+void onOutputNotify(::io_queue_t*)
+{
+    startTransmissionI();
+}
+
+void serveTxDMA(void*, std::uint32_t)
+{
+    // A transfer error terminates the transfer as well; the data can't be recovered, so it is treated as sent
+    chSysLockFromISR();
+
+    dmaStreamDisable(TxDMAStream);
+
+    auto& q = driver_.oqueue;
+    q.q_rdptr += driver_.tx_size;
+    if (q.q_rdptr >= q.q_top)
+    {
+        q.q_rdptr = q.q_buffer;
+    }
+    q.q_counter += driver_.tx_size;
+
+    if (driver_.tx_completion_callback != nullptr)
+    {
+        driver_.tx_completion_remaining -= driver_.tx_size;
+        if (driver_.tx_completion_remaining == 0)
+        {
+            awaitTxCompletionI();
+        }
+    }
+
+    driver_.tx_size = 0;
+
+    osalThreadDequeueAllI(&q.q_waiting, Q_OK);
+    if (oqIsEmptyI(&q))
+    {
+        chnAddFlagsI(&driver_.channel, CHN_OUTPUT_EMPTY);
+    }
+
+    startTransmissionI();
+
+    chSysUnlockFromISR();
+}
+
+void serveRxDMA(void*, std::uint32_t flags)
+{
+    chSysLockFromISR();
+    if (flags & STM32_DMA_ISR_TEIF)
+    {
+        driver_.statistics.rx_errors++;
+    }
+    updateRxI();
+    chSysUnlockFromISR();
+}
+
+/*
+ * Channel interface
+ */
+std::size_t write(void*, const std::uint8_t* bp, std::size_t n)
+{
+    return oqWriteTimeout(&driver_.oqueue, bp, n, TIME_INFINITE);
+}
+
+std::size_t read(void*, std::uint8_t* bp, std::size_t n)
+{
+    return iqReadTimeout(&driver_.iqueue, bp, n, TIME_INFINITE);
+}
+
+::msg_t put(void*, std::uint8_t b)
+{
+    return oqPutTimeout(&driver_.oqueue, b, TIME_INFINITE);
+}
+
+::msg_t get(void*)
+{
+    return iqGetTimeout(&driver_.iqueue, TIME_INFINITE);
+}
+
+::msg_t putt(void*, std::uint8_t b, ::systime_t timeout)
+{
+    return oqPutTimeout(&driver_.oqueue, b, timeout);
+}
+
+::msg_t gett(void*, ::systime_t timeout)
+{
+    return iqGetTimeout(&driver_.iqueue, timeout);
+}
+
+std::size_t writet(void*, const std::uint8_t* bp, std::size_t n, ::systime_t timeout)
+{
+    return oqWriteTimeout(&driver_.oqueue, bp, n, timeout);
+}
+
+std::size_t readt(void*, std::uint8_t* bp, std::size_t n, ::systime_t timeout)
+{
+    return iqReadTimeout(&driver_.iqueue, bp, n, timeout);
+}
+
+const struct ::BaseAsynchronousChannelVMT vmt =
+{
+    &write, &read, &put, &get,
+    &putt, &gett, &writet, &readt
+};
+
+void init()
+{
+    driver_.channel.vmt = &vmt;
+    osalEventObjectInit(&driver_.channel.event);
+    iqObjectInit(&driver_.iqueue, &rx_buffer_[0], RxBufferSize, nullptr, nullptr);
+    oqObjectInit(&driver_.oqueue, &tx_buffer_[0], TxBufferSize, &onOutputNotify, nullptr);
+
+    bool failed = dmaStreamAllocate(RxDMAStream, IRQPriority, &serveRxDMA, nullptr);
+    failed = dmaStreamAllocate(TxDMAStream, IRQPriority, &serveTxDMA, nullptr) || failed;
+    assert(!failed);
+    (void)failed;
+
+    dmaStreamSetPeripheral(RxDMAStream, &USART1->RDR);
+    dmaStreamSetPeripheral(TxDMAStream, &USART1->TDR);
+
+    RCC->APB2ENR  |=  RCC_APB2ENR_USART1EN;
+    RCC->APB2RSTR |=  RCC_APB2RSTR_USART1RST;
+    RCC->APB2RSTR &= ~RCC_APB2RSTR_USART1RST;
+
+    // The RX DMA is never stopped, the queue follows its position
+    dmaStreamSetMemory0(RxDMAStream, &rx_buffer_[0]);
+    dmaStreamSetTransactionSize(RxDMAStream, RxBufferSize);
+    dmaStreamSetMode(RxDMAStream, RxDMAMode);
+    dmaStreamEnable(RxDMAStream);
+
+    nvicEnableVector(STM32_USART1_NUMBER, IRQPriority);
+}
+
+}
+
+void start(const unsigned baudrate)
+{
+    assert(baudrate > 0);
+
+    os::CriticalSectionLocker cs_lock;
+
+    if (!driver_.started)
+    {
+        init();
+        driver_.started = true;
+    }
+
+    // Oversampling by 16, which allows up to 4.5 Mbaud at 72 MHz
+    USART1->CR1 = 0;
+    USART1->BRR = (STM32_USART1CLK + baudrate / 2U) / baudrate;
+    USART1->CR2 = USART_CR2_STOP1_BITS;
+    USART1->CR3 = USART_CR3_DMAR | USART_CR3_DMAT | USART_CR3_EIE;
+    USART1->ICR = 0xFFFFFFFFU;
+    USART1->CR1 = USART_CR1_UE | USART_CR1_TE | USART_CR1_RE | USART_CR1_IDLEIE |
+                  (driver_.tx_held ? USART_CR1_TCIE : 0);
+}
+
+void captureTxCompletion(const TxCompletionCallback callback)
+{
+    assert(callback != nullptr);
+
+    os::CriticalSectionLocker cs_lock;
+
+    driver_.tx_completion_callback = callback;
+
+    if (!driver_.tx_held)
+    {
+        // The data of the ongoing transfer is still in the queue, so it is accounted for
+        driver_.tx_completion_remaining = oqGetFullI(&driver_.oqueue);
+        if (driver_.tx_completion_remaining == 0)
+        {
+            awaitTxCompletionI();
+        }
+    }
+}
+
+bool isTxIdle()
+{
+    os::CriticalSectionLocker cs_lock;
+    return (driver_.tx_size == 0) && !driver_.tx_held && oqIsEmptyI(&driver_.oqueue);
+}
+
+::BaseChannel* getChannel()
+{
+    return reinterpret_cast<::BaseChannel*>(&driver_.channel);
+}
+
+::output_queue_t* getOutputQueue()
+{
+    return &driver_.oqueue;
+}
+
+Statistics getStatistics()
+{
+    os::CriticalSectionLocker cs_lock;
+    return driver_.statistics;
+}
+
+}
+
+extern "C"
+{
+
+using namespace uart_dma;
+
+CH_IRQ_HANDLER(STM32_USART1_HANDLER)
+{
+    CH_IRQ_PROLOGUE();
+
+    const std::uint32_t isr = USART1->ISR;
+    USART1->ICR = isr & (USART_ICR_IDLECF | USART_ICR_ORECF | USART_ICR_NCF | USART_ICR_FECF | USART_ICR_PECF);
+
+    chSysLockFromISR();
+    if (isr & (USART_ISR_ORE | USART_ISR_NE | USART_ISR_FE | USART_ISR_PE))
+    {
+        driver_.statistics.rx_errors++;
+    }
+    if (isr & USART_ISR_IDLE)
+    {
+        updateRxI();
+    }
+    if ((isr & USART_ISR_TC) && driver_.tx_held)
+    {
+        USART1->CR1 &= ~USART_CR1_TCIE;
+        driver_.tx_held = false;
+
+        const auto callback = driver_.tx_completion_callback;
+        driver_.tx_completion_callback = nullptr;
+        if (callback != nullptr)
+        {
+            callback();
+        }
+
+        startTransmissionI();
+    }
+    chSysUnlockFromISR();
+
+    CH_IRQ_EPILOGUE();
+}
+
+}
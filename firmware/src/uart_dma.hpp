@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2015  Zubax Robotics  <info@zubax.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <hal.h>
+
+/**
+ * DMA-driven driver of the CLI UART (USART1), which replaces the interrupt-per-byte serial driver of ChibiOS
+ * in order to sustain the baud rates of several megabits per second.
+ *
+ * RX: the DMA writes into the circular buffer continuously; the buffer is also the storage of the input queue,
+ * so no copying is involved. The queue is updated from the DMA half/full transfer interrupts and from the
+ * idle line interrupt, so that short messages are delivered without waiting for the buffer to fill up.
+ * If the application does not read the data fast enough, the unread data is discarded and the overrun is counted.
+ *
+ * TX: the output queue is drained by the DMA, one contiguous region of the ring buffer per transfer.
+ *
+ * The channel implements the regular BaseAsynchronousChannel interface, so it can be used with the stream API
+ * and os::setStdIOStream() as usual.
+ */
+namespace uart_dma
+{
+
+static constexpr unsigned RxBufferSize = 1536;
+static constexpr unsigned TxBufferSize = 2048;
+
+/**
+ * Starts the driver or changes its baud rate; the buffered data is retained.
+ * Must be invoked from a thread.
+ */
+void start(unsigned baudrate);
+
+::BaseChannel* getChannel();
+
+/**
+ * Can be used to find out how much data can be written without blocking.
+ */
+::output_queue_t* getOutputQueue();
+
+/**
+ * Invoked from the interrupt context with the kernel locked, see @ref captureTxCompletion().
+ */
+typedef void (*TxCompletionCallback)();
+
+/**
+ * Arms a one-shot notification of the moment when all the data written so far has left the transmitter, i.e. when
+ * the stop bit of the last byte has been sent. The data written afterwards is held until then, so that the moment
+ * is not obscured by the following bytes; this costs a gap of about one character.
+ * A notification that has not been delivered yet is replaced. Must be invoked from a thread.
+ */
+void captureTxCompletion(TxCompletionCallback callback);
+
+/**
+ * Returns true if there is no output data pending and no completion is awaited; the data written next will be
+ * passed to the transmitter immediately.
+ */
+bool isTxIdle();
+
+struct Statistics
+{
+    std::uint32_t rx_overruns = 0;      ///< Events when the unread data was overwritten
+    std::uint32_t rx_errors = 0;        ///< Framing, noise, and hardware overrun errors
+};
+
+Statistics getStatistics();
+
+}
@@ -6,6 +6,7 @@
 #include <hal.h>
 #include <cstdint>
 #include <cstring>
+#include <cassert>
 #include "usb_cdc.hpp"
 
 namespace usb_cdc
@@ -287,7 +288,12 @@ static void usb_event(USBDriver* usbp, usbevent_t event)
     switch (event)
     {
     case USB_EVENT_RESET:
+    case USB_EVENT_SUSPEND:
     {
+        // Letting the application know that the interface may need to be switched
+        chSysLockFromISR();
+        chnAddFlagsI(&SDU1, CHN_DISCONNECTED);
+        chSysUnlockFromISR();
         return;
     }
     case USB_EVENT_ADDRESS:
@@ -312,10 +318,6 @@ static void usb_event(USBDriver* usbp, usbevent_t event)
         chSysUnlockFromISR();
         return;
     }
-    case USB_EVENT_SUSPEND:
-    {
-        return;
-    }
     case USB_EVENT_WAKEUP:
     {
         return;
@@ -327,9 +329,17 @@ static void usb_event(USBDriver* usbp, usbevent_t event)
     }
 }
 
+static SOFCallback sof_callback = nullptr;
+
 static void sof_handler(USBDriver*)
 {
     chSysLockFromISR();
+    if (sof_callback != nullptr)
+    {
+        const auto callback = sof_callback;
+        sof_callback = nullptr;
+        callback();
+    }
     sduSOFHookI(&SDU1);
     chSysUnlockFromISR();
 }
@@ -396,6 +406,38 @@ void init(const DeviceSerialNumber& device_serial)
     usbConnectBus(&USBD1);
 }
 
+void captureNextSOF(const SOFCallback callback)
+{
+    chSysLock();
+    sof_callback = callback;
+    chSysUnlock();
+}
+
+bool isOutputIdle()
+{
+    chSysLock();
+    // The buffer being filled is counted as empty, the buffer being transmitted is not
+    const bool idle = (SDU1.obqueue.ptr == nullptr) && obqIsEmptyI(&SDU1.obqueue);
+    chSysUnlock();
+    return idle;
+}
+
+std::size_t getOutputSpace()
+{
+    const output_buffers_queue_t* const obqp = &SDU1.obqueue;
+    const std::size_t payload_size = obqp->bsize - sizeof(std::size_t);
+
+    chSysLock();
+    std::size_t space = obqp->bcounter * payload_size;
+    if (obqp->ptr != nullptr)
+    {
+        // The buffer being filled is still counted as empty
+        space -= payload_size - std::size_t(obqp->top - obqp->ptr);
+    }
+    chSysUnlock();
+    return space;
+}
+
 SerialUSBDriver* getSerialUSBDriver()
 {
     return &SDU1;
@@ -406,4 +448,80 @@ State getState()
     return (USBD1.state == USB_ACTIVE) ? State::Connected : State::Disconnected;
 }
 
+/*
+ * The zero-copy output follows the same logic as obqWriteTimeout(), except that the data is not copied.
+ */
+static std::uint8_t* acquired_output_ptr = nullptr;
+
+std::uint8_t* acquireOutputBuffer(const std::size_t min_size, std::size_t& out_size, const systime_t timeout)
+{
+    output_buffers_queue_t* const obqp = &SDU1.obqueue;
+    assert(acquired_output_ptr == nullptr);
+    assert(min_size <= (obqp->bsize - sizeof(std::size_t)));
+
+    chSysLock();
+
+    // Not enough space left in the current buffer - posting it as is
+    if ((obqp->ptr != nullptr) && (std::size_t(obqp->top - obqp->ptr) < min_size))
+    {
+        obqPostFullBufferS(obqp, std::size_t(obqp->ptr - obqp->bwrptr) - sizeof(std::size_t));
+        obqp->ptr = nullptr;
+    }
+
+    if ((obqp->ptr == nullptr) && (obqGetEmptyBufferTimeoutS(obqp, timeout) != MSG_OK))
+    {
+        chSysUnlock();
+        return nullptr;
+    }
+
+    acquired_output_ptr = obqp->ptr;
+    out_size = std::size_t(obqp->top - obqp->ptr);
+
+    chSysUnlock();
+    return acquired_output_ptr;
+}
+
+bool commitOutputBuffer(const std::size_t size)
+{
+    output_buffers_queue_t* const obqp = &SDU1.obqueue;
+    assert(acquired_output_ptr != nullptr);
+
+    chSysLock();
+
+    if (obqp->ptr != acquired_output_ptr)
+    {
+        /*
+         * A partially filled buffer has been flushed from the SOF interrupt while the new data was being written
+         * past its end. The new data is still intact, because the flushed buffer will not be reused until all other
+         * buffers are, so it is copied into a free buffer. The data never exceeds one buffer, so it either fits
+         * completely or is discarded completely.
+         */
+        if ((obqp->ptr != nullptr) && (std::size_t(obqp->top - obqp->ptr) < size))
+        {
+            obqPostFullBufferS(obqp, std::size_t(obqp->ptr - obqp->bwrptr) - sizeof(std::size_t));
+            obqp->ptr = nullptr;
+        }
+
+        if ((obqp->ptr == nullptr) && (obqGetEmptyBufferTimeoutS(obqp, TIME_IMMEDIATE) != MSG_OK))
+        {
+            chSysUnlock();
+            acquired_output_ptr = nullptr;
+            return false;
+        }
+
+        std::memcpy(obqp->ptr, acquired_output_ptr, size);
+    }
+
+    obqp->ptr += size;
+    if (obqp->ptr >= obqp->top)
+    {
+        obqPostFullBufferS(obqp, obqp->bsize - sizeof(std::size_t));
+        obqp->ptr = nullptr;
+    }
+
+    chSysUnlock();
+    acquired_output_ptr = nullptr;
+    return true;
+}
+
 }
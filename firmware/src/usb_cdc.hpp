@@ -7,6 +7,7 @@
 #include <hal.h>
 #include <array>
 #include <cstdint>
+#include <cstddef>
 
 namespace usb_cdc
 {
@@ -25,4 +26,48 @@ enum class State
 
 State getState();
 
+/**
+ * Invoked from the SOF interrupt with the kernel locked, see @ref captureNextSOF().
+ */
+typedef void (*SOFCallback)();
+
+/**
+ * Arms a one-shot notification from the next start of frame interrupt, which is when the partially filled output
+ * buffer is passed to the host, see @ref acquireOutputBuffer(). Data that fills a whole buffer is passed earlier.
+ * A notification that has not been delivered yet is replaced.
+ */
+void captureNextSOF(SOFCallback callback);
+
+/**
+ * Returns true if there is no output data pending, neither in the buffers nor in an ongoing transfer;
+ * the data written next will be passed to the host at the next start of frame.
+ */
+bool isOutputIdle();
+
+/**
+ * Returns the number of bytes that can be written to the serial-over-USB driver without blocking.
+ */
+std::size_t getOutputSpace();
+
+/**
+ * Zero-copy output: provides direct access to the output buffers of the serial-over-USB driver, so that the data
+ * can be encoded in place instead of being copied into the driver's queue. Partially filled buffers are flushed
+ * to the host from the SOF interrupt, i.e. every millisecond.
+ * The caller must have exclusive access to the output stream (e.g. by holding the stdio mutex) until the buffer is
+ * committed, and must not use the regular stream API in between.
+ * @param min_size      Minimum number of contiguous bytes; must not exceed SERIAL_USB_BUFFERS_SIZE minus 4.
+ * @param out_size      Number of contiguous bytes available at the returned pointer.
+ * @param timeout       Time to wait for a free buffer.
+ * @return              Pointer to the buffer, or nullptr on timeout.
+ */
+std::uint8_t* acquireOutputBuffer(std::size_t min_size, std::size_t& out_size, systime_t timeout);
+
+/**
+ * Passes the data written into the buffer returned by @ref acquireOutputBuffer() to the driver.
+ * The data is committed either completely or not at all, so that the output is never truncated.
+ * @param size          Number of bytes written, not greater than the available size.
+ * @return              False if the data had to be discarded because there was no free buffer.
+ */
+bool commitOutputBuffer(std::size_t size);
+
 }
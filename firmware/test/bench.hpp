@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2015  Zubax Robotics  <info@zubax.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+# include <x86intrin.h>
+#endif
+
+/**
+ * Minimal microbenchmark framework for the host build, see the Makefile.
+ * A benchmark is a function defined with BENCHMARK() that invokes run() for every measured operation.
+ * The host numbers are only meaningful relative to each other, e.g. when comparing two implementations of the same
+ * function; on the target everything is several times slower.
+ * Ticks are read from the x86 time stamp counter; they approximate the core cycles if the frequency scaling is off.
+ */
+namespace bench
+{
+
+struct Case
+{
+    const char* name;
+    void (*function)();
+};
+
+inline std::vector<Case>& getRegistry()
+{
+    static std::vector<Case> registry;
+    return registry;
+}
+
+struct Registrator
+{
+    Registrator(const char* const name, void (*function)())
+    {
+        getRegistry().push_back(Case{name, function});
+    }
+};
+
+inline std::uint64_t readTicks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/**
+ * Prevents the compiler from optimizing away the computation that produced the value.
+ */
+template <typename T>
+inline void keep(const T& value)
+{
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+/**
+ * Invokes the function, which performs the specified number of operations, and prints the time per operation.
+ * The best of several runs is reported in order to reduce the noise.
+ */
+template <typename Function>
+inline void run(const char* const name, const unsigned num_ops, Function function)
+{
+    static constexpr unsigned NumRuns = 5;
+
+    double best_ns = 1e30;
+    double best_ticks = 1e30;
+    for (unsigned i = 0; i < NumRuns; i++)
+    {
+        const auto started_at = std::chrono::steady_clock::now();
+        const std::uint64_t started_at_ticks = readTicks();
+        function();
+        const std::uint64_t ticks = readTicks() - started_at_ticks;
+        const auto elapsed = std::chrono::steady_clock::now() - started_at;
+
+        const double ns = std::chrono::duration<double, std::nano>(elapsed).count() / num_ops;
+        best_ns = (ns < best_ns) ? ns : best_ns;
+        best_ticks = (double(ticks) / num_ops < best_ticks) ? (double(ticks) / num_ops) : best_ticks;
+    }
+
+    std::printf("%-56s %9.2f ns/op %9.1f ticks/op\n", name, best_ns, best_ticks);
+}
+
+}
+
+#define BENCHMARK(name)                                                                 \
+    static void bench_##name();                                                         \
+    static const ::bench::Registrator bench_registrator_##name(#name, &bench_##name);  \
+    static void bench_##name()
@@ -0,0 +1,239 @@
+/*
+ * Copyright (C) 2015  Zubax Robotics  <info@zubax.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+#include "bench.hpp"
+#include <can_queues.hpp>
+#include <slcan_codec.hpp>
+#include <binary_protocol.hpp>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+constexpr unsigned NumFrames = 1000000;
+
+struct Options
+{
+    bool timestamping_on;
+    bool timestamping_ext;
+    bool flags_on;
+
+    Options(bool on = true, bool ext = false, bool flags = true) :
+        timestamping_on(on),
+        timestamping_ext(ext),
+        flags_on(flags)
+    { }
+};
+
+std::uint64_t extendTimestamp(std::uint32_t timestamp_usec)
+{
+    return timestamp_usec;
+}
+
+/**
+ * Data frames with uniformly distributed format and DLC, as seen on a busy bus.
+ */
+std::vector<can::RxFrame> makeFrames(const unsigned num_frames)
+{
+    std::mt19937 rng(0);
+    std::vector<can::RxFrame> frames(num_frames);
+    for (auto& f : frames)
+    {
+        const bool ext = rng() & 1;
+        f.id = ext ? ((rng() & can::Frame::MaskExtID) | can::Frame::FlagEFF) : (rng() & can::Frame::MaskStdID);
+        f.dlc = rng() % (can::Frame::MaxDataLen + 1);
+        for (auto& b : f.data)
+        {
+            b = std::uint8_t(rng());
+        }
+        f.timestamp_usec = rng() % can::TimestampRolloverIntervalUSec;
+    }
+    return frames;
+}
+
+/**
+ * Encoded frames without the terminating carriage returns, one per string.
+ */
+std::vector<std::string> encodeFrames(const std::vector<can::RxFrame>& frames)
+{
+    const Options options(false, false, false);
+    std::vector<std::string> out;
+    out.reserve(frames.size());
+    for (auto& f : frames)
+    {
+        std::uint8_t buf[slcan::MaxEncodedFrameSize];
+        const unsigned len = slcan::encodeFrame(options, f, &buf[0], &extendTimestamp);
+        out.emplace_back(reinterpret_cast<const char*>(&buf[0]), len - 1);
+    }
+    return out;
+}
+
+/**
+ * Priority orders that stress the TX queue in different ways; the frames are pushed in the order of the vector.
+ */
+std::vector<can::Frame> makeTxFrames(const char* const order, const unsigned num_frames)
+{
+    std::mt19937 rng(0);
+    std::vector<can::Frame> frames(num_frames);
+    for (unsigned i = 0; i < num_frames; i++)
+    {
+        auto& f = frames[i];
+        const std::string o = order;
+        if (o == "ascending")               // Every new frame has the lowest priority
+        {
+            f.id = i & can::Frame::MaskStdID;
+        }
+        else if (o == "descending")         // Every new frame has the highest priority
+        {
+            f.id = (num_frames - i) & can::Frame::MaskStdID;
+        }
+        else if (o == "equal")              // Ordered by the sequence number only
+        {
+            f.id = 0x123;
+        }
+        else                                // STD, EXT, and RTR frames colliding on the same 11 bits
+        {
+            const std::uint32_t arb11 = rng() % 4;
+            switch (rng() % 4)
+            {
+            case 0:  f.id = arb11; break;
+            case 1:  f.id = arb11 | can::Frame::FlagRTR; break;
+            case 2:  f.id = can::Frame::FlagEFF | (arb11 << 18) | (rng() % 3); break;
+            default: f.id = can::Frame::FlagEFF | can::Frame::FlagRTR | (arb11 << 18); break;
+            }
+        }
+        f.dlc = 8;
+    }
+    return frames;
+}
+
+}
+
+BENCHMARK(SLCAN)
+{
+    const auto frames = makeFrames(NumFrames);
+    const auto encoded = encodeFrames(frames);
+
+    static std::uint8_t out[slcan::MaxEncodedFrameSize * 16];
+
+    bench::run("encodeFrame, timestamp and flags", NumFrames, [&]()
+    {
+        const Options options;
+        unsigned total = 0;
+        for (unsigned i = 0; i < NumFrames; i++)
+        {
+            total += slcan::encodeFrame(options, frames[i], &out[(i % 16) * slcan::MaxEncodedFrameSize],
+                                        &extendTimestamp);
+        }
+        bench::keep(total);
+    });
+
+    bench::run("encodeFrame, extended timestamp", NumFrames, [&]()
+    {
+        const Options options(true, true, false);
+        unsigned total = 0;
+        for (unsigned i = 0; i < NumFrames; i++)
+        {
+            total += slcan::encodeFrame(options, frames[i], &out[(i % 16) * slcan::MaxEncodedFrameSize],
+                                        &extendTimestamp);
+        }
+        bench::keep(total);
+    });
+
+    bench::run("parseFrame", NumFrames, [&]()
+    {
+        unsigned total = 0;
+        for (unsigned i = 0; i < NumFrames; i++)
+        {
+            can::Frame f;
+            total += slcan::parseFrame(encoded[i].c_str(), f) ? f.dlc : 0U;
+        }
+        bench::keep(total);
+    });
+
+    bench::run("parseFrameData{Std,Ext}", NumFrames, [&]()
+    {
+        unsigned total = 0;
+        for (unsigned i = 0; i < NumFrames; i++)
+        {
+            can::Frame f;
+            const char* const s = encoded[i].c_str();
+            total += ((s[0] == 'T') ? slcan::parseFrameDataExt(s, f) : slcan::parseFrameDataStd(s, f)) ? f.dlc : 0U;
+        }
+        bench::keep(total);
+    });
+}
+
+BENCHMARK(BinaryProtocol)
+{
+    static constexpr unsigned BatchSize = 16;
+    const auto frames = makeFrames(NumFrames);
+
+    static std::uint8_t out[binary_protocol::predictMaxEncodedPacketSize(binary_protocol::MaxFrameRecordSize *
+                                                                         BatchSize)];
+
+    bench::run("PacketEncoder, 16 frames per packet", NumFrames, [&]()
+    {
+        unsigned total = 0;
+        for (unsigned i = 0; i < NumFrames; i += BatchSize)
+        {
+            binary_protocol::PacketEncoder encoder(&out[0], binary_protocol::PacketType::CANFrames);
+            for (unsigned k = 0; k < BatchSize; k++)
+            {
+                encoder.addFrameRecord(frames[i + k]);
+            }
+            total += encoder.finalize();
+        }
+        bench::keep(total);
+    });
+}
+
+BENCHMARK(TxQueue)
+{
+    static constexpr unsigned Capacity = 100;
+    static constexpr unsigned NumRounds = NumFrames / Capacity;
+
+    for (const char* order : { "ascending", "descending", "equal", "adversarial" })
+    {
+        const auto frames = makeTxFrames(order, Capacity);
+        const std::string name = std::string("push+pop, full queue, ") + order;
+
+        // The queue is filled completely and drained in every round, so the heap depth is at its maximum
+        bench::run(name.c_str(), NumRounds * Capacity, [&]()
+        {
+            static can::TxQueue<Capacity> q;
+            std::uint32_t total = 0;
+            for (unsigned round = 0; round < NumRounds; round++)
+            {
+                for (auto& f : frames)
+                {
+                    (void)q.push(f, round);
+                }
+                while (q.peek() != nullptr)
+                {
+                    total += q.peek()->id;
+                    q.pop();
+                }
+            }
+            bench::keep(total);
+        });
+    }
+}
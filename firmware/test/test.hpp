@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2015  Zubax Robotics  <info@zubax.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+/**
+ * Minimal test framework for the host build, see the Makefile.
+ * A test case is a function defined with TEST_CASE(); it fails on the first violated ENFORCE().
+ */
+namespace test
+{
+
+struct Case
+{
+    const char* name;
+    void (*function)();
+};
+
+inline std::vector<Case>& getRegistry()
+{
+    static std::vector<Case> registry;
+    return registry;
+}
+
+struct Registrator
+{
+    Registrator(const char* const name, void (*function)())
+    {
+        getRegistry().push_back(Case{name, function});
+    }
+};
+
+[[noreturn]] inline void fail(const char* const file, const int line, const char* const expression)
+{
+    std::fprintf(stderr, "%s:%d: ENFORCE(%s) failed\n", file, line, expression);
+    std::abort();
+}
+
+}
+
+#define ENFORCE(x)              ((x) ? (void)0 : ::test::fail(__FILE__, __LINE__, #x))
+
+#define TEST_CASE(name)                                                                 \
+    static void test_##name();                                                          \
+    static const ::test::Registrator test_registrator_##name(#name, &test_##name);     \
+    static void test_##name()
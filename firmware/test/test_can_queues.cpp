@@ -0,0 +1,269 @@
+/*
+ * Copyright (C) 2015  Zubax Robotics  <info@zubax.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+#include "test.hpp"
+#include <can_queues.hpp>
+#include <algorithm>
+#include <random>
+#include <string>
+
+namespace
+{
+
+using can::Frame;
+using can::RxFrame;
+
+Frame makeFrame(std::uint32_t id)
+{
+    static unsigned count = 0;
+    const auto s = std::to_string(count++ % 100000000U);       // Unique payload identifies the frame
+    return Frame(id, s.c_str(), std::uint8_t(std::min<std::size_t>(s.length(), Frame::MaxDataLen)));
+}
+
+bool sameFrame(const Frame& a, const Frame& b)
+{
+    return (a.id == b.id) && (a.dlc == b.dlc) && (std::memcmp(a.data, b.data, a.dlc) == 0);
+}
+
+/**
+ * Random identifiers that collide often: few distinct 11-bit prefixes, so that the STD vs EXT and the RTR rules
+ * are exercised, not only the plain ID comparison.
+ */
+std::uint32_t makeAdversarialID(std::mt19937& rng)
+{
+    const std::uint32_t arb11 = rng() % 4;
+    switch (rng() % 5)
+    {
+    case 0:  return arb11;
+    case 1:  return arb11 | Frame::FlagRTR;
+    case 2:  return Frame::FlagEFF | (arb11 << 18) | (rng() % 3);
+    case 3:  return Frame::FlagEFF | Frame::FlagRTR | (arb11 << 18) | (rng() % 3);
+    default: return Frame::FlagEFF | (rng() & Frame::MaskExtID);
+    }
+}
+
+}
+
+TEST_CASE(FramePriority)
+{
+    const Frame std_data(0x123, "", 0);
+    const Frame std_rtr(0x123 | Frame::FlagRTR, "", 0);
+    const Frame ext_data(Frame::FlagEFF | (0x123U << 18), "", 0);
+    const Frame ext_rtr(Frame::FlagEFF | Frame::FlagRTR | (0x123U << 18), "", 0);
+    const Frame ext_low(Frame::FlagEFF | (0x122U << 18) | 0x3FFFF, "", 0);
+
+    // Same 11 bits: STD wins over EXT, even if it is RTR
+    ENFORCE(std_data.priorityHigherThan(ext_data));
+    ENFORCE(std_rtr.priorityHigherThan(ext_data));
+    ENFORCE(!ext_data.priorityHigherThan(std_rtr));
+
+    // Same ID: data wins over RTR
+    ENFORCE(std_data.priorityHigherThan(std_rtr));
+    ENFORCE(ext_data.priorityHigherThan(ext_rtr));
+    ENFORCE(!std_rtr.priorityHigherThan(std_data));
+
+    // Lower 11 bits win regardless of the format
+    ENFORCE(ext_low.priorityHigherThan(std_data));
+    ENFORCE(std_data.priorityLowerThan(ext_low));
+
+    // Equal frames are neither
+    ENFORCE(!std_data.priorityHigherThan(std_data));
+    ENFORCE(!std_data.priorityLowerThan(std_data));
+}
+
+TEST_CASE(TxQueueBasic)
+{
+    can::TxQueue<30> q;
+    ENFORCE(q.getPeakUsage() == 0);
+    ENFORCE(q.getCapacity() == 30);
+    ENFORCE(q.getLength() == 0);
+    ENFORCE(q.peek() == nullptr);
+
+    const std::uint32_t ids[] = { 5, 3, 4, 4, 2, 4 };
+    std::vector<Frame> pushed;
+    for (unsigned i = 0; i < 6; i++)
+    {
+        pushed.push_back(makeFrame(ids[i]));
+        ENFORCE(q.push(pushed.back(), 1000 + i));
+    }
+    ENFORCE(q.getLength() == 6);
+    ENFORCE(q.getPeakUsage() == 6);
+
+    // Equal priorities are transmitted in the order of insertion
+    const unsigned expected_order[] = { 4, 1, 2, 3, 5, 0 };
+    for (unsigned index : expected_order)
+    {
+        ENFORCE(q.peek() != nullptr);
+        ENFORCE(sameFrame(*q.peek(), pushed[index]));
+        ENFORCE(q.getTopSubmissionTimestamp() == 1000 + index);
+        q.pop();
+    }
+    ENFORCE(q.peek() == nullptr);
+    ENFORCE(q.getLength() == 0);
+    ENFORCE(q.getPeakUsage() == 6);
+}
+
+TEST_CASE(TxQueueOverflow)
+{
+    can::TxQueue<7> q;
+    for (unsigned i = 0; i < 7; i++)
+    {
+        ENFORCE(q.push(makeFrame(100 - i), 0));
+    }
+    ENFORCE(!q.push(makeFrame(0), 0));
+    ENFORCE(q.getLength() == 7);
+
+    // Freed blocks are reused
+    q.pop();
+    ENFORCE(q.push(makeFrame(0), 0));
+    ENFORCE(q.peek()->id == 0);
+    ENFORCE(q.getPeakUsage() == 7);
+}
+
+TEST_CASE(TxQueueAdversarialOrder)
+{
+    static constexpr unsigned Capacity = 100;
+    std::mt19937 rng(42);
+
+    for (unsigned iteration = 0; iteration < 200; iteration++)
+    {
+        can::TxQueue<Capacity> q;
+        std::vector<Frame> reference;
+
+        for (unsigned i = 0; i < Capacity; i++)
+        {
+            reference.push_back(makeFrame(makeAdversarialID(rng)));
+            ENFORCE(q.push(reference.back(), i));
+        }
+
+        std::stable_sort(reference.begin(), reference.end(),
+                         [](const Frame& a, const Frame& b) { return a.priorityHigherThan(b); });
+
+        for (auto& f : reference)
+        {
+            ENFORCE(q.peek() != nullptr);
+            ENFORCE(sameFrame(*q.peek(), f));
+            q.pop();
+        }
+        ENFORCE(q.peek() == nullptr);
+    }
+}
+
+TEST_CASE(TxQueueInterleaved)
+{
+    static constexpr unsigned Capacity = 50;
+    std::mt19937 rng(123);
+
+    can::TxQueue<Capacity> q;
+    std::vector<std::pair<Frame, unsigned>> reference;         // Frame and the insertion sequence number
+    unsigned sequence = 0;
+
+    for (unsigned i = 0; i < 100000; i++)
+    {
+        if ((rng() % 3) != 0)
+        {
+            const Frame f = makeFrame(makeAdversarialID(rng));
+            const bool accepted = q.push(f, sequence);
+            ENFORCE(accepted == (reference.size() < Capacity));
+            if (accepted)
+            {
+                reference.emplace_back(f, sequence++);
+            }
+        }
+        else if (!reference.empty())
+        {
+            const auto top = std::min_element(reference.begin(), reference.end(),
+                [](const std::pair<Frame, unsigned>& a, const std::pair<Frame, unsigned>& b)
+                {
+                    if (a.first.priorityHigherThan(b.first)) { return true; }
+                    if (b.first.priorityHigherThan(a.first)) { return false; }
+                    return a.second < b.second;
+                });
+            ENFORCE(sameFrame(*q.peek(), top->first));
+            ENFORCE(q.getTopSubmissionTimestamp() == top->second);
+            reference.erase(top);
+            q.pop();
+        }
+        else
+        {
+            ENFORCE(q.peek() == nullptr);
+        }
+        ENFORCE(q.getLength() == reference.size());
+    }
+}
+
+TEST_CASE(RxQueueWrapAndOverflow)
+{
+    can::RxQueue<8> q;
+    ENFORCE(q.getCapacity() == 8);
+    ENFORCE(q.getLength() == 0);
+
+    const RxFrame* frames = nullptr;
+    ENFORCE(q.peek(frames) == 0);
+
+    std::uint32_t next_in = 0;
+    std::uint32_t next_out = 0;
+    auto push = [&]()
+    {
+        RxFrame f;
+        f.timestamp_usec = next_in;
+        f.setFrame(makeFrame(next_in));
+        const bool ok = q.push(f);
+        next_in += ok ? 1 : 0;
+        return ok;
+    };
+
+    // Filling up completely, then overflowing
+    for (unsigned i = 0; i < 8; i++)
+    {
+        ENFORCE(push());
+    }
+    ENFORCE(!push());
+    ENFORCE(!push());
+    ENFORCE(q.getLength() == 8);
+    ENFORCE(q.getPeakUsage() == 8);
+
+    // Many passes over the buffer with varying fill levels; peek() never returns frames past the end of the buffer
+    std::mt19937 rng(7);
+    for (unsigned i = 0; i < 100000; i++)
+    {
+        const unsigned len = q.getLength();
+        ENFORCE(len == (next_in - next_out));
+
+        const unsigned available = q.peek(frames);
+        ENFORCE(available <= len);
+        ENFORCE((len == 0) || (available > 0));
+        ENFORCE(available <= (8 - (next_out % 8)));
+        for (unsigned k = 0; k < available; k++)
+        {
+            ENFORCE(frames[k].timestamp_usec == (next_out + k));
+        }
+
+        const unsigned num_commit = available ? unsigned(rng() % (available + 1)) : 0;
+        q.commit(num_commit);
+        next_out += num_commit;
+
+        const unsigned num_push = rng() % 6;
+        for (unsigned k = 0; k < num_push; k++)
+        {
+            const bool expected = (next_in - next_out) < 8;
+            ENFORCE(push() == expected);
+        }
+    }
+}
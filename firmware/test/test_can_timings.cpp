@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2015  Zubax Robotics  <info@zubax.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+#include "test.hpp"
+#include <can_timings.hpp>
+
+namespace
+{
+
+constexpr std::uint32_t PCLK = 36000000;        ///< PCLK1 of the target
+
+const std::uint32_t SLCANBitRates[] =           ///< S0...S8
+{
+    10000, 20000, 50000, 100000, 125000, 250000, 500000, 800000, 1000000
+};
+
+std::uint32_t absDiff(std::uint32_t a, std::uint32_t b) { return (a > b) ? (a - b) : (b - a); }
+
+struct Quality
+{
+    std::uint32_t error_ppm = 0xFFFFFFFFU;
+    unsigned sample_point_error_permill = 0xFFFFFFFFU;
+};
+
+Quality evaluate(std::uint32_t bitrate, unsigned sample_point_permill, unsigned prescaler, unsigned bs1, unsigned bs2)
+{
+    const unsigned quanta = 1 + bs1 + bs2;
+    Quality q;
+    q.error_ppm = std::uint32_t((std::uint64_t(absDiff(PCLK / (prescaler * quanta), bitrate)) * 1000000U) / bitrate);
+    q.sample_point_error_permill = absDiff((1000 * (1 + bs1)) / quanta, sample_point_permill);
+    return q;
+}
+
+/**
+ * Exhaustive search over every register combination allowed by the hardware and by the solver's constraints.
+ */
+Quality findBestQuality(std::uint32_t bitrate, unsigned sample_point_permill)
+{
+    Quality best;
+    for (unsigned prescaler = 1; prescaler <= 1024; prescaler++)
+    {
+        for (unsigned bs1 = 1; bs1 <= 16; bs1++)
+        {
+            for (unsigned bs2 = 1; bs2 <= 8; bs2++)
+            {
+                if ((1 + bs1 + bs2) < 8)
+                {
+                    continue;
+                }
+                const auto q = evaluate(bitrate, sample_point_permill, prescaler, bs1, bs2);
+                if ((q.error_ppm < best.error_ppm) ||
+                    ((q.error_ppm == best.error_ppm) &&
+                     (q.sample_point_error_permill < best.sample_point_error_permill)))
+                {
+                    best = q;
+                }
+            }
+        }
+    }
+    return best;
+}
+
+}
+
+TEST_CASE(TimingsSLCANBitRates)
+{
+    for (unsigned sp = 500; sp <= 900; sp += 25)
+    {
+        for (auto bitrate : SLCANBitRates)
+        {
+            can::Timings t;
+            ENFORCE(can::computeTimings(PCLK, bitrate, sp, t));
+
+            // Register ranges
+            ENFORCE(t.prescaler < 1024);
+            ENFORCE(t.bs1 < 16);
+            ENFORCE(t.bs2 < 8);
+            ENFORCE(t.sjw == 0);
+            ENFORCE(t.getQuantaPerBit() >= 8);
+
+            // All S0-S8 rates are exact at 36 MHz
+            ENFORCE((PCLK % t.getPCLKPerBit()) == 0);
+            ENFORCE((PCLK / t.getPCLKPerBit()) == bitrate);
+
+            // Same quality as the best one found by the exhaustive search
+            const auto best = findBestQuality(bitrate, sp);
+            const auto actual = evaluate(bitrate, sp, t.prescaler + 1U, t.bs1 + 1U, t.bs2 + 1U);
+            ENFORCE(actual.error_ppm == best.error_ppm);
+            ENFORCE(actual.sample_point_error_permill == best.sample_point_error_permill);
+            ENFORCE(t.getSamplePointPermill() == (1000U * (2U + t.bs1)) / t.getQuantaPerBit());
+        }
+    }
+}
+
+TEST_CASE(TimingsEightQuantaPerBit)
+{
+    // 36 MHz / 500 kbps = 72 = 9 * 8; only 8 quanta per bit provide the exact sample point of 875
+    can::Timings t;
+    ENFORCE(can::computeTimings(PCLK, 500000, 875, t));
+    ENFORCE(t.getQuantaPerBit() == 8);
+    ENFORCE(t.getSamplePointPermill() == 875);
+}
+
+TEST_CASE(TimingsUnsupported)
+{
+    can::Timings t;
+    ENFORCE(!can::computeTimings(PCLK, 0, 875, t));
+    ENFORCE(!can::computeTimings(PCLK, 5000000, 875, t));      // Fewer than 8 quanta per bit
+    ENFORCE(!can::computeTimings(PCLK, 1000, 875, t));         // Prescaler out of range
+}
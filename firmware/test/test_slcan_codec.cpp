@@ -0,0 +1,365 @@
+/*
+ * Copyright (C) 2015  Zubax Robotics  <info@zubax.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+#include "test.hpp"
+#include <slcan_codec.hpp>
+#include <binary_protocol.hpp>
+#include <algorithm>
+#include <cctype>
+#include <random>
+#include <string>
+
+namespace
+{
+
+struct Options
+{
+    bool timestamping_on  = false;
+    bool timestamping_ext = false;
+    bool flags_on         = false;
+};
+
+std::uint64_t extendTimestamp(std::uint32_t)
+{
+    return 0x0123456789ABCDEFULL;
+}
+
+std::string encode(const Options& options, const can::RxFrame& f)
+{
+    std::uint8_t buf[slcan::MaxEncodedFrameSize + 1] = {};
+    const unsigned len = slcan::encodeFrame(options, f, &buf[0], &extendTimestamp);
+    ENFORCE(len <= slcan::MaxEncodedFrameSize);
+    return std::string(reinterpret_cast<const char*>(&buf[0]), len);
+}
+
+can::RxFrame makeRxFrame(std::uint32_t id, const char* data, std::uint8_t dlc, std::uint32_t timestamp_usec = 0)
+{
+    can::RxFrame f;
+    f.setFrame(can::Frame(id, data, dlc));
+    f.timestamp_usec = timestamp_usec;
+    return f;
+}
+
+can::Frame makeRandomFrame(std::mt19937& rng)
+{
+    can::Frame f;
+    const bool ext = rng() & 1;
+    const bool rtr = (rng() % 4) == 0;
+    f.id = ext ? ((rng() & can::Frame::MaskExtID) | can::Frame::FlagEFF) : (rng() & can::Frame::MaskStdID);
+    f.id |= rtr ? can::Frame::FlagRTR : 0;
+    f.dlc = std::uint8_t(rng() % (can::Frame::MaxDataLen + 1));
+    for (unsigned i = 0; i < (rtr ? 0U : f.dlc); i++)       // The data of RTR frames is not transferred
+    {
+        f.data[i] = std::uint8_t(rng());
+    }
+    return f;
+}
+
+bool sameFrame(const can::Frame& a, const can::Frame& b)
+{
+    return (a.id == b.id) && (a.dlc == b.dlc) && (std::memcmp(a.data, b.data, a.dlc) == 0);
+}
+
+}
+
+TEST_CASE(HexU16Exhaustive)
+{
+    for (std::uint32_t value = 0; value <= 0xFFFF; value++)
+    {
+        char expected[5] = {};
+        std::snprintf(&expected[0], sizeof(expected), "%04X", unsigned(value));
+
+        std::uint8_t chars[4] = {};
+        ENFORCE(hex_codec::encodeU16(value, &chars[0]) == &chars[4]);
+        ENFORCE(std::memcmp(&chars[0], &expected[0], 4) == 0);
+
+        // Decoded as two bytes, lower case is accepted as well
+        for (auto& c : expected)
+        {
+            c = char(std::tolower(c));
+        }
+        std::uint8_t decoded[2] = {};
+        ENFORCE(hex_codec::decodeBytes(&expected[0], &decoded[0], 2));
+        ENFORCE(((unsigned(decoded[0]) << 8) | decoded[1]) == value);
+    }
+}
+
+TEST_CASE(HexDigitValidation)
+{
+    for (unsigned position = 0; position < 8; position++)
+    {
+        for (unsigned c = 0; c < 256; c++)
+        {
+            char chars[8] = { '7', 'a', 'F', '0', '9', 'B', 'c', '1' };
+            chars[position] = char(c);
+            const bool valid = std::isxdigit(int(c)) != 0;
+
+            std::uint32_t value = 0;
+            ENFORCE(hex_codec::decodeU32(&chars[0], value) == valid);
+            if (position < 3)
+            {
+                ENFORCE(hex_codec::decodeU12(&chars[0], value) == valid);
+            }
+            std::uint8_t bytes[4] = {};
+            ENFORCE(hex_codec::decodeBytes(&chars[0], &bytes[0], 4) == valid);
+        }
+    }
+}
+
+TEST_CASE(HexFields)
+{
+    std::mt19937 rng(1);
+    for (unsigned i = 0; i < 100000; i++)
+    {
+        const std::uint32_t value = rng();
+        char expected[9] = {};
+
+        std::uint8_t u32[8] = {};
+        ENFORCE(hex_codec::encodeU32(value, &u32[0]) == &u32[8]);
+        std::snprintf(&expected[0], sizeof(expected), "%08X", unsigned(value));
+        ENFORCE(std::memcmp(&u32[0], &expected[0], 8) == 0);
+        std::uint32_t decoded = 0;
+        ENFORCE(hex_codec::decodeU32(reinterpret_cast<const char*>(&u32[0]), decoded) && (decoded == value));
+
+        std::uint8_t u12[3] = {};
+        ENFORCE(hex_codec::encodeU12(value, &u12[0]) == &u12[3]);
+        std::snprintf(&expected[0], sizeof(expected), "%03X", unsigned(value & 0xFFFU));
+        ENFORCE(std::memcmp(&u12[0], &expected[0], 3) == 0);
+        ENFORCE(hex_codec::decodeU12(reinterpret_cast<const char*>(&u12[0]), decoded) && (decoded == (value & 0xFFFU)));
+
+        // Any invalid digit is detected
+        u32[rng() % 8] = 'g';
+        ENFORCE(!hex_codec::decodeU32(reinterpret_cast<const char*>(&u32[0]), decoded));
+        u12[rng() % 3] = ':';
+        ENFORCE(!hex_codec::decodeU12(reinterpret_cast<const char*>(&u12[0]), decoded));
+    }
+}
+
+TEST_CASE(HexBytes)
+{
+    std::mt19937 rng(2);
+    for (unsigned i = 0; i < 100000; i++)
+    {
+        const unsigned len = rng() % 9;
+        std::uint8_t bytes[8] = {};
+        for (auto& b : bytes)
+        {
+            b = std::uint8_t(rng());
+        }
+
+        char chars[17] = {};
+        ENFORCE(hex_codec::encodeBytes(&bytes[0], len, reinterpret_cast<std::uint8_t*>(&chars[0])) ==
+                reinterpret_cast<std::uint8_t*>(&chars[len * 2]));
+        for (unsigned k = 0; k < len; k++)
+        {
+            char expected[3] = {};
+            std::snprintf(&expected[0], sizeof(expected), "%02X", unsigned(bytes[k]));
+            ENFORCE((chars[k * 2] == expected[0]) && (chars[k * 2 + 1] == expected[1]));
+        }
+
+        std::uint8_t decoded[8] = {};
+        ENFORCE(hex_codec::decodeBytes(&chars[0], &decoded[0], len));
+        ENFORCE(std::memcmp(&decoded[0], &bytes[0], len) == 0);
+
+        if (len > 0)
+        {
+            chars[rng() % (len * 2)] = 'x';
+            ENFORCE(!hex_codec::decodeBytes(&chars[0], &decoded[0], len));
+        }
+    }
+}
+
+TEST_CASE(SLCANEncodeFormats)
+{
+    Options o;
+    auto f = makeRxFrame(0x123, "\xAA\xBB", 2, 12345678);
+    ENFORCE(encode(o, f) == "t1232AABB\r");
+
+    o.timestamping_on = true;
+    ENFORCE(encode(o, f) == "t1232AABB3039\r");                // 12345 ms
+
+    o.flags_on = true;
+    ENFORCE(encode(o, f) == "t1232AABB3039\r");
+    f.loopback = true;
+    ENFORCE(encode(o, f) == "t1232AABB3039L\r");
+
+    o.timestamping_ext = true;
+    ENFORCE(encode(o, f) == "t1232AABB0123456789ABCDEFL\r");
+
+    o = Options();
+    ENFORCE(encode(o, makeRxFrame(can::Frame::FlagEFF | 0x1ABCDEF0, "\x01\x02\x03\x04\x05\x06\x07\x08", 8)) ==
+            "T1ABCDEF080102030405060708\r");
+    ENFORCE(encode(o, makeRxFrame(can::Frame::FlagEFF | can::Frame::FlagRTR | 0x7F, "", 0)) == "R0000007F0\r");
+    ENFORCE(encode(o, makeRxFrame(can::Frame::FlagRTR | 0x7FF, "", 0)) == "r7FF0\r");
+
+    // Not reported
+    auto failed = makeRxFrame(0x123, "", 0);
+    failed.failed = true;
+    ENFORCE(encode(o, failed).empty());
+    ENFORCE(encode(o, makeRxFrame(can::Frame::FlagERR | 0x123, "", 0)).empty());
+
+    // The worst case fits
+    o.timestamping_on = o.timestamping_ext = o.flags_on = true;
+    auto longest = makeRxFrame(can::Frame::FlagEFF | can::Frame::MaskExtID, "\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF", 8);
+    longest.loopback = true;
+    ENFORCE(encode(o, longest).size() == slcan::MaxEncodedFrameSize);
+}
+
+TEST_CASE(SLCANParseValidation)
+{
+    can::Frame f;
+    ENFORCE(slcan::parseFrame("t1232AABB", f));
+    ENFORCE((f.id == 0x123) && (f.dlc == 2) && (f.data[0] == 0xAA) && (f.data[1] == 0xBB));
+    ENFORCE(slcan::parseFrame("T1abcdef01ff", f));
+    ENFORCE((f.id == (0x1ABCDEF0 | can::Frame::FlagEFF)) && (f.dlc == 1) && (f.data[0] == 0xFF));
+    ENFORCE(slcan::parseFrame("r7FF8", f) && (f.id == (0x7FF | can::Frame::FlagRTR)) && (f.dlc == 8));
+
+    ENFORCE(!slcan::parseFrame("", f));
+    ENFORCE(!slcan::parseFrame("x1230", f));
+    ENFORCE(!slcan::parseFrame("t123", f));                     // No DLC
+    ENFORCE(!slcan::parseFrame("t1239", f));                    // DLC out of range
+    ENFORCE(!slcan::parseFrame("t1232AA", f));                  // Truncated data
+    ENFORCE(!slcan::parseFrame("t1232AABBC", f));               // Trailing characters
+    ENFORCE(!slcan::parseFrame("t12G0", f));                    // Invalid digit in the ID
+    ENFORCE(!slcan::parseFrame("t1231G0", f));                  // Invalid digit in the data
+    ENFORCE(!slcan::parseFrame("t8000", f));                    // ID wider than 11 bits
+    ENFORCE(!slcan::parseFrame("T200000000", f));               // ID wider than 29 bits
+    ENFORCE(!slcan::parseFrame("r1230AA", f));                  // RTR frames carry no data
+}
+
+TEST_CASE(SLCANRoundTrip)
+{
+    std::mt19937 rng(3);
+    const Options options;
+    for (unsigned i = 0; i < 1000000; i++)
+    {
+        can::Frame frame = makeRandomFrame(rng);
+        if (frame.isRemoteTransmissionRequest())
+        {
+            frame.dlc = 0;                                      // The encoder reports the DLC of RTR frames as is
+        }
+        can::RxFrame rxf;
+        rxf.setFrame(frame);
+
+        std::string s = encode(options, rxf);
+        ENFORCE(!s.empty() && (s.back() == '\r'));
+        s.pop_back();
+
+        can::Frame parsed;
+        ENFORCE(slcan::parseFrame(s.c_str(), parsed));
+        ENFORCE(sameFrame(parsed, frame));
+    }
+}
+
+TEST_CASE(BinaryCRC)
+{
+    binary_protocol::CRC16 crc;
+    crc.add(reinterpret_cast<const std::uint8_t*>("123456789"), 9);
+    ENFORCE(crc.get() == 0x29B1);                               // CRC-16/CCITT-FALSE check value
+}
+
+TEST_CASE(BinaryFrameRecordsRoundTrip)
+{
+    static constexpr unsigned MaxRecords = 16;
+    std::mt19937 rng(4);
+
+    for (unsigned i = 0; i < 10000; i++)
+    {
+        const unsigned num_records = 1 + rng() % MaxRecords;
+        can::RxFrame frames[MaxRecords];
+        std::uint8_t buf[binary_protocol::predictMaxEncodedPacketSize(binary_protocol::MaxFrameRecordSize *
+                                                                      MaxRecords)] = {};
+
+        binary_protocol::PacketEncoder encoder(&buf[0], binary_protocol::PacketType::CANFrames);
+        for (unsigned k = 0; k < num_records; k++)
+        {
+            frames[k].setFrame(makeRandomFrame(rng));
+            frames[k].timestamp_usec = rng() % can::TimestampRolloverIntervalUSec;
+            frames[k].loopback = rng() & 1;
+            encoder.addFrameRecord(frames[k]);
+        }
+        const unsigned size = encoder.finalize();
+        ENFORCE(size <= sizeof(buf));
+
+        // The delimiter occurs only at the end
+        ENFORCE(buf[size - 1] == binary_protocol::PacketDelimiter);
+        ENFORCE(std::count(&buf[0], &buf[size - 1], 0) == 0);
+
+        binary_protocol::PacketType type = binary_protocol::PacketType::Text;
+        const int payload_len = binary_protocol::decodePacket(&buf[0], size - 1, type);
+        ENFORCE(payload_len > 0);
+        ENFORCE(type == binary_protocol::PacketType::CANFrames);
+
+        const std::uint8_t* ptr = &buf[1];
+        const std::uint8_t* const end = ptr + payload_len;
+        for (unsigned k = 0; k < num_records; k++)
+        {
+            ENFORCE(std::uint32_t(ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) | (std::uint32_t(ptr[3]) << 24)) ==
+                    frames[k].timestamp_usec);
+            ENFORCE(((ptr[8] & binary_protocol::FrameRecordFlagLoopback) != 0) == frames[k].loopback);
+
+            can::Frame parsed;
+            ENFORCE(binary_protocol::parseFrameRecord(ptr, end, parsed));
+            ENFORCE(sameFrame(parsed, frames[k].getFrame()));
+        }
+        ENFORCE(ptr == end);
+
+        can::Frame dummy;
+        ENFORCE(!binary_protocol::parseFrameRecord(ptr, end, dummy));
+    }
+}
+
+TEST_CASE(BinaryLongPacketAndCorruption)
+{
+    // Longer than one COBS block, with zeros and runs of non-zero bytes
+    std::uint8_t payload[600] = {};
+    for (unsigned i = 0; i < sizeof(payload); i++)
+    {
+        payload[i] = (i < 300) ? std::uint8_t(1 + i % 255) : std::uint8_t((i % 7 == 0) ? 0 : i);
+    }
+
+    std::uint8_t buf[binary_protocol::predictMaxEncodedPacketSize(sizeof(payload))] = {};
+    binary_protocol::PacketEncoder encoder(&buf[0], binary_protocol::PacketType::Text);
+    encoder.add(&payload[0], sizeof(payload));
+    const unsigned size = encoder.finalize();
+    ENFORCE(size <= sizeof(buf));
+    ENFORCE(std::count(&buf[0], &buf[size - 1], 0) == 0);
+
+    std::uint8_t copy[sizeof(buf)] = {};
+    std::memcpy(&copy[0], &buf[0], size);
+    binary_protocol::PacketType type = binary_protocol::PacketType::CANFrames;
+    ENFORCE(binary_protocol::decodePacket(&copy[0], size - 1, type) == int(sizeof(payload)));
+    ENFORCE(type == binary_protocol::PacketType::Text);
+    ENFORCE(std::memcmp(&copy[1], &payload[0], sizeof(payload)) == 0);
+
+    // Any single bit error is detected
+    for (unsigned i = 0; i < (size - 1); i++)
+    {
+        for (unsigned bit = 0; bit < 8; bit++)
+        {
+            std::memcpy(&copy[0], &buf[0], size);
+            copy[i] ^= std::uint8_t(1U << bit);
+            ENFORCE(binary_protocol::decodePacket(&copy[0], size - 1, type) < 0);
+        }
+    }
+
+    // Truncated packets are rejected
+    std::memcpy(&copy[0], &buf[0], size);
+    ENFORCE(binary_protocol::decodePacket(&copy[0], 2, type) < 0);
+}
@@ -0,0 +1,623 @@
+#!/usr/bin/env python3
+#
+# Copyright (C) 2016 Zubax Robotics <info@zubax.com>
+#
+# This program is free software: you can redistribute it and/or modify it under the terms of the
+# GNU General Public License as published by the Free Software Foundation, either version 3 of the License,
+# or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+# without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+# See the GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along with this program.
+# If not, see <http://www.gnu.org/licenses/>.
+#
+# Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+#
+
+import sys
+import time
+import json
+import struct
+import logging
+import argparse
+import platform
+import threading
+import collections
+import datetime
+import serial
+
+
+BITRATES = {
+    0: 10000,
+    1: 20000,
+    2: 50000,
+    3: 100000,
+    4: 125000,
+    5: 250000,
+    6: 500000,
+    7: 800000,
+    8: 1000000,
+}
+
+# Metrics that are compared by the compare command; True if the bigger value is better
+REGRESSION_METRICS = {
+    'rx_frames_per_sec': True,
+    'dropped_frames': False,
+    'host_latency_usec.p99': False,
+    'rx_stat.rx_latency_usec.p99': False,
+    'rx_stat.sw_rx_queue_overruns': False,
+    'rx_stat.hw_rx_queue_overruns': False,
+}
+
+END_OF_MULTILINE_RESPONSE = b'\x03\r\n'
+
+FLAG_EFF = 1 << 31
+FLAG_RTR = 1 << 30
+
+PACKET_TYPE_CAN_FRAMES = 0x01
+PACKET_TYPE_TEXT = 0x02
+
+FRAME_RECORD_FLAG_LOOPBACK = 0x80
+
+MAX_FRAMES_PER_PACKET = 10          # The device accepts encoded packets up to 200 bytes long
+
+TIMESTAMP_WRAP_USEC = 60 * 1000 * 1000
+
+
+logger = logging.getLogger('benchmark')
+
+
+#
+# Binary protocol, see firmware/src/binary_protocol.hpp
+#
+def crc16(data):
+    crc = 0xFFFF
+    for b in data:
+        crc ^= b << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if (crc & 0x8000) else (crc << 1)
+            crc &= 0xFFFF
+    return crc
+
+
+def cobs_encode(data):
+    out = bytearray()
+    block = bytearray()
+    for b in data:
+        if b == 0:
+            out.append(len(block) + 1)
+            out += block
+            block = bytearray()
+        else:
+            block.append(b)
+            if len(block) == 254:
+                out.append(255)
+                out += block
+                block = bytearray()
+    out.append(len(block) + 1)
+    out += block
+    return bytes(out)
+
+
+def cobs_decode(data):
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        code = data[i]
+        i += 1
+        if code == 0 or i + code - 1 > len(data):
+            return None
+        out += data[i:i + code - 1]
+        i += code - 1
+        if code < 0xFF and i < len(data):
+            out.append(0)
+    return bytes(out)
+
+
+def encode_packet(packet_type, payload):
+    body = bytes([packet_type]) + bytes(payload)
+    return cobs_encode(body + struct.pack('<H', crc16(body))) + b'\x00'
+
+
+def decode_packet(encoded):
+    """Returns (type, payload) or None if the packet is malformed."""
+    body = cobs_decode(encoded)
+    if body is None or len(body) < 3:
+        return None
+    if crc16(body[:-2]) != struct.unpack('<H', body[-2:])[0]:
+        return None
+    return body[0], body[1:-2]
+
+
+#
+# Device link
+#
+Frame = collections.namedtuple('Frame', ['id', 'data', 'timestamp_usec', 'loopback', 'host_timestamp'])
+
+
+class Babel:
+    """
+    Drives one Babel over SLCAN, either in the ASCII or in the binary encoding.
+    A background thread parses everything the device sends; the received frames and the number of positive and
+    negative responses are accumulated until collected by the caller.
+    """
+
+    def __init__(self, port, baudrate):
+        self.name = port
+        self._port = serial.Serial(port, baudrate=baudrate, timeout=0.01)
+        self._binary = False
+        self._lock = threading.Lock()
+        self._frames = []
+        self._num_acks = 0
+        self._num_nacks = 0
+        self._text = bytearray()
+        self._keep_going = True
+        self._thread = threading.Thread(target=self._reader, name='reader:' + port, daemon=True)
+        self._thread.start()
+
+    def close(self):
+        self._keep_going = False
+        self._thread.join()
+        self._port.close()
+
+    def _reader(self):
+        buf = bytearray()
+        while self._keep_going:
+            chunk = self._port.read(max(1, self._port.in_waiting))
+            if not chunk:
+                continue
+            host_ts = time.monotonic()
+            buf += chunk
+            if self._binary:
+                *packets, buf = buf.split(b'\x00')
+                for p in packets:
+                    self._handle_packet(p, host_ts)
+            else:
+                buf = self._handle_ascii(buf, host_ts)
+
+    def _handle_packet(self, encoded, host_ts):
+        decoded = decode_packet(encoded)
+        if decoded is None:
+            logger.warning('%s: malformed packet %r', self.name, encoded)
+            return
+        packet_type, payload = decoded
+        if packet_type == PACKET_TYPE_CAN_FRAMES:
+            frames = []
+            while len(payload) >= 9:
+                ts, can_id, dlc_flags = struct.unpack('<IIB', payload[:9])
+                dlc = dlc_flags & 0x0F
+                frames.append(Frame(can_id, bytes(payload[9:9 + dlc]), ts,
+                                    (dlc_flags & FRAME_RECORD_FLAG_LOOPBACK) != 0, host_ts))
+                payload = payload[9 + dlc:]
+            with self._lock:
+                self._frames += frames
+        elif packet_type == PACKET_TYPE_TEXT:
+            self._handle_ascii(bytearray(payload), host_ts, is_whole=True)
+
+    def _handle_ascii(self, buf, host_ts, is_whole=False):
+        """Returns the unprocessed remainder of the buffer."""
+        with self._lock:
+            while buf:
+                if self._text or buf[:1] not in (b't', b'T', b'r', b'R', b'z', b'Z', b'\r', b'\a', b'Q'):
+                    # Multi-line responses are accumulated separately until the end marker
+                    self._text += buf
+                    buf = bytearray()
+                    break
+                if buf[:1] == b'\a':
+                    self._num_nacks += 1
+                    buf = buf[1:]
+                    continue
+                end = buf.find(b'\r')
+                if end < 0:
+                    if is_whole:
+                        logger.warning('%s: unterminated response %r', self.name, buf)
+                        buf = bytearray()
+                    break
+                line, buf = bytes(buf[:end]), buf[end + 1:]
+                if line in (b'', b'z', b'Z'):
+                    self._num_acks += 1
+                elif line[:1] == b'Q':
+                    pass                                        # TX credits are not used by the benchmark
+                elif line[:1] in (b't', b'T', b'r', b'R'):
+                    frame = self._parse_ascii_frame(line, host_ts)
+                    if frame is not None:
+                        self._frames.append(frame)
+                else:
+                    self._text += line + b'\r'
+        return buf
+
+    @staticmethod
+    def _parse_ascii_frame(line, host_ts):
+        try:
+            text = line.decode()
+            extended = text[0].isupper()
+            id_len = 8 if extended else 3
+            can_id = int(text[1:1 + id_len], 16) | (FLAG_EFF if extended else 0)
+            dlc = int(text[1 + id_len])
+            ptr = 2 + id_len
+            if text[0] in 'rR':
+                can_id |= FLAG_RTR
+                data = b''
+            else:
+                data = bytes.fromhex(text[ptr:ptr + dlc * 2])
+                ptr += dlc * 2
+            loopback = text.endswith('L')
+            ts_text = text[ptr:len(text) - (1 if loopback else 0)]
+            # The benchmark uses the extended timestamps; the short ones are milliseconds
+            timestamp = int(ts_text, 16) if len(ts_text) == 16 else int(ts_text, 16) * 1000 if ts_text else None
+            return Frame(can_id, data, timestamp, loopback, host_ts)
+        except (ValueError, IndexError):
+            logger.warning('Malformed frame %r', line)
+
+    def collect(self):
+        """Returns the frames received and the responses counted since the last call, then forgets them."""
+        with self._lock:
+            out = self._frames, self._num_acks, self._num_nacks
+            self._frames, self._num_acks, self._num_nacks = [], 0, 0
+        return out
+
+    def _write_command(self, cmd):
+        if self._binary:
+            self._port.write(encode_packet(PACKET_TYPE_TEXT, cmd.encode()))
+        else:
+            self._port.write(cmd.encode() + b'\r')
+
+    def command(self, cmd, timeout=1.0):
+        """Executes a single-line command, returns True if it succeeded."""
+        self.collect()
+        with self._lock:
+            self._text = bytearray()
+        self._write_command(cmd)
+        deadline = time.monotonic() + timeout
+        while time.monotonic() < deadline:
+            with self._lock:
+                if self._num_acks or self._num_nacks:
+                    ok = self._num_acks > 0
+                    self._num_acks, self._num_nacks = 0, 0
+                    return ok
+            time.sleep(0.005)
+        raise TimeoutError('%s: no response to %r' % (self.name, cmd))
+
+    def ensure(self, cmd):
+        if not self.command(cmd):
+            raise RuntimeError('%s: command %r failed' % (self.name, cmd))
+
+    def multiline_command(self, cmd, timeout=3.0):
+        """Executes a command with a multi-line output, e.g. stat; only available in the ASCII encoding."""
+        assert not self._binary
+        with self._lock:
+            self._text = bytearray()
+        self._write_command(cmd)
+        deadline = time.monotonic() + timeout
+        while time.monotonic() < deadline:
+            with self._lock:
+                end = self._text.find(END_OF_MULTILINE_RESPONSE)
+                if end >= 0:
+                    out = bytes(self._text[:end]).decode(errors='replace')
+                    self._text = bytearray()
+                    lines = out.replace('\r', '').split('\n')
+                    # The output is preceded by the echo of the command
+                    return lines[lines.index(cmd) + 1:] if cmd in lines else lines
+            time.sleep(0.01)
+        raise TimeoutError('%s: no response to %r' % (self.name, cmd))
+
+    def set_binary(self, binary):
+        # The response is sent in the old encoding, so the reader is switched only after the response arrived
+        self.ensure('B1' if binary else 'B0')
+        with self._lock:
+            self._binary = binary
+
+    def send_frames(self, frames):
+        """Frames are tuples (id, data), where the ID contains the flags, see can::Frame."""
+        if self._binary:
+            out = bytearray()
+            for i in range(0, len(frames), MAX_FRAMES_PER_PACKET):
+                payload = b''.join(struct.pack('<IIB', 0, can_id, len(data)) + data
+                                   for can_id, data in frames[i:i + MAX_FRAMES_PER_PACKET])
+                out += encode_packet(PACKET_TYPE_CAN_FRAMES, payload)
+            self._port.write(out)
+        else:
+            lines = []
+            for can_id, data in frames:
+                if can_id & FLAG_EFF:
+                    lines.append('T%08X%d%s\r' % (can_id & 0x1FFFFFFF, len(data), data.hex().upper()))
+                else:
+                    lines.append('t%03X%d%s\r' % (can_id & 0x7FF, len(data), data.hex().upper()))
+            self._port.write(''.join(lines).encode())
+
+    def read_stat(self):
+        return parse_key_value_lines(self.multiline_command('stat'))
+
+    def read_zubax_id(self):
+        return parse_key_value_lines(self.multiline_command('zubax_id'))
+
+
+def parse_key_value_lines(lines):
+    """
+    Parses the output of stat and zubax_id. Numbers are converted, latency histograms are parsed into dicts.
+    """
+    out = {}
+    for line in lines:
+        key, sep, value = line.partition(':')
+        if not sep:
+            continue
+        key, value = key.strip(), value.strip()
+        if key.endswith('_buckets'):
+            out[key] = {int(k): int(v) for k, v in (x.split(':') for x in value.split())}
+        elif '=' in value:
+            out[key] = {k: int(v) for k, v in (x.split('=') for x in value.split())}
+        elif value.startswith("'"):
+            out[key] = value.strip("'")
+        else:
+            for conv in (int, float):
+                try:
+                    value = conv(value.rstrip('%'))
+                    break
+                except ValueError:
+                    pass
+            out[key] = value
+    return out
+
+
+#
+# Benchmark
+#
+def compute_frame_bits(dlc, extended):
+    """Nominal frame length in bits, including the interframe space and excluding the stuff bits."""
+    return (67 if extended else 47) + dlc * 8
+
+
+def percentiles(values):
+    if not values:
+        return None
+    values = sorted(values)
+
+    def pick(p):
+        return values[min(len(values) - 1, int(len(values) * p / 100))]
+
+    return {
+        'count': len(values),
+        'min': values[0],
+        'p50': pick(50),
+        'p90': pick(90),
+        'p99': pick(99),
+        'max': values[-1],
+    }
+
+
+def compute_host_latencies(frames):
+    """
+    The device clock is not synchronized with the host clock, so the latency is reported relative to the smallest
+    observed delay between the device timestamp and the moment the host received the frame. This excludes the
+    constant part of the delay, but shows the queuing and the USB scheduling delays, which is what matters when
+    comparing builds. Short timestamps wrap around every minute, they are unwrapped here.
+    """
+    deltas = []
+    epoch = 0
+    prev_ts = None
+    for f in frames:
+        if f.timestamp_usec is None:
+            continue
+        ts = f.timestamp_usec
+        if ts < TIMESTAMP_WRAP_USEC:
+            if prev_ts is not None and ts + epoch < prev_ts - TIMESTAMP_WRAP_USEC // 2:
+                epoch += TIMESTAMP_WRAP_USEC
+            ts += epoch
+        prev_ts = ts
+        deltas.append(int(f.host_timestamp * 1e6) - ts)
+    if not deltas:
+        return None
+    offset = min(deltas)
+    return percentiles([d - offset for d in deltas])
+
+
+def make_payload(seq, dlc):
+    return (struct.pack('<Q', seq) * 2)[:dlc]
+
+
+def run_case(tx, rx, bitrate_index, dlc, load_percent, binary, duration, extended):
+    loopback = rx is None
+    devices = [tx] if loopback else [tx, rx]
+    bitrate = BITRATES[bitrate_index]
+    frame_bits = compute_frame_bits(dlc, extended)
+    target_fps = bitrate * load_percent / 100.0 / frame_bits
+    can_id = (0x1234567 | FLAG_EFF) if extended else 0x123
+
+    logger.info('Bitrate %d, DLC %d, load %d%%, %s: %.1f frames/s',
+                bitrate, dlc, load_percent, 'binary' if binary else 'ASCII', target_fps)
+
+    for d in devices:
+        d.set_binary(False)
+        d.ensure('C')
+        d.ensure('S%d' % bitrate_index)
+        d.ensure('Z2')
+    if loopback:
+        tx.ensure('l')
+    else:
+        rx.ensure('O')
+        tx.ensure('O')
+    for d in devices:
+        d.multiline_command('stat reset')
+        d.collect()
+        d.set_binary(binary)
+
+    def select_frames(frames):
+        # Unrelated traffic on the bus is ignored
+        return [f for f in frames if f.id == can_id and (f.loopback or not loopback)]
+
+    num_sent = 0
+    num_acks = 0
+    num_nacks = 0
+    rx_frames = []
+    started_at = time.monotonic()
+    while True:
+        elapsed = time.monotonic() - started_at
+        if elapsed >= duration:
+            break
+        owed = int(target_fps * elapsed) - num_sent
+        if owed > 0:
+            owed = min(owed, MAX_FRAMES_PER_PACKET * 4)
+            tx.send_frames([(can_id, make_payload(num_sent + i, dlc)) for i in range(owed)])
+            num_sent += owed
+        else:
+            time.sleep(0.0005)
+        frames, acks, nacks = tx.collect()
+        num_acks += acks
+        num_nacks += nacks
+        rx_frames += select_frames(frames if loopback else rx.collect()[0])
+    active_duration = time.monotonic() - started_at
+
+    # Letting the queues drain
+    time.sleep(0.5 + duration * 0.1)
+    frames, acks, nacks = tx.collect()
+    num_acks += acks
+    num_nacks += nacks
+    rx_frames += select_frames(frames if loopback else rx.collect()[0])
+
+    for d in devices:
+        d.set_binary(False)
+    tx_stat = tx.read_stat()
+    rx_stat = tx_stat if loopback else rx.read_stat()
+    for d in devices:
+        d.ensure('C')
+
+    return {
+        'bitrate': bitrate,
+        'dlc': dlc,
+        'extended_id': extended,
+        'load_percent': load_percent,
+        'encoding': 'binary' if binary else 'ascii',
+        'mode': 'loopback' if loopback else 'two_devices',
+        'duration_sec': round(active_duration, 3),
+        'target_frames_per_sec': round(target_fps, 1),
+        'tx_submitted': num_sent,
+        'tx_accepted': num_acks,
+        'tx_rejected': num_nacks,
+        'rx_frames': len(rx_frames),
+        'rx_frames_per_sec': round(len(rx_frames) / active_duration, 1),
+        'dropped_frames': num_acks - len(rx_frames),
+        'host_latency_usec': compute_host_latencies(rx_frames),
+        'tx_stat': tx_stat,
+        'rx_stat': rx_stat,
+    }
+
+
+def lookup(result, path):
+    for key in path.split('.'):
+        if not isinstance(result, dict) or key not in result:
+            return None
+        result = result[key]
+    return result
+
+
+def case_key(result):
+    return tuple(result[k] for k in ('bitrate', 'dlc', 'extended_id', 'load_percent', 'encoding', 'mode'))
+
+
+def compare_reports(old_path, new_path, tolerance_percent):
+    """Prints the changes of the key metrics, returns the number of regressions beyond the tolerance."""
+    with open(old_path) as f:
+        old = {case_key(r): r for r in json.load(f)['results']}
+    with open(new_path) as f:
+        new = json.load(f)['results']
+
+    num_regressions = 0
+    for result in new:
+        reference = old.get(case_key(result))
+        if reference is None:
+            continue
+        for metric, bigger_is_better in sorted(REGRESSION_METRICS.items()):
+            a, b = lookup(reference, metric), lookup(result, metric)
+            if a is None or b is None:
+                continue
+            change = (b - a) * 100.0 / a if a else (0.0 if a == b else float('inf'))
+            regression = (change < -tolerance_percent) if bigger_is_better else (change > tolerance_percent)
+            if regression:
+                num_regressions += 1
+            if regression or abs(change) > tolerance_percent:
+                print('%-60s %-32s %12s -> %-12s %+.1f%%%s' % (case_key(result), metric, a, b, change,
+                                                              '  REGRESSION' if regression else ''))
+    print('%d regression(s)' % num_regressions)
+    return num_regressions
+
+
+def parse_list(text, conv=int):
+    return [conv(x) for x in text.split(',') if x]
+
+
+def main():
+    parser = argparse.ArgumentParser(description='''Throughput, latency and drop rate benchmark for Zubax Babel.
+With two devices connected to the same bus, one transmits and the other receives. With one device, it is opened in
+the loopback mode (command l) and the looped back frames are measured; the bus must contain at least one other node
+that acknowledges the frames. The benchmark changes the configuration of the devices (bitrate, timestamping).''')
+    parser.add_argument('--tx', required=True, help='serial port of the transmitting device')
+    parser.add_argument('--rx', help='serial port of the receiving device; if omitted, the loopback mode is used')
+    parser.add_argument('--baudrate', type=int, default=115200, help='serial port baud rate, ignored by USB')
+    parser.add_argument('--bitrates', default='0,1,2,3,4,5,6,7,8', help='comma separated SLCAN bitrate indexes')
+    parser.add_argument('--dlcs', default='0,8', help='comma separated DLC values')
+    parser.add_argument('--loads', default='10,50,90', help='comma separated bus loads, in percent')
+    parser.add_argument('--encodings', default='ascii,binary', help='ascii, binary, or both')
+    parser.add_argument('--extended', action='store_true', help='use extended frame IDs')
+    parser.add_argument('--duration', type=float, default=5, help='duration of every case, in seconds')
+    parser.add_argument('--output', default='babel_benchmark_report.json', help='output report file')
+    parser.add_argument('--compare', nargs=2, metavar=('OLD', 'NEW'),
+                        help='compare two reports instead of running the benchmark')
+    parser.add_argument('--tolerance', type=float, default=10, help='regression tolerance for --compare, in percent')
+    parser.add_argument('--verbose', action='store_true')
+    args = parser.parse_args()
+
+    logging.basicConfig(level=logging.DEBUG if args.verbose else logging.INFO,
+                        format='%(asctime)s %(levelname)s %(name)s: %(message)s')
+
+    if args.compare:
+        sys.exit(1 if compare_reports(args.compare[0], args.compare[1], args.tolerance) else 0)
+
+    encodings = parse_list(args.encodings, str)
+    if any(e not in ('ascii', 'binary') for e in encodings):
+        parser.error('invalid encoding')
+    bitrates = parse_list(args.bitrates)
+    if any(b not in BITRATES for b in bitrates):
+        parser.error('invalid bitrate index')
+
+    tx = Babel(args.tx, args.baudrate)
+    rx = Babel(args.rx, args.baudrate) if args.rx else None
+    report = {
+        'created': datetime.datetime.utcnow().isoformat() + 'Z',
+        'host': platform.node(),
+        'arguments': vars(args),
+        'devices': {},
+        'results': [],
+    }
+    try:
+        for name, d in (('tx', tx), ('rx', rx)):
+            if d is not None:
+                d.set_binary(False)
+                report['devices'][name] = d.read_zubax_id()
+        if rx is None:
+            # Loopback frames can be told apart from the other traffic only by the flag
+            tx.multiline_command('cfg set slcan.flags_on 1')
+            time.sleep(0.5)                                     # The device applies the configuration asynchronously
+
+        for encoding in encodings:
+            for bitrate_index in bitrates:
+                for dlc in parse_list(args.dlcs):
+                    for load in parse_list(args.loads):
+                        result = run_case(tx, rx, bitrate_index, dlc, load, encoding == 'binary',
+                                          args.duration, args.extended)
+                        logger.info('RX %.1f frames/s, dropped %d, rejected %d, host latency %s',
+                                    result['rx_frames_per_sec'], result['dropped_frames'], result['tx_rejected'],
+                                    result['host_latency_usec'])
+                        report['results'].append(result)
+    finally:
+        with open(args.output, 'w') as f:
+            json.dump(report, f, indent=2, sort_keys=True)
+        logger.info('Report saved to %s', args.output)
+        for d in (tx, rx):
+            if d is not None:
+                d.close()
+
+
+if __name__ == '__main__':
+    main()
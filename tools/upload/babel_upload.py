@@ -0,0 +1,242 @@
+#!/usr/bin/env python3
+#
+# Copyright (C) 2016 Zubax Robotics <info@zubax.com>
+#
+# This program is free software: you can redistribute it and/or modify it under the terms of the
+# GNU General Public License as published by the Free Software Foundation, either version 3 of the License,
+# or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+# without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+# See the GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along with this program.
+# If not, see <http://www.gnu.org/licenses/>.
+#
+# Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+#
+
+import os
+import sys
+import time
+import zlib
+import struct
+import logging
+import argparse
+import serial
+import serial.tools.list_ports
+
+
+#
+# Windowed upload protocol, see bootloader/src/windowed_upload_protocol.hpp
+#
+SYNC_BYTE = 0x5A
+MAX_CHUNK_SIZE = 4096
+SEQ_MODULO = 0x10000
+RESPONSE_CODES = b'RANFE'
+
+START_TIMEOUT = 3.0
+RESPONSE_TIMEOUT = 0.5                  # Unacknowledged chunks are resent after this long without a response
+MAX_RETRIES = 10                        # Consecutive timeouts before giving up
+
+APP_DESCRIPTOR_SIGNATURE = b'APDesc00'
+
+USB_VID_PID = 0x1D50, 0x60C7            # See bootloader/src/usb_cdc.cpp
+DEFAULT_USB_WINDOW = 8
+
+
+logger = logging.getLogger('upload')
+
+
+class UploadError(Exception):
+    pass
+
+
+def make_chunk(seq, data):
+    header = struct.pack('<HH', seq % SEQ_MODULO, len(data))
+    return bytes([SYNC_BYTE]) + header + data + struct.pack('<I', zlib.crc32(header + data) & 0xFFFFFFFF)
+
+
+def is_native_usb_port(port):
+    """
+    Chunks can be sent ahead only over the native USB port of the device: USB flow control holds the data while
+    the bootloader erases flash, whereas a UART (including USB-UART adapters) loses the bytes that arrive meanwhile.
+    """
+    path = os.path.realpath(port)
+    for p in serial.tools.list_ports.comports():
+        if os.path.realpath(p.device) == path:
+            return (p.vid, p.pid) == USB_VID_PID
+    return False
+
+
+def read_image_crc(image):
+    """Returns the image CRC from the application descriptor, or None if there is no descriptor or it is not set."""
+    pos = image.find(APP_DESCRIPTOR_SIGNATURE)
+    if pos < 0 or pos + 16 > len(image):
+        return None
+    crc = struct.unpack_from('<Q', image, pos + len(APP_DESCRIPTOR_SIGNATURE))[0]
+    return crc or None
+
+
+class Uploader:
+    def __init__(self, port, baudrate, window):
+        self._port = serial.Serial(port, baudrate=baudrate, timeout=RESPONSE_TIMEOUT)
+        self._window = window
+
+    def close(self):
+        self._port.close()
+
+    def _read_response(self, timeout):
+        """Returns (code, seq), or None on timeout; the bytes that are not responses are skipped."""
+        deadline = time.monotonic() + timeout
+        while time.monotonic() < deadline:
+            code = self._port.read(1)
+            if not code or code not in RESPONSE_CODES:
+                continue
+            seq = self._port.read(2)
+            if len(seq) == 2:
+                return chr(code[0]), struct.unpack('<H', seq)[0]
+        return None
+
+    def _read_line(self, timeout):
+        deadline = time.monotonic() + timeout
+        line = bytearray()
+        while time.monotonic() < deadline:
+            c = self._port.read(1)
+            if c == b'\n':
+                return line.decode('ascii', 'replace').strip()
+            line += c
+        return None
+
+    def _start(self):
+        self._port.reset_input_buffer()
+        self._port.write(b'\r\nwait\r\nupload\r\n')             # Cancel the boot, then start the upload
+        deadline = time.monotonic() + START_TIMEOUT
+        while time.monotonic() < deadline:
+            r = self._read_response(deadline - time.monotonic())
+            if r == ('R', 0):
+                return
+        raise UploadError('The bootloader did not respond; make sure it is running and the port is right')
+
+    def _send_chunks(self, chunks):
+        """Sends the chunks using the go-back-N scheme; returns when all of them are acknowledged."""
+        base = 0                            # Oldest unacknowledged chunk
+        next_index = 0                      # Next chunk to send
+        retries = 0
+        while base < len(chunks):
+            while next_index < min(base + self._window, len(chunks)):
+                self._port.write(make_chunk(next_index, chunks[next_index]))
+                next_index += 1
+
+            r = self._read_response(RESPONSE_TIMEOUT)
+            if r is None:
+                retries += 1
+                if retries > MAX_RETRIES:
+                    raise UploadError('No response from the bootloader')
+                logger.debug('Timeout, resending from %d', base)
+                next_index = base
+                continue
+
+            code, seq = r
+            index = base + (seq - base) % SEQ_MODULO      # The sequence number wraps around
+            if code == 'A':
+                if index < next_index:
+                    base = max(base, index + 1)
+                    retries = 0
+            elif code == 'N':
+                if index <= next_index:
+                    logger.debug('NAK, resending from %d', index)
+                    base = index
+                    next_index = index
+            elif code == 'E':
+                raise UploadError('The bootloader aborted the upload at chunk %d' % index)
+            else:
+                logger.debug('Unexpected response %r', r)
+
+    def _finish(self, num_chunks):
+        for _ in range(MAX_RETRIES):
+            self._port.write(make_chunk(num_chunks, b''))
+            while True:
+                r = self._read_response(RESPONSE_TIMEOUT)
+                if r is None or r == ('F', num_chunks % SEQ_MODULO):
+                    break
+                if r[0] == 'E':
+                    raise UploadError('The bootloader aborted the upload at the end of the image')
+            if r is not None:
+                return
+        raise UploadError('The end of the image was not acknowledged')
+
+    def upload(self, image):
+        """Returns the image CRC reported by the bootloader."""
+        chunks = [image[i:i + MAX_CHUNK_SIZE] for i in range(0, len(image), MAX_CHUNK_SIZE)]
+        self._start()
+        started_at = time.monotonic()
+        self._send_chunks(chunks)
+        self._finish(len(chunks))
+        elapsed = time.monotonic() - started_at
+        logger.info('%d bytes sent in %.2f s, %.1f KB/s', len(image), elapsed, len(image) / elapsed / 1024)
+
+        # The bootloader verifies the image and reports the result as text
+        while True:
+            line = self._read_line(START_TIMEOUT)
+            if line is None:
+                raise UploadError('The bootloader did not report the result')
+            if line.startswith('ERROR'):
+                raise UploadError('The bootloader rejected the image: ' + line)
+            if line.startswith('image_crc:'):
+                return int(line.split(':')[1], 16)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='''Uploads the application image to Zubax Babel using the windowed
+upload protocol of the bootloader (command upload), which is much faster than YMODEM (command download).
+The device must be running the bootloader, e.g. after the application command bootloader.''')
+    parser.add_argument('port', help='serial port of the bootloader')
+    parser.add_argument('image', help='application image, e.g. build/com.zubax.babel.application.bin')
+    parser.add_argument('--baudrate', type=int, default=115200, help='serial port baud rate, ignored by USB')
+    parser.add_argument('--window', type=int, help='maximum number of unacknowledged chunks; '
+                        'the default is %d over the native USB port of the device; always 1 over UART'
+                        % DEFAULT_USB_WINDOW)
+    parser.add_argument('--verbose', action='store_true')
+    args = parser.parse_args()
+
+    logging.basicConfig(level=logging.DEBUG if args.verbose else logging.INFO,
+                        format='%(asctime)s %(levelname)s %(name)s: %(message)s')
+
+    if args.window is not None and args.window < 1:
+        parser.error('invalid window')
+
+    # The bootloader acknowledges a chunk after writing it, and erasing flash stalls the CPU; see the protocol header
+    if is_native_usb_port(args.port):
+        window = args.window or DEFAULT_USB_WINDOW
+    else:
+        if args.window is not None and args.window > 1:
+            logger.warning('Not the native USB port of the device, the window is reduced to 1')
+        window = 1
+
+    with open(args.image, 'rb') as f:
+        image = f.read()
+    if not image:
+        parser.error('the image is empty')
+
+    uploader = Uploader(args.port, args.baudrate, window)
+    try:
+        reported_crc = uploader.upload(image)
+    except UploadError as ex:
+        logger.error('%s', ex)
+        sys.exit(1)
+    finally:
+        uploader.close()
+
+    expected_crc = read_image_crc(image)
+    if expected_crc is None:
+        logger.info('Image CRC 0x%016x; the image has no application descriptor to compare with', reported_crc)
+    elif expected_crc != reported_crc:
+        logger.error('Image CRC mismatch: 0x%016x reported, 0x%016x expected', reported_crc, expected_crc)
+        sys.exit(1)
+    else:
+        logger.info('Image CRC 0x%016x verified', reported_crc)
+
+
+if __name__ == '__main__':
+    main()